@@ -0,0 +1,536 @@
+/*Archival of the files a rolling sink is done with
+    1、Compression with a bundled LZ4 block compressor, written as a standard .lz4 frame: lz4 -d or lz4cat read it
+    2、Retention: the oldest closed files are deleted beyond a file count, a total size, or an age
+    3、One thread per archiver, at the lowest CPU and I/O priority, reading and writing past the page cache
+    4、Counters of what was done, read with RollBySizeSink::archiveStats() / RollByTimeSink::archiveStats()
+    Rolled file names sort in creation order: every file of the sink sorting before the current one is closed.
+    Files left uncompressed by an earlier run, or by a stop in the middle of a file, are picked up on start.
+        Logs::ArchiveConfig archive;
+        archive._compress = true;
+        archive._max_bytes = 1024 * 1024 * 1024;
+        builder->buildSink<Logs::RollBySizeSink>("./logs/roll-", 64 * 1024 * 1024, Logs::FileConfig(), archive);
+*/
+
+#ifndef __M_ARCHIVE_H__
+#define __M_ARCHIVE_H__
+
+#include "util.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+namespace Logs
+{
+    //LZ4 block format and the frame around it, compression only
+    class Lz4
+    {
+    public:
+        enum
+        {
+            BLOCK_SIZE = 1024 * 1024,//Announced in the frame header as the 1MB maximum
+            HEADER_SIZE = 7
+        };
+
+        static size_t blockBound(size_t len) {return len + len / 255 + 16; }
+
+        //Frame header: magic, FLG (version 1, independent blocks, no checksums), BD (1MB blocks), header checksum
+        static size_t frameHeader(char* out)
+        {
+            uint8_t* o = (uint8_t*)out;
+            write32(o, 0x184D2204);
+            o[4] = 0x60;
+            o[5] = 0x60;
+            o[6] = (xxh32(o + 4, 2, 0) >> 8) & 0xFF;
+            return HEADER_SIZE;
+        }
+
+        //Block size field and the block, stored as is when compression doesn't pay. out holds 4 + blockBound(len)
+        static size_t frameBlock(const char* src, size_t len, char* out, uint32_t* table)
+        {
+            size_t n = compressBlock((const uint8_t*)src, len, (uint8_t*)out + 4, table);
+            if (n >= len)
+            {
+                memcpy(out + 4, src, len);
+                write32((uint8_t*)out, (uint32_t)len | 0x80000000u);
+                return len + 4;
+            }
+            write32((uint8_t*)out, (uint32_t)n);
+            return n + 4;
+        }
+
+        //End mark: a block of size 0
+        static size_t frameEnd(char* out)
+        {
+            write32((uint8_t*)out, 0);
+            return 4;
+        }
+
+        enum {HASH_LOG = 12};
+        //Greedy matching over a hash of the next 4 bytes. table: 1 << HASH_LOG entries
+        static size_t compressBlock(const uint8_t* src, size_t len, uint8_t* dst, uint32_t* table)
+        {
+            //The format wants the last 5 bytes as literals, and no match starting in the last 12
+            const size_t LAST_LITERALS = 5, MATCH_LIMIT = 12, MIN_MATCH = 4;
+            uint8_t* op = dst;
+            size_t anchor = 0, ip = 0;
+            if (len > MATCH_LIMIT)
+            {
+                memset(table, 0, sizeof(uint32_t) << HASH_LOG);
+                size_t match_end = len - LAST_LITERALS;
+                while (ip + MATCH_LIMIT <= len)
+                {
+                    uint32_t seq = read32(src + ip);
+                    uint32_t h = (seq * 2654435761u) >> (32 - HASH_LOG);
+                    size_t cand = table[h];
+                    table[h] = (uint32_t)ip;
+                    if (cand >= ip || ip - cand > 65535 || read32(src + cand) != seq)
+                    {
+                        //Skip faster through data that doesn't compress
+                        ip += 1 + ((ip - anchor) >> 6);
+                        continue;
+                    }
+                    size_t mlen = MIN_MATCH;
+                    while (ip + mlen < match_end && src[cand + mlen] == src[ip + mlen]) ++mlen;
+                    op = sequence(op, src + anchor, ip - anchor, ip - cand, mlen - MIN_MATCH);
+                    ip += mlen;
+                    anchor = ip;
+                }
+            }
+            //Last literals, a token without a match
+            size_t lit = len - anchor;
+            *op++ = (uint8_t)((lit < 15 ? lit : 15) << 4);
+            op = length(op, lit);
+            memcpy(op, src + anchor, lit);
+            op += lit;
+            return op - dst;
+        }
+
+        static uint32_t xxh32(const void* data, size_t len, uint32_t seed)
+        {
+            const uint32_t P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u, P4 = 668265263u, P5 = 374761393u;
+            const uint8_t* p = (const uint8_t*)data;
+            const uint8_t* end = p + len;
+            uint32_t h;
+            if (len >= 16)
+            {
+                uint32_t v[4] = {seed + P1 + P2, seed + P2, seed, seed - P1};
+                for (; p + 16 <= end; p += 16)
+                {
+                    for (int i = 0; i < 4; ++i) v[i] = rotl(v[i] + read32(p + 4 * i) * P2, 13) * P1;
+                }
+                h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            }
+            else h = seed + P5;
+            h += (uint32_t)len;
+            for (; p + 4 <= end; p += 4) h = rotl(h + read32(p) * P3, 17) * P4;
+            for (; p < end; ++p) h = rotl(h + *p * P5, 11) * P1;
+            h ^= h >> 15;
+            h *= P2;
+            h ^= h >> 13;
+            h *= P3;
+            h ^= h >> 16;
+            return h;
+        }
+    private:
+        static uint8_t* sequence(uint8_t* op, const uint8_t* lit, size_t lit_len, size_t offset, size_t mlen)
+        {
+            *op++ = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) | (mlen < 15 ? mlen : 15));
+            op = length(op, lit_len);
+            memcpy(op, lit, lit_len);
+            op += lit_len;
+            *op++ = (uint8_t)(offset & 0xFF);
+            *op++ = (uint8_t)(offset >> 8);
+            return length(op, mlen);
+        }
+
+        //What doesn't fit in the 4 bits of the token: bytes of 255, then the rest
+        static uint8_t* length(uint8_t* op, size_t len)
+        {
+            if (len < 15) return op;
+            for (len -= 15; len >= 255; len -= 255) *op++ = 255;
+            *op++ = (uint8_t)len;
+            return op;
+        }
+
+        static uint32_t read32(const uint8_t* p)
+        {
+            return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+
+        static void write32(uint8_t* p, uint32_t v)
+        {
+            p[0] = (uint8_t)v;
+            p[1] = (uint8_t)(v >> 8);
+            p[2] = (uint8_t)(v >> 16);
+            p[3] = (uint8_t)(v >> 24);
+        }
+
+        static uint32_t rotl(uint32_t v, int r) {return (v << r) | (v >> (32 - r)); }
+    };
+
+    struct ArchiveConfig
+    {
+        ArchiveConfig() : _compress(false), _max_files(0), _max_bytes(0), _max_age(0), _check_interval(60) {}
+
+        //Nothing to do: the rolling sink starts no archiver
+        bool enabled() const {return _compress || _max_files > 0 || _max_bytes > 0 || _max_age.count() > 0; }
+
+        bool _compress;//Closed files become <name>.lz4
+        //Limits on the closed files, compressed or not, 0: no limit. The file being written isn't counted
+        size_t _max_files;
+        size_t _max_bytes;
+        std::chrono::seconds _max_age;//Last modification
+        std::chrono::seconds _check_interval;//Age limit checked at least this often when no file rolls
+    };
+
+    struct ArchiveStats
+    {
+        ArchiveStats() : _pending(0), _compressed(0), _bytes_in(0), _bytes_out(0), _deleted(0), _bytes_deleted(0), _failures(0) {}
+
+        size_t _pending;//Closed files waiting for compression
+        size_t _compressed;
+        size_t _bytes_in;//Size of the files compressed
+        size_t _bytes_out;//Size of their archives
+        size_t _deleted;//Files removed by retention
+        size_t _bytes_deleted;
+        size_t _failures;
+    };
+
+    class Archiver
+    {
+    public:
+        //basename as given to the rolling sink, suffix is the extension of its files
+        Archiver(const std::string& basename, const std::string& suffix, const ArchiveConfig& config)
+            : _config(config), _dir(LogUtil::File::path(basename)), _suffix(suffix), _sweep(false), _stop(false)
+            , _pending(0), _compressed(0), _bytes_in(0), _bytes_out(0), _deleted(0), _bytes_deleted(0), _failures(0)
+        {
+            size_t pos = basename.find_last_of("/\\");
+            _prefix = pos == std::string::npos ? basename : basename.substr(pos + 1);
+            if (_dir.empty() || (_dir[_dir.size() - 1] != '/' && _dir[_dir.size() - 1] != '\\')) _dir += "/";
+            _thread = std::thread(&Archiver::archive_loop, this);
+        }
+
+        //Stops after the file in hand, the rest is done by the next archiver on these files
+        ~Archiver()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _cond.notify_all();
+            _thread.join();
+        }
+
+        Archiver(const Archiver&) = delete;
+        Archiver& operator=(const Archiver&) = delete;
+
+        //The sink writes to pathname from now on, the file it wrote before is closed
+        void current(const std::string& pathname)
+        {
+            std::string name = pathname.substr(pathname.find_last_of("/\\") + 1);
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (name == _current) return ;
+                if (_current.empty()) _sweep = true;
+                if (_current.empty() == false && _config._compress)
+                {
+                    _queue.push_back(_current);
+                    _pending.fetch_add(1, std::memory_order_relaxed);
+                }
+                _current = name;
+            }
+            _cond.notify_all();
+        }
+
+        ArchiveStats stats()
+        {
+            ArchiveStats st;
+            st._pending = _pending.load(std::memory_order_relaxed);
+            st._compressed = _compressed.load(std::memory_order_relaxed);
+            st._bytes_in = _bytes_in.load(std::memory_order_relaxed);
+            st._bytes_out = _bytes_out.load(std::memory_order_relaxed);
+            st._deleted = _deleted.load(std::memory_order_relaxed);
+            st._bytes_deleted = _bytes_deleted.load(std::memory_order_relaxed);
+            st._failures = _failures.load(std::memory_order_relaxed);
+            return st;
+        }
+    private:
+        struct Entry
+        {
+            std::string _name;//Without ".lz4"
+            bool _archived;
+            size_t _size;
+            time_t _mtime;
+            bool operator<(const Entry& e) const {return _name < e._name; }
+        };
+
+        void archive_loop()
+        {
+            LogUtil::Thread::setName("log-archive");
+            lowerPriority();
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_stop == false)
+            {
+                if (_queue.empty() && _sweep == false)
+                {
+                    if (_config._max_age.count() > 0 && _config._check_interval.count() > 0)
+                        _cond.wait_for(lock, _config._check_interval);
+                    else
+                        _cond.wait(lock);
+                    if (_stop) break;
+                    if (_queue.empty() && _sweep == false && _current.empty() == false)
+                    {
+                        //Timed out: only the age limit can have changed anything
+                        lock.unlock();
+                        retain();
+                        lock.lock();
+                    }
+                    continue;
+                }
+                bool sweep = _sweep;
+                std::string name;
+                if (sweep) _sweep = false;
+                else
+                {
+                    name = _queue.front();
+                    _queue.pop_front();
+                }
+                lock.unlock();
+                if (sweep) sweepLeftovers();
+                else
+                {
+                    compress(name);
+                    _pending.fetch_sub(1, std::memory_order_relaxed);
+                }
+                retain();
+                lock.lock();
+            }
+        }
+
+        //Nice 19 for the CPU, idle class for the I/O: both apply to this thread only on Linux
+        static void lowerPriority()
+        {
+            setpriority(PRIO_PROCESS, LogUtil::Thread::tid(), 19);
+#ifdef SYS_ioprio_set
+            const int IOPRIO_WHO_PROCESS = 1, IOPRIO_CLASS_IDLE = 3, IOPRIO_CLASS_SHIFT = 13;
+            syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+        }
+
+        std::string currentName()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _current;
+        }
+
+        //Files of the sink that are closed: they sort before the current one. A newer file may already exist,
+        //the next one is opened ahead of time
+        std::vector<Entry> closedFiles()
+        {
+            std::vector<Entry> files;
+            std::string current = currentName();
+            if (current.empty()) return files;
+            DIR* dir = opendir(_dir.c_str());
+            if (dir == nullptr) return files;
+            const std::string lz4 = ".lz4";
+            while (struct dirent* de = readdir(dir))
+            {
+                std::string name = de->d_name;
+                if (name.compare(0, _prefix.size(), _prefix) != 0) continue;
+                Entry e;
+                e._archived = false;
+                if (endsWith(name, _suffix + lz4))
+                {
+                    e._archived = true;
+                    name.resize(name.size() - lz4.size());
+                }
+                else if (endsWith(name, _suffix + lz4 + ".tmp"))
+                {
+                    //Compression stopped in the middle, the original is still there
+                    unlink((_dir + name).c_str());
+                    continue;
+                }
+                else if (endsWith(name, _suffix) == false) continue;
+                if (name >= current) continue;
+                struct stat st;
+                if (stat((_dir + de->d_name).c_str(), &st) != 0) continue;
+                e._name = name;
+                e._size = st.st_size;
+                e._mtime = st.st_mtime;
+                files.push_back(e);
+            }
+            closedir(dir);
+            std::sort(files.begin(), files.end());
+            return files;
+        }
+
+        //On start: files closed by an earlier run that weren't compressed
+        void sweepLeftovers()
+        {
+            if (_config._compress == false) return ;
+            std::vector<Entry> files = closedFiles();
+            for (size_t i = 0; i < files.size() && _stop.load(std::memory_order_relaxed) == false; ++i)
+            {
+                //A name both compressed and not: the rename happened, the unlink didn't
+                if (i + 1 < files.size() && files[i + 1]._name == files[i]._name) continue;
+                if (files[i]._archived == false) compress(files[i]._name);
+            }
+        }
+
+        //Oldest first, until every limit holds
+        void retain()
+        {
+            if (_config._max_files == 0 && _config._max_bytes == 0 && _config._max_age.count() == 0) return ;
+            std::vector<Entry> files = closedFiles();
+            size_t total = 0;
+            for (size_t i = 0; i < files.size(); ++i) total += files[i]._size;
+            time_t oldest = time(nullptr) - _config._max_age.count();
+            size_t count = files.size();
+            for (size_t i = 0; i < files.size(); ++i)
+            {
+                bool over = (_config._max_files > 0 && count > _config._max_files)
+                    || (_config._max_bytes > 0 && total > _config._max_bytes)
+                    || (_config._max_age.count() > 0 && files[i]._mtime < oldest);
+                if (over == false) break;
+                std::string path = _dir + files[i]._name + (files[i]._archived ? ".lz4" : "");
+                if (unlink(path.c_str()) != 0 && errno != ENOENT)
+                {
+                    _failures.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                --count;
+                total -= files[i]._size;
+                _deleted.fetch_add(1, std::memory_order_relaxed);
+                _bytes_deleted.fetch_add(files[i]._size, std::memory_order_relaxed);
+            }
+        }
+
+        //name -> name.lz4 through a temporary file, synced before the original is removed
+        void compress(const std::string& name)
+        {
+            std::string src_path = _dir + name;
+            std::string dst_path = src_path + ".lz4";
+            std::string tmp_path = dst_path + ".tmp";
+            int src = ::open(src_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (src < 0)
+            {
+                //Removed by retention or by hand
+                if (errno != ENOENT) _failures.fetch_add(1, std::memory_order_relaxed);
+                return ;
+            }
+            int dst = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (dst < 0)
+            {
+                ::close(src);
+                std::cout << "Log archive create failed: " << tmp_path << "\n";
+                _failures.fetch_add(1, std::memory_order_relaxed);
+                return ;
+            }
+            if (_in.empty())
+            {
+                _in.resize(Lz4::BLOCK_SIZE);
+                _out.resize(4 + Lz4::blockBound(Lz4::BLOCK_SIZE));
+                _table.resize(1 << Lz4::HASH_LOG);
+            }
+            bool ok = LogUtil::File::writeAll(dst, _out.data(), Lz4::frameHeader(_out.data()));
+            size_t in = 0, out = Lz4::HEADER_SIZE;
+            while (ok)
+            {
+                if (_stop.load(std::memory_order_relaxed))
+                {
+                    ok = false;
+                    break;
+                }
+                ssize_t n = readFull(src, _in.data(), _in.size());
+                if (n < 0) ok = false;
+                if (n <= 0) break;
+                size_t len = Lz4::frameBlock(_in.data(), n, _out.data(), _table.data());
+                ok = LogUtil::File::writeAll(dst, _out.data(), len);
+                //Nobody reads these pages again, keep the page cache for the files in use
+                posix_fadvise(src, in, n, POSIX_FADV_DONTNEED);
+                in += n;
+                out += len;
+            }
+            ok = ok && LogUtil::File::writeAll(dst, _out.data(), Lz4::frameEnd(_out.data()));
+            out += 4;
+            ok = ok && fdatasync(dst) == 0;
+            posix_fadvise(dst, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(src);
+            ::close(dst);
+            if (ok == false || rename(tmp_path.c_str(), dst_path.c_str()) != 0)
+            {
+                unlink(tmp_path.c_str());
+                if (_stop.load(std::memory_order_relaxed) == false)
+                {
+                    std::cout << "Log archive write failed: " << dst_path << "\n";
+                    _failures.fetch_add(1, std::memory_order_relaxed);
+                }
+                return ;
+            }
+            unlink(src_path.c_str());
+            _compressed.fetch_add(1, std::memory_order_relaxed);
+            _bytes_in.fetch_add(in, std::memory_order_relaxed);
+            _bytes_out.fetch_add(out, std::memory_order_relaxed);
+        }
+
+        static ssize_t readFull(int fd, char* buf, size_t len)
+        {
+            size_t got = 0;
+            while (got < len)
+            {
+                ssize_t n = ::read(fd, buf + got, len - got);
+                if (n < 0)
+                {
+                    if (errno == EINTR) continue;
+                    return -1;
+                }
+                if (n == 0) break;
+                got += n;
+            }
+            return got;
+        }
+
+        static bool endsWith(const std::string& s, const std::string& tail)
+        {
+            return s.size() >= tail.size() && s.compare(s.size() - tail.size(), tail.size(), tail) == 0;
+        }
+    private:
+        ArchiveConfig _config;
+        std::string _dir;//Ends with a separator
+        std::string _prefix;//File name part of the basename
+        std::string _suffix;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::deque<std::string> _queue;//Closed files to compress
+        std::string _current;//File the sink writes to, guarded by _mutex
+        bool _sweep;
+        std::atomic<bool> _stop;
+        std::thread _thread;
+        std::vector<char> _in;//Archiver thread only, allocated on the first compression
+        std::vector<char> _out;
+        std::vector<uint32_t> _table;
+        std::atomic<size_t> _pending;
+        std::atomic<size_t> _compressed;
+        std::atomic<size_t> _bytes_in;
+        std::atomic<size_t> _bytes_out;
+        std::atomic<size_t> _deleted;
+        std::atomic<size_t> _bytes_deleted;
+        std::atomic<size_t> _failures;
+    };
+}
+
+#endif
@@ -0,0 +1,205 @@
+/*Memory behind the async buffers
+    1、Buffers are made of whole blocks mapped straight from the kernel: no zero-fill in user space,
+       growth moves page tables with mremap instead of copying
+    2、Single blocks are recycled through a free list, what exceeds the retention limit goes back to the kernel
+    3、A global limit across every logger, checked by the paths that may fail (Buffer::tryPush)
+    4、Optional huge pages: MAP_HUGETLB when the system has some reserved, otherwise madvise(MADV_HUGEPAGE)
+    5、Rings and their oversize records are mapped here too, whole pages that start zeroed, never recycled
+*/
+
+#ifndef __M_ARENA_H__
+#define __M_ARENA_H__
+
+#include <sys/mman.h>
+#include <mutex>
+#include <vector>
+#include <cstring>
+#include <cstddef>
+
+namespace Logs
+{
+    class BlockArena
+    {
+    public:
+        enum
+        {
+            BLOCK_SIZE = 2 * 1024 * 1024,//One huge page on x86-64
+            PAGE_BYTES = 4096,
+            DEFAULT_RETAIN = 4//Free blocks kept for reuse
+        };
+
+        //Never destroyed: buffers owned by static loggers may be released after every other static is gone
+        static BlockArena& instance()
+        {
+            static BlockArena* arena = new BlockArena();
+            return *arena;
+        }
+
+        BlockArena(const BlockArena&) = delete;
+        BlockArena& operator=(const BlockArena&) = delete;
+
+        //0: no limit. Only applies to later allocations
+        void setLimit(size_t bytes)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _limit = bytes;
+        }
+
+        void setHugePages(bool huge)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _huge = huge;
+        }
+
+        void setRetain(size_t blocks)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _retain = blocks;
+            while (_free.size() > _retain) unmapFree();
+        }
+
+        //Bytes currently mapped, free blocks included
+        size_t mapped()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _mapped;
+        }
+
+        //size is rounded up to whole blocks. With capped set, nullptr instead of going over the limit
+        char* acquire(size_t& size, bool capped)
+        {
+            size = roundUp(size);
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (size == BLOCK_SIZE && _free.empty() == false)
+            {
+                char* p = _free.back();
+                _free.pop_back();
+                return p;
+            }
+            if (capped && overLimit(size)) return nullptr;
+            char* p = map(size);
+            if (p != nullptr) _mapped += size;
+            return p;
+        }
+
+        //Make p (old bytes) size bytes long, the contents are kept. nullptr on failure, p is then untouched
+        char* grow(char* p, size_t old, size_t& size, bool capped)
+        {
+            size = roundUp(size);
+            if (size <= old) return p;
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (capped && overLimit(size - old)) return nullptr;
+            void* q = mremap(p, old, size, MREMAP_MAYMOVE);
+            if (q == MAP_FAILED)
+            {
+                //Huge page mappings can't always be remapped
+                q = map(size);
+                if (q == nullptr) return nullptr;
+                memcpy(q, p, old);
+                munmap(p, old);
+            }
+            _mapped += size - old;
+            return (char*)q;
+        }
+
+        //Give back everything past the first size bytes (rounded up to blocks)
+        void shrink(char* p, size_t old, size_t& size)
+        {
+            size = roundUp(size);
+            if (size >= old) return ;
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (munmap(p + size, old - size) != 0)
+            {
+                size = old;
+                return ;
+            }
+            _mapped -= old - size;
+        }
+
+        //Fixed size memory for the rings: rounded up to pages and zeroed. With capped set, nullptr instead of going over the limit
+        char* acquirePages(size_t& size, bool capped)
+        {
+            size = (size + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (capped && overLimit(size)) return nullptr;
+            char* p = map(size);
+            if (p != nullptr) _mapped += size;
+            return p;
+        }
+
+        //size as passed to acquirePages
+        void releasePages(char* p, size_t size)
+        {
+            size = (size + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+            std::unique_lock<std::mutex> lock(_mutex);
+            munmap(p, size);
+            _mapped -= size;
+        }
+
+        void release(char* p, size_t size)
+        {
+            size_t keep = BLOCK_SIZE;
+            shrink(p, size, keep);
+            size = keep;
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (size == BLOCK_SIZE && _free.size() < _retain)
+            {
+                _free.push_back(p);
+                return ;
+            }
+            munmap(p, size);
+            _mapped -= size;
+        }
+    private:
+        BlockArena() : _limit(0), _mapped(0), _retain(DEFAULT_RETAIN), _huge(false) {}
+
+        static size_t roundUp(size_t size)
+        {
+            if (size == 0) return BLOCK_SIZE;
+            return (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        }
+
+        //Free blocks can be unmapped to make room
+        bool overLimit(size_t more)
+        {
+            if (_limit == 0) return false;
+            while (_mapped + more > _limit && _free.empty() == false) unmapFree();
+            return _mapped + more > _limit;
+        }
+
+        void unmapFree()
+        {
+            munmap(_free.back(), BLOCK_SIZE);
+            _free.pop_back();
+            _mapped -= BLOCK_SIZE;
+        }
+
+        //Fresh anonymous pages, zeroed lazily by the kernel as they are touched
+        char* map(size_t size)
+        {
+            void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+            //The kernel rounds huge page mappings up to a whole page, only whole blocks can be unmapped as they were mapped
+            if (_huge && size % BLOCK_SIZE == 0) p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+            if (p == MAP_FAILED)
+            {
+                p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+                if (_huge) madvise(p, size, MADV_HUGEPAGE);
+#endif
+            }
+            return (char*)p;
+        }
+    private:
+        std::mutex _mutex;
+        size_t _limit;
+        size_t _mapped;
+        size_t _retain;
+        bool _huge;
+        std::vector<char*> _free;//Single blocks
+    };
+}
+
+#endif
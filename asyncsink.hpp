@@ -0,0 +1,239 @@
+/*Sinks with a queue of their own
+    AsyncSinkAdapter<SinkT> owns a SinkT and writes to it from its own thread, or from a BackendPool.
+    The logger only enqueues a reference to the formatted bytes, every queued sink of a logger shares
+    the same copy. A slow sink fills its own queue, and its overflow policy decides what happens
+    then, the logger and its other sinks keep going.
+        builder->buildSink<Logs::AsyncSinkAdapter<Logs::FileSink>>(Logs::SinkQueueConfig(), "./logs/archive.log");
+*/
+
+#ifndef __M_ASINK_H__
+#define __M_ASINK_H__
+
+#include "sink.hpp"
+#include "looper.hpp"
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+
+namespace Logs
+{
+    struct SinkQueueConfig
+    {
+        SinkQueueConfig() : _max_bytes(16 * 1024 * 1024), _type(AsyncType::ASYNC_DROP_NEWEST), _timeout(10) {}
+
+        size_t _max_bytes;//Queued bytes before the policy applies, a batch always fits in an empty queue
+        //ASYNC_SAFE blocks the logger's backend, ASYNC_UNSAFE never drops and never blocks
+        AsyncType _type;
+        std::chrono::milliseconds _timeout;//ASYNC_TIMEOUT only
+        BackendPool::ptr _pool;//Written from this pool instead of a thread of its own
+    };
+
+    template <typename SinkT>
+    class AsyncSinkAdapter : public LogSink, public BackendTask
+    {
+    public:
+        using ptr = std::shared_ptr<AsyncSinkAdapter>;
+
+        template <typename... Args>
+        explicit AsyncSinkAdapter(const SinkQueueConfig& config, Args&&... args)
+            : _sink(std::forward<Args>(args)...), _config(config), _queued_bytes(0), _scheduled(false), _stop(false)
+            , _flush_requested(0), _flush_done(0), _dropped_batches(0), _dropped_bytes(0)
+        {
+            if (_config._pool == nullptr) _thread = std::thread(&AsyncSinkAdapter::worker_loop, this);
+        }
+
+        //Whatever is queued is written first
+        ~AsyncSinkAdapter()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+            _work_cond.notify_all();
+            if (_config._pool == nullptr)
+            {
+                lock.unlock();
+                _thread.join();
+                return ;
+            }
+            //Pool: wait for the running task to hand back, then finish on this thread
+            _idle_cond.wait(lock, [&]{ return _scheduled == false; });
+            lock.unlock();
+            writeQueued();
+        }
+
+        SinkT& sink() {return _sink; }
+
+        bool queued() override {return true; }
+
+        void log(const char* data, size_t len) override {logShared(SinkBatch::copy(data, len)); }
+
+        void logShared(const SinkBatch::ptr& batch) override
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (makeRoom(lock, batch->size()) == false)
+            {
+                _dropped_batches.fetch_add(1, std::memory_order_relaxed);
+                _dropped_bytes.fetch_add(batch->size(), std::memory_order_relaxed);
+                return ;
+            }
+            _queue.push_back(batch);
+            _queued_bytes += batch->size();
+            wakeUp();
+        }
+
+        //Returns once everything queued before the call is written and the sink flushed
+        void flush() override
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            uint64_t ticket = ++_flush_requested;
+            _queue.push_back(nullptr);//Marker, the sink is flushed when the worker gets there
+            wakeUp();
+            _flush_cond.wait(lock, [&]{ return _flush_done >= ticket || _stop; });
+        }
+
+        //Signal handler: what is still queued goes first, unless the crash hit while the queue was locked
+        //The batches the worker was writing at that moment may be cut short
+        void crashWrite(const char* data, size_t len) override
+        {
+            std::unique_lock<std::mutex> lock(_mutex, std::try_to_lock);
+            if (lock.owns_lock())
+            {
+                for (auto& batch : _queue)
+                {
+                    if (batch) _sink.crashWrite(batch->data(), batch->size());
+                }
+                //Left locked: the worker must not write them a second time, and neither must the next logger sharing this sink
+                lock.release();
+            }
+            _sink.crashWrite(data, len);
+        }
+
+        //Batches and bytes lost to the overflow policy
+        uint64_t droppedBatches() {return _dropped_batches.load(std::memory_order_relaxed); }
+        uint64_t droppedBytes() {return _dropped_bytes.load(std::memory_order_relaxed); }
+
+        //Pool side: write what is queued, then hand back, or go to the end of a deque if more came in
+        void run(Buffer&) override
+        {
+            writeQueued();
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_queue.empty() == false && _stop == false)
+            {
+                lock.unlock();
+                _config._pool->submit(this);
+                return ;
+            }
+            _scheduled = false;
+            _idle_cond.notify_all();
+        }
+    private:
+        //Called with _mutex held, false if the batch has to be dropped
+        bool makeRoom(std::unique_lock<std::mutex>& lock, size_t len)
+        {
+            auto fits = [&]{ return _queue.empty() || _queued_bytes + len <= _config._max_bytes; };
+            if (fits()) return true;
+            switch (_config._type)
+            {
+            case AsyncType::ASYNC_UNSAFE:
+                return true;
+            case AsyncType::ASYNC_DROP_NEWEST:
+                return false;
+            case AsyncType::ASYNC_DROP_OLDEST:
+                while (fits() == false)
+                {
+                    //Flush markers stay, somebody waits for them
+                    auto it = _queue.begin();
+                    while (it != _queue.end() && *it == nullptr) ++it;
+                    if (it == _queue.end()) break;
+                    _dropped_batches.fetch_add(1, std::memory_order_relaxed);
+                    _dropped_bytes.fetch_add((*it)->size(), std::memory_order_relaxed);
+                    _queued_bytes -= (*it)->size();
+                    _queue.erase(it);
+                }
+                return true;
+            case AsyncType::ASYNC_TIMEOUT:
+                return _space_cond.wait_for(lock, _config._timeout, fits);
+            default:
+                _space_cond.wait(lock, fits);
+                return true;
+            }
+        }
+
+        //Called with _mutex held
+        void wakeUp()
+        {
+            if (_config._pool == nullptr)
+            {
+                _work_cond.notify_one();
+                return ;
+            }
+            if (_scheduled || _stop) return ;
+            _scheduled = true;
+            _config._pool->submit(this);
+        }
+
+        //Take the whole queue at once, write it without the lock
+        void writeQueued()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_queue.empty() == false)
+            {
+                _writing.swap(_queue);
+                _queued_bytes = 0;
+                _space_cond.notify_all();
+                lock.unlock();
+                uint64_t flushes = 0;
+                for (auto& batch : _writing)
+                {
+                    if (batch == nullptr)
+                    {
+                        _sink.flush();
+                        ++flushes;
+                    }
+                    else _sink.log(batch->data(), batch->size());
+                }
+                _writing.clear();
+                lock.lock();
+                if (flushes > 0)
+                {
+                    _flush_done += flushes;
+                    _flush_cond.notify_all();
+                }
+            }
+        }
+
+        void worker_loop()
+        {
+            while (1)
+            {
+                writeQueued();
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (_stop && _queue.empty()) break;
+                _work_cond.wait(lock, [&]{ return _queue.empty() == false || _stop; });
+            }
+        }
+    private:
+        SinkT _sink;
+        SinkQueueConfig _config;
+        std::mutex _mutex;
+        std::condition_variable _work_cond;//Own thread: something was queued
+        std::condition_variable _space_cond;//ASYNC_SAFE/ASYNC_TIMEOUT: the queue was taken
+        std::condition_variable _idle_cond;//Pool: the task handed back
+        std::condition_variable _flush_cond;
+        std::deque<SinkBatch::ptr> _queue;//nullptr: flush marker
+        std::deque<SinkBatch::ptr> _writing;//Worker only
+        size_t _queued_bytes;
+        bool _scheduled;//Pool: submitted or running
+        bool _stop;
+        uint64_t _flush_requested;
+        uint64_t _flush_done;
+        std::atomic<uint64_t> _dropped_batches;
+        std::atomic<uint64_t> _dropped_bytes;
+        std::thread _thread;
+    };
+}
+
+#endif
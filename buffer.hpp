@@ -1,10 +1,15 @@
-/*Implement asynchronous log buffer*/
+/*Implement asynchronous log buffer
+    Memory comes from BlockArena (arena.hpp) on the first push, an idle logger holds none
+*/
 
 #ifndef __M_BUF_H__
 #define __M_BUF_H__
 
+#include "arena.hpp"
 #include <iostream>
-#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
 #include <cassert>
 
 namespace Logs
@@ -13,17 +18,27 @@ namespace Logs
     //The threshold used for expansion. If it doesn't exceed, it will double. If it exceeds, it will grow linearly
     #define THRESHOLD_BUFFER_SIZE (10 * 1024 * 1024)
     #define INCREMENT_BUFFER_SIZE (1 * 1024 * 1024)//linear growth
+    //A grown buffer gives the extra memory back after this many resets in a row found it at most a quarter full
+    #define SHRINK_AFTER_RESETS 16
 
     class Buffer
     {
     public:
-        Buffer() :_buffer(DEFAULT_BUFFER_SIZE), _reader_idx(0), _writer_idx(0) {}
+        Buffer() : _buffer(nullptr), _capacity(0), _reader_idx(0), _writer_idx(0), _small_resets(0) {}
+
+        ~Buffer()
+        {
+            if (_buffer != nullptr) BlockArena::instance().release(_buffer, _capacity);
+        }
+
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
 
         //Determine whether the buffer is empty
         bool empty() {return _reader_idx == _writer_idx; }
 
         //Returns the starting address of readable data
-        const char* begin() {return &_buffer[_reader_idx]; }
+        const char* begin() {return _buffer + _reader_idx; }
 
         //Returns the length of readable data
         size_t readAbleSize()
@@ -36,15 +51,17 @@ namespace Logs
         size_t writeAbleSize()
         {
             //This interface is only provided for fixed size buffer
-            return _buffer.size() - _writer_idx;
+            return _capacity - _writer_idx;
         }
 
         //Exchange data between two buffers
         void swap(Buffer& buf)
         {
-            _buffer.swap(buf._buffer);
+            std::swap(_buffer, buf._buffer);
+            std::swap(_capacity, buf._capacity);
             std::swap(_reader_idx, buf._reader_idx);
             std::swap(_writer_idx, buf._writer_idx);
+            std::swap(_small_resets, buf._small_resets);
         }
 
         //Write data to buffer
@@ -53,14 +70,25 @@ namespace Logs
             //assert(len <= writeAbleSize());//Block
 
             //1、Not enough space, then expand
-            ensureEnoughSize(len);//Dynamic expansion
-            
+            ensureEnoughSize(len, false);//Dynamic expansion, the arena's limit doesn't apply
+            if (len == 0) return ;
             //2、Copy data into buffer
-            std::copy(data, data + len, &_buffer[_writer_idx]);
+            memcpy(_buffer + _writer_idx, data, len);
             //3、Offset backward from current writing position
             //The first step ensures that +len will not exceed the total buffer size
             _writer_idx += len;
-        } 
+        }
+
+        //Make room for len more bytes without going over BlockArena's limit
+        bool tryReserve(size_t len) {return ensureEnoughSize(len, true); }
+
+        //Like push, but false instead of going over BlockArena's limit
+        bool tryPush(const char* data, size_t len)
+        {
+            if (tryReserve(len) == false) return false;
+            push(data, len);
+            return true;
+        }
 
         //Offset the read and write pointers backward
         void pop(size_t len)//Offset moveReader backward after reading data
@@ -72,24 +100,60 @@ namespace Logs
         //When there is no data to read, reset the read and write position and initialize the buffer
         void reset()
         {
+            //A burst grew the buffer: once batches stay small for a while, the memory goes back
+            if (_capacity > BlockArena::BLOCK_SIZE)
+            {
+                if (_writer_idx > _capacity / 4) _small_resets = 0;
+                else if (++_small_resets >= SHRINK_AFTER_RESETS)
+                {
+                    _writer_idx = 0;
+                    shrink();
+                }
+            }
             _writer_idx = 0;//All space in the buffer is free
             _reader_idx = 0;//Equality with _writer_idx means no data is readable
         }
+
+        //Keep a single block, or what the readable data needs. Called by workers about to go idle
+        void shrink()
+        {
+            if (_capacity <= BlockArena::BLOCK_SIZE) return ;
+            size_t size = _writer_idx;
+            BlockArena::instance().shrink(_buffer, _capacity, size);
+            _capacity = size;
+            _small_resets = 0;
+        }
     private:
-        //Expansd buffer
-        void ensureEnoughSize(size_t len)
+        //Expansd buffer, whole blocks from the arena. With capped set, false instead of going over its limit
+        bool ensureEnoughSize(size_t len, bool capped)
         {
-            if(len <= writeAbleSize()) return ;
+            if(len <= writeAbleSize()) return true;
             size_t new_size = 0;
-            if (_buffer.size() < THRESHOLD_BUFFER_SIZE)
-                new_size = _buffer.size() * 2 + len;
-            else new_size = _buffer.size() + INCREMENT_BUFFER_SIZE + len;
-            _buffer.resize(new_size);
+            if (_capacity < THRESHOLD_BUFFER_SIZE)
+                new_size = _capacity * 2 + len;
+            else new_size = _capacity + INCREMENT_BUFFER_SIZE + len;
+            char* p = _buffer == nullptr ? BlockArena::instance().acquire(new_size, capped)
+                                         : BlockArena::instance().grow(_buffer, _capacity, new_size, capped);
+            if (p == nullptr)
+            {
+                //Out of memory with the limit ignored is fatal, as it was for std::vector
+                if (capped == false)
+                {
+                    std::cout << "Log buffer allocation failed! \n";
+                    abort();
+                }
+                return false;
+            }
+            _buffer = p;
+            _capacity = new_size;
+            return true;
         }
     private:
-        std::vector<char> _buffer;
+        char* _buffer;//Whole blocks from BlockArena
+        size_t _capacity;
         size_t _reader_idx;
         size_t _writer_idx;
+        size_t _small_resets;
     };
 }
 
@@ -0,0 +1,142 @@
+/*Last words of the asynchronous loggers
+    1、CrashTarget: something holding log records that would be lost if the process died now
+    2、CrashHandler: on SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT, every registered target writes what
+       it still holds straight to its sinks' file descriptors, then the previous handler gets the signal
+    Targets register in a fixed array of atomic slots: the handler takes no lock and allocates nothing.
+    Opt-in, nothing is installed until install() (LoggerManager::installCrashHandler) is called.
+*/
+
+#ifndef __M_CRASH_H__
+#define __M_CRASH_H__
+
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+
+namespace Logs
+{
+    //Static memory for the handler, a crashing process can't be trusted to allocate
+    struct CrashScratch
+    {
+        enum
+        {
+            RECORD_SIZE = 64 * 1024,//A record that wraps around a ring is copied here first
+            OUT_SIZE = 64 * 1024//Recovered text, written to the sinks whenever it fills up
+        };
+        char _record[RECORD_SIZE];
+        char _out[OUT_SIZE];
+        size_t _len;
+    };
+
+    class CrashTarget
+    {
+    public:
+        virtual ~CrashTarget() {}
+        //Runs inside the signal handler, other threads may be anywhere, including in the middle of a log call
+        virtual void crashDrain(CrashScratch& scratch) = 0;
+    };
+
+    class CrashHandler
+    {
+    public:
+        enum
+        {
+            MAX_TARGETS = 64,
+            ALT_STACK_SIZE = 64 * 1024
+        };
+
+        //False if every slot is taken, the target then isn't drained on a crash
+        static bool add(CrashTarget* target)
+        {
+            for (size_t i = 0; i < MAX_TARGETS; ++i)
+            {
+                CrashTarget* empty = nullptr;
+                if (slots()[i].compare_exchange_strong(empty, target, std::memory_order_acq_rel)) return true;
+            }
+            return false;
+        }
+
+        static void remove(CrashTarget* target)
+        {
+            for (size_t i = 0; i < MAX_TARGETS; ++i)
+            {
+                CrashTarget* expected = target;
+                if (slots()[i].compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) return ;
+            }
+        }
+
+        //Idempotent. The alternate stack lets a stack overflow be reported too, but only on the calling thread
+        static void install()
+        {
+            static std::atomic<bool> installed(false);
+            if (installed.exchange(true)) return ;
+            stack_t ss;
+            ss.ss_sp = malloc(ALT_STACK_SIZE);
+            ss.ss_size = ALT_STACK_SIZE;
+            ss.ss_flags = 0;
+            if (ss.ss_sp != nullptr) sigaltstack(&ss, nullptr);
+            struct sigaction sa;
+            sa.sa_sigaction = &CrashHandler::onSignal;
+            sigemptyset(&sa.sa_mask);
+            sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+            for (size_t i = 0; i < SIGNAL_COUNT; ++i) sigaction(signals()[i], &sa, &previous()[i]);
+        }
+
+        //Every registered target, in registration order. For a dying process only: sinks may be left unusable
+        static void drain()
+        {
+            static CrashScratch scratch;
+            for (size_t i = 0; i < MAX_TARGETS; ++i)
+            {
+                CrashTarget* target = slots()[i].load(std::memory_order_acquire);
+                if (target == nullptr) continue;
+                scratch._len = 0;
+                target->crashDrain(scratch);
+            }
+        }
+    private:
+        enum {SIGNAL_COUNT = 5};
+
+        static void onSignal(int sig, siginfo_t*, void*)
+        {
+            static std::atomic<int> entered(0);
+            //Another thread crashed too and is draining, it takes the process down once it's done
+            if (entered.exchange(1, std::memory_order_acq_rel) != 0)
+            {
+                while (1) pause();
+            }
+            int saved = errno;
+            drain();
+            errno = saved;
+            //Hand the signal to whoever had it before: delivered as soon as this handler returns
+            for (size_t i = 0; i < SIGNAL_COUNT; ++i)
+            {
+                if (signals()[i] == sig) sigaction(sig, &previous()[i], nullptr);
+            }
+            raise(sig);
+        }
+
+        //Zero-initialized arrays of static storage, no guard to take on first use
+        static std::atomic<CrashTarget*>* slots()
+        {
+            static std::atomic<CrashTarget*> s[MAX_TARGETS];
+            return s;
+        }
+
+        static const int* signals()
+        {
+            static const int s[SIGNAL_COUNT] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+            return s;
+        }
+
+        static struct sigaction* previous()
+        {
+            static struct sigaction s[SIGNAL_COUNT];
+            return s;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,257 @@
+/*Deferred (binary) logging:
+    1、LogSite: static description of one log statement (level, file, line, format), registered once per call site
+    2、ArgCodec: copies the raw bytes of each argument on the caller thread and formats them later
+    3、DeferredRecord: the layout written into the async buffer, decoded and formatted by the backend thread
+*/
+
+#ifndef __M_DEFER_H__
+#define __M_DEFER_H__
+
+#include "level.hpp"
+#include "fmtbuf.hpp"
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <sys/types.h>
+#include <type_traits>
+
+namespace Logs
+{
+    struct LogSite;
+
+    //Site ids are indexes into this table, id 0 is reserved for records that carry preformatted text
+    class LogSiteRegistry
+    {
+    public:
+        enum
+        {
+            CHUNK_SITES = 1024,
+            MAX_CHUNKS = 1024//Sites past the first million are not known to the crash handler
+        };
+
+        static uint32_t add(const LogSite* site)
+        {
+            std::unique_lock<std::mutex> lock(mutex());
+            std::vector<const LogSite*>& v = sites();
+            if (v.empty()) v.push_back(nullptr);
+            v.push_back(site);
+            uint32_t id = v.size() - 1;
+            if (id / CHUNK_SITES < MAX_CHUNKS)
+            {
+                std::atomic<const LogSite*>* chunk = chunks()[id / CHUNK_SITES].load(std::memory_order_relaxed);
+                if (chunk == nullptr)
+                {
+                    chunk = new std::atomic<const LogSite*>[CHUNK_SITES]();
+                    chunks()[id / CHUNK_SITES].store(chunk, std::memory_order_release);
+                }
+                chunk[id % CHUNK_SITES].store(site, std::memory_order_release);
+            }
+            return id;
+        }
+
+        //Crash handler side: no lock and no allocation, nullptr for an id it doesn't know
+        static const LogSite* find(uint32_t id)
+        {
+            if (id / CHUNK_SITES >= MAX_CHUNKS) return nullptr;
+            std::atomic<const LogSite*>* chunk = chunks()[id / CHUNK_SITES].load(std::memory_order_acquire);
+            if (chunk == nullptr) return nullptr;
+            return chunk[id % CHUNK_SITES].load(std::memory_order_acquire);
+        }
+
+        //The backend keeps its own copy and only refreshes it when it meets an id it doesn't know yet
+        static const LogSite* get(std::vector<const LogSite*>& snapshot, uint32_t id)
+        {
+            if (id >= snapshot.size())
+            {
+                std::unique_lock<std::mutex> lock(mutex());
+                snapshot = sites();
+                if (id >= snapshot.size()) return nullptr;
+            }
+            return snapshot[id];
+        }
+    private:
+        static std::mutex& mutex()
+        {
+            static std::mutex m;
+            return m;
+        }
+        static std::vector<const LogSite*>& sites()
+        {
+            static std::vector<const LogSite*> v;
+            return v;
+        }
+        //Same table in fixed chunks that never move, written under mutex() and read without it
+        static std::atomic<std::atomic<const LogSite*>*>* chunks()
+        {
+            static std::atomic<std::atomic<const LogSite*>*> c[MAX_CHUNKS];
+            return c;
+        }
+    };
+
+    //Must have static storage duration: file and fmt are string literals and are never copied
+    struct LogSite
+    {
+        LogSite(LogLevel::value level, const char* file, size_t line, const char* fmt)
+            : _level(level), _file(file), _line(line), _fmt(fmt), _id(LogSiteRegistry::add(this)) {}
+
+        LogSite(const LogSite&) = delete;
+        LogSite& operator=(const LogSite&) = delete;
+
+        LogLevel::value _level;
+        const char* _file;
+        size_t _line;
+        const char* _fmt;
+        uint32_t _id;
+    };
+
+    /*How one argument is captured, appended to the record being built
+        Arithmetic, enums and pointers: raw bytes
+        C strings and std::string: length + bytes, they may not outlive the call
+        Anything else: rendered through operator<< on the caller thread, then stored as a string
+    */
+    template <typename T, int Kind = std::is_arithmetic<T>::value || std::is_enum<T>::value ? 1
+                                   : (std::is_same<T, const char*>::value || std::is_same<T, char*>::value) ? 2
+                                   : std::is_same<T, std::string>::value ? 3
+                                   : std::is_pointer<T>::value ? 4 : 0>
+    struct ArgCodec;
+
+    //Strings share one layout: uint32_t length followed by the bytes
+    struct StrCodec
+    {
+        static void encode(FmtBuffer& rec, const char* str, uint32_t len)
+        {
+            rec.append((const char*)&len, sizeof(len));
+            rec.append(str, len);
+        }
+        static const char* decode(const char* p, const char*& str, uint32_t& len)
+        {
+            memcpy(&len, p, sizeof(len));
+            str = p + sizeof(len);
+            return str + len;
+        }
+        static const char* decode(FmtBuffer& out, const char* p)
+        {
+            const char* str;
+            uint32_t len;
+            p = decode(p, str, len);
+            out.append(str, len);
+            return p;
+        }
+    };
+
+    //Raw bytes
+    template <typename T>
+    struct ArgCodec<T, 1>
+    {
+        static void encode(FmtBuffer& rec, const T& v) {rec.append((const char*)&v, sizeof(T)); }
+        static const char* decode(FmtBuffer& out, const char* p)
+        {
+            T v;
+            memcpy(&v, p, sizeof(T));
+            ArgWriter::write(out, v);
+            return p + sizeof(T);
+        }
+    };
+
+    template <typename T>
+    struct ArgCodec<T, 2>
+    {
+        static void encode(FmtBuffer& rec, const char* str)
+        {
+            if (str == nullptr) StrCodec::encode(rec, "(null)", 6);
+            else StrCodec::encode(rec, str, strlen(str));
+        }
+        static const char* decode(FmtBuffer& out, const char* p) {return StrCodec::decode(out, p); }
+    };
+
+    template <typename T>
+    struct ArgCodec<T, 3>
+    {
+        static void encode(FmtBuffer& rec, const T& str) {StrCodec::encode(rec, str.data(), str.size()); }
+        static const char* decode(FmtBuffer& out, const char* p) {return StrCodec::decode(out, p); }
+    };
+
+    template <typename T>
+    struct ArgCodec<T, 4>
+    {
+        static void encode(FmtBuffer& rec, const T& v)
+        {
+            const void* ptr = v;
+            rec.append((const char*)&ptr, sizeof(ptr));
+        }
+        static const char* decode(FmtBuffer& out, const char* p)
+        {
+            const void* ptr;
+            memcpy(&ptr, p, sizeof(ptr));
+            ArgWriter::write(out, ptr);
+            return p + sizeof(ptr);
+        }
+    };
+
+    //User types can't be copied as bytes safely, so they are formatted on the caller thread
+    template <typename T>
+    struct ArgCodec<T, 0>
+    {
+        static void encode(FmtBuffer& rec, const T& v)
+        {
+            //Leave room for the length and patch it once the text is written
+            size_t at = rec.size();
+            uint32_t len = 0;
+            rec.append((const char*)&len, sizeof(len));
+            ArgWriter::write(rec, v);
+            len = rec.size() - at - sizeof(len);
+            memcpy(rec.data() + at, &len, sizeof(len));
+        }
+        static const char* decode(FmtBuffer& out, const char* p) {return StrCodec::decode(out, p); }
+    };
+
+    //Encoding and "{}" formatting of a whole argument list
+    template <typename... Args>
+    struct ArgPack;
+
+    template <>
+    struct ArgPack<>
+    {
+        static void encode(FmtBuffer&) {}
+        static void decode(FmtBuffer& out, const char* fmt, const char*) {ArgWriter::format(out, fmt); }
+    };
+
+    template <typename T, typename... Rest>
+    struct ArgPack<T, Rest...>
+    {
+        using Codec = ArgCodec<typename std::decay<T>::type>;
+
+        static void encode(FmtBuffer& rec, const T& first, const Rest&... rest)
+        {
+            Codec::encode(rec, first);
+            ArgPack<Rest...>::encode(rec, rest...);
+        }
+        static void decode(FmtBuffer& out, const char* fmt, const char* p)
+        {
+            fmt = ArgWriter::nextField(out, fmt);
+            if (fmt == nullptr) return ;
+            p = Codec::decode(out, p);
+            ArgPack<Rest...>::decode(out, fmt, p);
+        }
+    };
+
+    //Formats the argument bytes of a record according to the site's format string
+    using ArgDecoder = void (*)(FmtBuffer& out, const char* fmt, const char* args);
+
+    /*Record layout in the async buffer:
+        DeferredRecord | argument bytes
+        For _site == 0 the arguments are replaced by: level, line, file length + file, payload length + payload
+    */
+    struct DeferredRecord
+    {
+        uint32_t _size;//Whole record including this header
+        uint32_t _site;//Id in LogSiteRegistry
+        ArgDecoder _decode;
+        time_t _sec;
+        long _nsec;
+        pid_t _tid;
+        char _tname[16];//Copied, the thread may have exited before the backend formats the record
+    };
+}
+
+#endif
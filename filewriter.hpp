@@ -0,0 +1,274 @@
+/*File backend of the file sinks
+    1、A raw descriptor opened with O_APPEND, no iostream layer in between
+    2、A user space buffer of configurable size: small writes are copied into it, a write that doesn't fit
+       goes out together with the buffered bytes in one writev
+    3、Durability policy: none, fdatasync every N bytes or T ms, or fdatasync on every flush()
+       With DURABLE_ON_FLUSH, Builder::buildFlushOn(LogLevel::value::Error) syncs every Error and above
+    4、Time bounds on a Rotator timer, armed only while bytes wait: buffered bytes reach the kernel within
+       _flush_interval, DURABLE_PERIODIC bytes reach the disk within _sync_interval, even if nothing else is logged
+*/
+
+#ifndef __M_FWRITER_H__
+#define __M_FWRITER_H__
+
+#include "util.hpp"
+#include "rotator.hpp"
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+namespace Logs
+{
+    enum class Durability
+    {
+        DURABLE_NONE,//Left to the kernel
+        DURABLE_PERIODIC,//fdatasync once FileConfig::_sync_bytes were written, or _sync_interval after the oldest unsynced write
+        DURABLE_ON_FLUSH//fdatasync on every flush(): whatever a flush covered is on disk when it returns
+    };
+
+    struct FileConfig
+    {
+        FileConfig()
+            : _buffer_size(64 * 1024), _flush_interval(200), _durability(Durability::DURABLE_NONE), _sync_bytes(0), _sync_interval(0)
+        {}
+
+        size_t _buffer_size;//0: every log call is a write
+        std::chrono::milliseconds _flush_interval;//Longest a buffered byte waits for the kernel, 0: until the buffer fills or a flush()
+        Durability _durability;
+        size_t _sync_bytes;//DURABLE_PERIODIC, 0: no byte trigger
+        std::chrono::milliseconds _sync_interval;//DURABLE_PERIODIC, 0: no time trigger
+    };
+
+    class FileWriter
+    {
+    public:
+        explicit FileWriter(const FileConfig& config = FileConfig())
+            : _config(config), _buffer(config._buffer_size ? new char[config._buffer_size] : nullptr), _len(0)
+            , _fd(-1), _busy(false), _unsynced(0), _tick_at(Steady::time_point::max()), _ticking(false)
+        {}
+
+        ~FileWriter()
+        {
+            //A tick may be running, it takes _mutex
+            if (_ticking) Rotator::instance().cancel(this);
+            close();
+        }
+
+        FileWriter(const FileWriter&) = delete;
+        FileWriter& operator=(const FileWriter&) = delete;
+
+        //The descriptor open() would use, -1 on failure. Lets a rolling sink open the next file ahead of time
+        static int openFile(const std::string& pathname)
+        {
+            return ::open(pathname.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        }
+
+        //Buffered bytes go to the previous file first. False if pathname can't be opened, the previous file is kept
+        bool open(const std::string& pathname)
+        {
+            int fd = openFile(pathname);
+            if (fd < 0) return false;
+            int old = adopt(fd);
+            if (old >= 0) ::close(old);
+            return true;
+        }
+
+        //Switch to fd (from openFile) after writing the buffered bytes to the current file
+        //Returns the previous descriptor, or -1, for the caller to close: close may be slow, e.g. on a network file system
+        int adopt(int fd)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _busy.store(true, std::memory_order_seq_cst);
+            flushLocked();
+            //The previous file's unsynced bytes can't be synced through the next descriptor
+            if (periodic() && _unsynced > 0) sync();
+            //Swapped before the old one is closed, the crash handler never sees a closed descriptor
+            int old = _fd.exchange(fd, std::memory_order_acq_rel);
+            _busy.store(false, std::memory_order_seq_cst);
+            return old;
+        }
+
+        void close()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _busy.store(true, std::memory_order_seq_cst);
+            flushLocked();
+            int old = _fd.exchange(-1, std::memory_order_acq_rel);
+            if (old >= 0) ::close(old);
+            _busy.store(false, std::memory_order_seq_cst);
+        }
+
+        bool isOpen() {return _fd.load(std::memory_order_relaxed) >= 0; }
+
+        //False on a write error, the bytes are lost
+        bool write(const char* data, size_t len)
+        {
+            if (len == 0) return true;
+            std::unique_lock<std::mutex> lock(_mutex);
+            _busy.store(true, std::memory_order_seq_cst);
+            bool ok = true;
+            if (_len + len <= _config._buffer_size)
+            {
+                if (_len == 0) _buffered_since = Steady::now();
+                memcpy(_buffer.get() + _len, data, len);
+                _len += len;
+                if (_len == len) schedule();
+            }
+            else
+            {
+                //Buffered bytes and the new ones in one system call, the new ones are never copied
+                struct iovec iov[2];
+                iov[0].iov_base = _buffer.get();
+                iov[0].iov_len = _len;
+                iov[1].iov_base = (void*)data;
+                iov[1].iov_len = len;
+                ok = writevAll(iov, 2);
+                _len = 0;
+            }
+            if (periodic()) ok = accepted(len) && ok;
+            _busy.store(false, std::memory_order_seq_cst);
+            return ok;
+        }
+
+        //Buffered bytes to the kernel, and to the disk under DURABLE_ON_FLUSH
+        bool flush()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _busy.store(true, std::memory_order_seq_cst);
+            bool ok = flushLocked();
+            if (_config._durability == Durability::DURABLE_ON_FLUSH) ok = sync() && ok;
+            _busy.store(false, std::memory_order_seq_cst);
+            return ok;
+        }
+
+        //Signal handler: the buffered bytes first, unless the writer was interrupted in the middle of a call
+        //Takes no lock, _busy covers the ticks too
+        void crashWrite(const char* data, size_t len)
+        {
+            int fd = _fd.load(std::memory_order_acquire);
+            if (fd < 0) return ;
+            if (_busy.load(std::memory_order_seq_cst) == false && _len > 0)
+            {
+                LogUtil::File::writeAll(fd, _buffer.get(), _len);
+                _len = 0;
+            }
+            LogUtil::File::writeAll(fd, data, len);
+        }
+    private:
+        using Steady = std::chrono::steady_clock;
+
+        bool flushLocked()
+        {
+            if (_len == 0) return true;
+            int fd = _fd.load(std::memory_order_relaxed);
+            bool ok = fd >= 0 && LogUtil::File::writeAll(fd, _buffer.get(), _len);
+            _len = 0;
+            return ok;
+        }
+
+        //Partial writes continue where the kernel stopped
+        bool writevAll(struct iovec* iov, int cnt)
+        {
+            int fd = _fd.load(std::memory_order_relaxed);
+            if (fd < 0) return false;
+            size_t total = 0;
+            for (int i = 0; i < cnt; ++i) total += iov[i].iov_len;
+            while (total > 0)
+            {
+                while (cnt > 0 && iov->iov_len == 0) {++iov; --cnt; }
+                ssize_t n = ::writev(fd, iov, cnt);
+                if (n < 0)
+                {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                total -= n;
+                for (size_t left = n; left > 0;)
+                {
+                    size_t part = left < iov->iov_len ? left : iov->iov_len;
+                    iov->iov_base = (char*)iov->iov_base + part;
+                    iov->iov_len -= part;
+                    left -= part;
+                    if (iov->iov_len == 0) {++iov; --cnt; }
+                }
+            }
+            return true;
+        }
+
+        bool periodic() {return _config._durability == Durability::DURABLE_PERIODIC; }
+
+        //DURABLE_PERIODIC: count every byte write() took, buffered or not. The byte trigger syncs the buffer too
+        bool accepted(size_t len)
+        {
+            if (_unsynced == 0) _unsynced_since = Steady::now();
+            _unsynced += len;
+            if (_config._sync_bytes > 0 && _unsynced >= _config._sync_bytes)
+            {
+                bool ok = flushLocked();
+                return sync() && ok;
+            }
+            if (_unsynced == len) schedule();
+            return true;
+        }
+
+        bool sync()
+        {
+            int fd = _fd.load(std::memory_order_relaxed);
+            _unsynced = 0;
+            return fd >= 0 && fdatasync(fd) == 0;
+        }
+
+        //Called with _mutex held when bytes start waiting: a tick is due when the oldest of them is
+        void schedule()
+        {
+            Steady::time_point due = Steady::time_point::max();
+            if (_len > 0 && _config._flush_interval.count() > 0) due = _buffered_since + _config._flush_interval;
+            if (periodic() && _unsynced > 0 && _config._sync_interval.count() > 0)
+                due = std::min(due, _unsynced_since + _config._sync_interval);
+            //An earlier tick is already on its way, it schedules the next one
+            if (due >= _tick_at) return ;
+            _tick_at = due;
+            _ticking = true;
+            Rotator::instance().at(this, Rotator::Clock::now() + (due - Steady::now()), [this]{ tick(); });
+        }
+
+        //Rotator thread: what is due goes out, then the next tick is scheduled if bytes still wait
+        void tick()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _busy.store(true, std::memory_order_seq_cst);
+            _tick_at = Steady::time_point::max();
+            Steady::time_point now = Steady::now();
+            if (_len > 0 && _config._flush_interval.count() > 0 && now >= _buffered_since + _config._flush_interval)
+                flushLocked();
+            if (periodic() && _unsynced > 0 && _config._sync_interval.count() > 0 && now >= _unsynced_since + _config._sync_interval)
+            {
+                flushLocked();
+                sync();
+            }
+            schedule();
+            _busy.store(false, std::memory_order_seq_cst);
+        }
+    private:
+        FileConfig _config;
+        std::mutex _mutex;//The logging side and the ticks
+        std::unique_ptr<char[]> _buffer;
+        size_t _len;
+        std::atomic<int> _fd;
+        std::atomic<bool> _busy;//In a call, crashWrite must leave the buffer alone
+        size_t _unsynced;//DURABLE_PERIODIC: bytes written since the last fdatasync
+        Steady::time_point _buffered_since;//Oldest byte in the buffer
+        Steady::time_point _unsynced_since;//Oldest unsynced byte
+        Steady::time_point _tick_at;//Earliest tick on its way, max() if none
+        bool _ticking;//A tick was ever scheduled, the destructor must cancel
+
+    };
+}
+
+#endif
@@ -0,0 +1,281 @@
+/*Formatting without heap allocation:
+    1、FmtBuffer: append-only character buffer living on the caller's stack,
+       only spilling to the heap when a message is larger than the inline space
+    2、ArgWriter: type-safe "{}" placeholder formatting that writes straight into FmtBuffer
+*/
+
+#ifndef __M_FMTBUF_H__
+#define __M_FMTBUF_H__
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <type_traits>
+
+namespace Logs
+{
+    #define INLINE_FMT_BUFFER_SIZE (4 * 1024)//Messages below 4KB never touch the allocator
+
+    class FmtBuffer
+    {
+    public:
+        //Tag for a buffer that never allocates: what doesn't fit in the inline space is cut off (crash handler)
+        struct Bounded {};
+        enum {BOUNDED_SLACK = 256};//Room kept behind a bounded buffer for reserve(), no writer asks for more
+
+        FmtBuffer() : _data(_inline), _size(0), _capacity(INLINE_FMT_BUFFER_SIZE), _bounded(false) {}
+        explicit FmtBuffer(Bounded)
+            : _data(_inline), _size(0), _capacity(INLINE_FMT_BUFFER_SIZE - BOUNDED_SLACK), _bounded(true) {}
+        ~FmtBuffer()
+        {
+            if (_data != _inline) free(_data);
+        }
+
+        //Copying would have to decide who owns the spilled memory, and nobody needs it
+        FmtBuffer(const FmtBuffer&) = delete;
+        FmtBuffer& operator=(const FmtBuffer&) = delete;
+
+        const char* data() const {return _data; }
+        char* data() {return _data; }
+        size_t size() const {return _size; }
+        bool empty() const {return _size == 0; }
+        void clear() {_size = 0; }
+
+        void append(const char* data, size_t len)
+        {
+            len = ensureEnoughSize(len);
+            memcpy(_data + _size, data, len);
+            _size += len;
+        }
+
+        void append(const char* str) {append(str, strlen(str)); }
+        void append(const std::string& str) {append(str.c_str(), str.size()); }
+
+        void append(char c)
+        {
+            if (ensureEnoughSize(1) == 0) return ;
+            _data[_size++] = c;
+        }
+
+        //For writers that produce data in place (integer conversion, snprintf):
+        //reserve at least len bytes, write behind tail(), then commit what was written
+        //A bounded buffer that is full hands out its slack, and commit() throws the bytes away
+        char* reserve(size_t len)
+        {
+            ensureEnoughSize(len);
+            return _data + _size;
+        }
+        char* tail() {return _data + _size; }
+        size_t writeAbleSize() const {return _capacity - _size; }
+        void commit(size_t len) {_size = std::min(_size + len, _capacity); }
+
+    private:
+        //Returns how many of the len bytes can be written, less than len only for a bounded buffer
+        size_t ensureEnoughSize(size_t len)
+        {
+            if (len <= _capacity - _size) return len;
+            if (_bounded) return _capacity - _size;
+            size_t new_cap = _capacity * 2;
+            if (new_cap < _size + len) new_cap = _size + len;
+            //realloc doesn't zero-fill, and the inline part must be copied over by hand
+            if (_data == _inline)
+            {
+                char* p = (char*)malloc(new_cap);
+                memcpy(p, _inline, _size);
+                _data = p;
+            }
+            else _data = (char*)realloc(_data, new_cap);
+            _capacity = new_cap;
+            return len;
+        }
+    private:
+        char* _data;//Points to _inline until the message outgrows it
+        size_t _size;
+        size_t _capacity;
+        bool _bounded;
+        char _inline[INLINE_FMT_BUFFER_SIZE];
+    };
+
+    /*
+        "{}" is replaced by the next argument
+        "{{" and "}}" are written as "{" and "}"
+        Extra placeholders are written as they are, extra arguments are ignored
+    */
+    class ArgWriter
+    {
+    public:
+        static void format(FmtBuffer& out, const char* fmt)
+        {
+            //No arguments left, the rest is plain text
+            while (*fmt)
+            {
+                if ((fmt[0] == '{' && fmt[1] == '{') || (fmt[0] == '}' && fmt[1] == '}')) ++fmt;
+                out.append(*fmt++);
+            }
+        }
+
+        template <typename T, typename... Rest>
+        static void format(FmtBuffer& out, const char* fmt, const T& first, const Rest&... rest)
+        {
+            fmt = nextField(out, fmt);
+            if (fmt == nullptr) return ;//No more placeholders
+            write(out, first);
+            format(out, fmt, rest...);
+        }
+
+        //Writers for each supported type, also used by the formatter for numeric fields
+        static void write(FmtBuffer& out, const char* str)
+        {
+            if (str == nullptr) out.append("(null)", 6);
+            else out.append(str);
+        }
+        static void write(FmtBuffer& out, char* str) {write(out, (const char*)str); }
+        static void write(FmtBuffer& out, const std::string& str) {out.append(str); }
+        static void write(FmtBuffer& out, char c) {out.append(c); }
+        static void write(FmtBuffer& out, bool b)
+        {
+            if (b) out.append("true", 4);
+            else out.append("false", 5);
+        }
+        static void write(FmtBuffer& out, short v) {writeSigned(out, v); }
+        static void write(FmtBuffer& out, int v) {writeSigned(out, v); }
+        static void write(FmtBuffer& out, long v) {writeSigned(out, v); }
+        static void write(FmtBuffer& out, long long v) {writeSigned(out, v); }
+        static void write(FmtBuffer& out, unsigned short v) {writeUnsigned(out, v); }
+        static void write(FmtBuffer& out, unsigned int v) {writeUnsigned(out, v); }
+        static void write(FmtBuffer& out, unsigned long v) {writeUnsigned(out, v); }
+        static void write(FmtBuffer& out, unsigned long long v) {writeUnsigned(out, v); }
+        static void write(FmtBuffer& out, float v) {write(out, (double)v); }
+        static void write(FmtBuffer& out, double v)
+        {
+            //%g matches what operator<< prints by default
+            char* p = out.reserve(32);
+            int len = snprintf(p, 32, "%g", v);
+            if (len > 0) out.commit(len);
+        }
+        static void write(FmtBuffer& out, const void* ptr)
+        {
+            char* p = out.reserve(2 + 2 * sizeof(void*));
+            p[0] = '0';
+            p[1] = 'x';
+            size_t len = toHex(p + 2, (unsigned long long)(uintptr_t)ptr);
+            out.commit(2 + len);
+        }
+        static void write(FmtBuffer& out, void* ptr) {write(out, (const void*)ptr); }
+
+        //Everything else: enums as their value, other integers by sign, and user types through operator<<
+        template <typename T>
+        static void write(FmtBuffer& out, const T& v)
+        {
+            writeOther(out, v, std::integral_constant<int,
+                std::is_enum<T>::value ? 1 : (std::is_integral<T>::value ? 2 : 0)>());
+        }
+
+        //Convert integers by hand, two digits at a time, instead of going through snprintf
+        static size_t toDigits(char* dst, unsigned long long v)
+        {
+            static const char digits[] =
+                "0001020304050607080910111213141516171819"
+                "2021222324252627282930313233343536373839"
+                "4041424344454647484950515253545556575859"
+                "6061626364656667686970717273747576777879"
+                "8081828384858687888990919293949596979899";
+            char tmp[24];
+            char* p = tmp + sizeof(tmp);
+            while (v >= 100)
+            {
+                unsigned idx = (unsigned)(v % 100) * 2;
+                v /= 100;
+                *--p = digits[idx + 1];
+                *--p = digits[idx];
+            }
+            if (v >= 10)
+            {
+                *--p = digits[v * 2 + 1];
+                *--p = digits[v * 2];
+            }
+            else *--p = (char)('0' + v);
+            size_t len = tmp + sizeof(tmp) - p;
+            memcpy(dst, p, len);
+            return len;
+        }
+
+        static size_t toHex(char* dst, unsigned long long v)
+        {
+            char tmp[16];
+            size_t len = 0;
+            do
+            {
+                tmp[len++] = "0123456789abcdef"[v & 0xf];
+                v >>= 4;
+            } while (v);
+            for (size_t i = 0; i < len; ++i) dst[i] = tmp[len - 1 - i];
+            return len;
+        }
+
+        //Copy the text before the next "{}" and return the position after it, or nullptr if there is none
+        static const char* nextField(FmtBuffer& out, const char* fmt)
+        {
+            while (*fmt)
+            {
+                if (fmt[0] == '{')
+                {
+                    if (fmt[1] == '}') return fmt + 2;
+                    if (fmt[1] == '{') ++fmt;
+                }
+                else if (fmt[0] == '}' && fmt[1] == '}') ++fmt;
+                out.append(*fmt++);
+            }
+            return nullptr;
+        }
+
+        static void writeSigned(FmtBuffer& out, long long v)
+        {
+            char* p = out.reserve(24);
+            size_t len = 0;
+            unsigned long long u = (unsigned long long)v;
+            if (v < 0)
+            {
+                p[len++] = '-';
+                u = 0 - u;//Also correct for the minimum value
+            }
+            len += toDigits(p + len, u);
+            out.commit(len);
+        }
+
+        static void writeUnsigned(FmtBuffer& out, unsigned long long v)
+        {
+            char* p = out.reserve(24);
+            out.commit(toDigits(p, v));
+        }
+
+    private:
+        template <typename T>
+        static void writeOther(FmtBuffer& out, const T& v, std::integral_constant<int, 1>)
+        {
+            writeSigned(out, (long long)v);
+        }
+
+        template <typename T>
+        static void writeOther(FmtBuffer& out, const T& v, std::integral_constant<int, 2>)
+        {
+            if (std::is_signed<T>::value) writeSigned(out, (long long)v);
+            else writeUnsigned(out, (unsigned long long)v);
+        }
+
+        template <typename T>
+        static void writeOther(FmtBuffer& out, const T& v, std::integral_constant<int, 0>)
+        {
+            //Only user types pay for a stream
+            std::ostringstream ss;
+            ss << v;
+            out.append(ss.str());
+        }
+    };
+}
+
+#endif
@@ -2,10 +2,14 @@
 #define __M_FMT_H__
 
 #include "message.hpp"
+#include "fmtbuf.hpp"
 #include <vector>
 #include <cassert>
 #include <sstream>
 #include <tuple>
+#include <functional>
+#include <unordered_map>
+#include <atomic>
 
 namespace Logs
 {
@@ -15,6 +19,13 @@ namespace Logs
         using ptr = std::shared_ptr<FormatItem>;
         virtual ~FormatItem() {}
         virtual void format(std::ostream& out, const LogMsg& msg) = 0;
+        //Used by Formatter for custom items, override it to skip the stream
+        virtual void append(FmtBuffer& out, const LogMsg& msg)
+        {
+            std::ostringstream ss;
+            format(ss, msg);
+            out.append(ss.str());
+        }
     };
 
     class MsgFormatItem : public FormatItem
@@ -37,27 +48,242 @@ namespace Logs
         }
     };
     
-    class TimeFormatItem : public FormatItem//Time has subformat
+    /*Time subformat with caching
+        Anything strftime understands, plus fractional seconds:
+        %3N milliseconds, %6N microseconds, %9N or %N nanoseconds
+        %:z the UTC offset as +hh:mm (RFC 3339), strftime's %z has no colon
+        The strftime part only changes once a second, so each thread keeps the rendered text
+        of the last second and only patches the fractional digits.
+    */
+    class TimeFormat
     {
     public:
-        TimeFormatItem(const std::string& fmt = "%H:%M:%S"):_time_fmt(fmt)
+        TimeFormat(const std::string& fmt = "%H:%M:%S") : _id(nextId()), _colon_z(fmt.find("%:z") != std::string::npos)
         {
-            if(fmt.empty()) _time_fmt = "%H:%M:%S";
+            std::string cur = fmt.empty() ? "%H:%M:%S" : fmt;
+            std::string chunk;
+            size_t pos = 0;
+            while (pos < cur.size())
+            {
+                if (cur[pos] != '%' || pos + 1 >= cur.size())
+                {
+                    chunk.append(1, cur[pos++]);
+                    continue;
+                }
+                int digits = 0;
+                size_t skip = 0;
+                if (cur[pos + 1] == 'N') {digits = 9; skip = 2; }
+                else if (pos + 2 < cur.size() && cur[pos + 2] == 'N'
+                         && (cur[pos + 1] == '3' || cur[pos + 1] == '6' || cur[pos + 1] == '9'))
+                {
+                    digits = cur[pos + 1] - '0';
+                    skip = 3;
+                }
+                if (digits == 0 || _digits.size() == MAX_FRACS)
+                {
+                    //Normal strftime conversion, keep %% together so it isn't mistaken for %N
+                    chunk.append(cur, pos, 2);
+                    pos += 2;
+                    continue;
+                }
+                _chunks.push_back(chunk);
+                _digits.push_back(digits);
+                chunk.clear();
+                pos += skip;
+            }
+            _chunks.push_back(chunk);
+            //Seeds the offset a crash handler uses, in case nothing is rendered before
+            struct tm t;
+            time_t now = time(nullptr);
+            localtime_r(&now, &t);
+            utcOffset().store(t.tm_gmtoff, std::memory_order_relaxed);
+            zone().store(t.tm_zone, std::memory_order_relaxed);
         }
 
-        void format(std::ostream& out, const LogMsg& msg) override
+        void format(FmtBuffer& out, time_t sec, long nsec) const
+        {
+            static thread_local Cache caches[CACHE_SLOTS];
+            Cache& c = caches[_id % CACHE_SLOTS];
+            if (c._id != _id || c._sec != sec) render(c, sec);
+
+            char* p = out.reserve(c._len);
+            memcpy(p, c._text, c._len);
+            for (size_t i = 0; i < _digits.size(); ++i)
+            {
+                //Left out by render, no room was reserved for it
+                if (c._frac_len[i] == 0) continue;
+                //Write the leading digits of nsec, zero padded
+                long v = nsec;
+                for (int d = _digits[i]; d < 9; ++d) v /= 10;
+                for (int d = _digits[i] - 1; d >= 0; --d)
+                {
+                    p[c._frac_pos[i] + d] = (char)('0' + v % 10);
+                    v /= 10;
+                }
+            }
+            out.commit(c._len);
+        }
+
+        //Set on the crashing thread while the crash handler formats, render() then stays away from localtime_r
+        static bool& signalSafe()
+        {
+            static thread_local bool on = false;
+            return on;
+        }
+
+    private:
+        enum {MAX_FRACS = 4, CACHE_SLOTS = 4, MAX_TEXT = 128};
+
+        struct Cache
+        {
+            Cache() : _id(0), _sec(0), _len(0) {}
+            uint64_t _id;//Which TimeFormat the text belongs to, ids start at 1
+            time_t _sec;
+            size_t _len;
+            size_t _frac_pos[MAX_FRACS];
+            size_t _frac_len[MAX_FRACS];//Digits rendered for each fractional field, 0 if it didn't fit
+            char _text[MAX_TEXT];
+        };
+
+        //Only called when the second changes, this is the one place that pays for localtime_r
+        void render(Cache& c, time_t sec) const
         {
             struct tm t;
-            //Get the current system time from the first parameter, put it into t, and return tm structure pointer
-            localtime_r(&msg._ctime, &t);
-            char tmp[128] = {0};
-            //Format the time in t according to the format and put it in tmp
-            //The number represents the maximum number of characters copied to tmp, which must be greater than the number of format characters
-            strftime(tmp, 127, _time_fmt.c_str(), &t);
-            out << tmp;//Put in output stream
+            if (signalSafe()) breakDown(sec + utcOffset().load(std::memory_order_relaxed), t);
+            else
+            {
+                localtime_r(&sec, &t);
+                utcOffset().store(t.tm_gmtoff, std::memory_order_relaxed);
+                zone().store(t.tm_zone, std::memory_order_relaxed);
+            }
+            size_t len = 0;
+            for (size_t i = 0; i < _chunks.size(); ++i)
+            {
+                //strftime returns 0 when the text doesn't fit, the chunk is then left out
+                if (_chunks[i].empty() == false)
+                {
+                    char expanded[MAX_TEXT];
+                    const char* f = _colon_z ? expandOffset(expanded, _chunks[i].c_str(), t.tm_gmtoff) : _chunks[i].c_str();
+                    len += strftime(c._text + len, MAX_TEXT - len, f, &t);
+                }
+                if (i < _digits.size())
+                {
+                    size_t d = _digits[i];
+                    if (len + d > MAX_TEXT) d = 0;
+                    c._frac_pos[i] = len;
+                    c._frac_len[i] = d;
+                    len += d;
+                }
+            }
+            c._len = len;
+            c._sec = sec;
+            c._id = _id;
+        }
+
+        //Writes fmt into dst with every %:z replaced by the offset, strftime doesn't know it
+        static const char* expandOffset(char* dst, const char* fmt, long offset)
+        {
+            char sign = offset < 0 ? '-' : '+';
+            if (offset < 0) offset = -offset;
+            char text[6] = {sign, (char)('0' + offset / 36000 % 10), (char)('0' + offset / 3600 % 10), ':',
+                            (char)('0' + offset / 600 % 6), (char)('0' + offset / 60 % 10)};
+            size_t len = 0;
+            for (; *fmt; ++fmt)
+            {
+                if (len + sizeof(text) >= MAX_TEXT) return "";//Renders longer than the text can hold anyway
+                if (fmt[0] == '%' && fmt[1] == ':' && fmt[2] == 'z')
+                {
+                    memcpy(dst + len, text, sizeof(text));
+                    len += sizeof(text);
+                    fmt += 2;
+                }
+                else if (fmt[0] == '%' && fmt[1] != '\0')
+                {
+                    dst[len++] = *fmt++;//Keeps %% together
+                    dst[len++] = *fmt;
+                }
+                else dst[len++] = *fmt;
+            }
+            dst[len] = '\0';
+            return dst;
+        }
+
+        //localtime_r without the timezone lock: the offset of the last normal render is added by hand,
+        //a daylight saving change since then is missed
+        static void breakDown(time_t sec, struct tm& t)
+        {
+            static const int before_month[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+            long long days = sec / 86400, rem = sec % 86400;
+            if (rem < 0)
+            {
+                rem += 86400;
+                --days;
+            }
+            memset(&t, 0, sizeof(t));
+            t.tm_hour = rem / 3600;
+            t.tm_min = rem % 3600 / 60;
+            t.tm_sec = rem % 60;
+            t.tm_wday = (int)((days % 7 + 11) % 7);//1970-01-01 was a Thursday
+            //Civil date from the day count, with years starting in March so the leap day comes last
+            days += 719468;
+            long long era = (days >= 0 ? days : days - 146096) / 146097;
+            long long doe = days - era * 146097;
+            long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+            long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+            long long mp = (5 * doy + 2) / 153;
+            int mon = mp < 10 ? mp + 2 : mp - 10;
+            long long year = yoe + era * 400 + (mon < 2);
+            t.tm_mday = doy - (153 * mp + 2) / 5 + 1;
+            t.tm_mon = mon;
+            t.tm_year = year - 1900;
+            bool leap = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+            t.tm_yday = before_month[mon] + t.tm_mday - 1 + (leap && mon > 1);
+            t.tm_gmtoff = utcOffset().load(std::memory_order_relaxed);
+            t.tm_zone = zone().load(std::memory_order_relaxed);
+        }
+
+        static std::atomic<long>& utcOffset()
+        {
+            static std::atomic<long> offset(0);
+            return offset;
+        }
+
+        static std::atomic<const char*>& zone()
+        {
+            static std::atomic<const char*> name("UTC");
+            return name;
+        }
+
+        static uint64_t nextId()
+        {
+            static std::atomic<uint64_t> id(0);
+            return ++id;
         }
     private:
-        std::string _time_fmt;//The default is %H:%M:%S
+        uint64_t _id;//Keys the per-thread cache, never reused even if a formatter is destroyed
+        std::vector<std::string> _chunks;//strftime formats between fractional fields
+        std::vector<int> _digits;//Digit count of each fractional field
+        bool _colon_z;//The format uses %:z
+    };
+
+    class TimeFormatItem : public FormatItem//Time has subformat
+    {
+    public:
+        TimeFormatItem(const std::string& fmt = "%H:%M:%S"):_time_fmt(fmt) {}
+
+        void format(std::ostream& out, const LogMsg& msg) override
+        {
+            FmtBuffer buf;
+            append(buf, msg);
+            out.write(buf.data(), buf.size());//Put in output stream
+        }
+
+        void append(FmtBuffer& out, const LogMsg& msg) override
+        {
+            _time_fmt.format(out, msg._ctime, msg._nsec);
+        }
+    private:
+        TimeFormat _time_fmt;//The default is %H:%M:%S
     };
 
     class FileFormatItem : public FormatItem
@@ -90,6 +316,17 @@ namespace Logs
         }
     };
 
+    class ThreadNameFormatItem : public FormatItem
+    {
+    public:
+        ThreadNameFormatItem(const std::string& = ""){}
+        void format(std::ostream& out, const LogMsg& msg) override
+        {
+            if (msg._tname.empty()) out << msg._tid;
+            else out << msg._tname;
+        }
+    };
+
     class NameFormatItem : public FormatItem
     {
     public:
@@ -133,8 +370,9 @@ namespace Logs
     };
 
     /*
-        %d date, including subformats: {%H:%M:%S}
-        %t thread id
+        %d date, including subformats: {%H:%M:%S}, {%H:%M:%S.%3N} adds milliseconds (%6N, %9N)
+        %t thread id (kernel tid, as in top -H)
+        %N thread name, thread id if unnamed
         %c logger name
         %f source code file name
         %l source code line number
@@ -144,37 +382,110 @@ namespace Logs
         %n newline
     */
 
+    //One step of a compiled pattern
+    struct FormatOp
+    {
+        enum Code : uint8_t
+        {
+            OP_LITERAL = 0,//_strings[_offset, _offset + _len)
+            OP_MSG,
+            OP_LEVEL,
+            OP_TIME,//_times[_offset]
+            OP_FILE,
+            OP_LINE,
+            OP_THREAD,
+            OP_THREAD_NAME,
+            OP_NAME,
+            OP_CUSTOM//_customs[_offset]
+        };
+
+        FormatOp(Code code, uint32_t offset = 0, uint32_t len = 0) : _code(code), _offset(offset), _len(len) {}
+        Code _code;
+        uint32_t _offset;
+        uint32_t _len;
+    };
+
     class Formatter
     {
     public:
         using ptr = std::shared_ptr<Formatter>;
+        //Extension path: create a FormatItem for a formatting character that isn't built in, from its subformat
+        using ItemCreator = std::function<FormatItem::ptr(const std::string& val)>;
 
         Formatter(const std::string& pattern = "[%d{%H:%M:%S}][%t][%p][%c][%f:%l] %m%n") : _pattern(pattern)
         {
-            assert(parsePattern());
+            //Parse outside assert, NDEBUG builds still need the result
+            bool ret = parsePattern();
+            assert(ret);
+            (void)ret;
+        }
+
+        //Custom items are looked up before the built-in ones, e.g. {{"u", creator}} handles %u
+        Formatter(const std::string& pattern, const std::unordered_map<std::string, ItemCreator>& creators)
+            : _pattern(pattern), _creators(creators)
+        {
+            //Parse outside assert, NDEBUG builds still need the result
+            bool ret = parsePattern();
+            assert(ret);
+            (void)ret;
         }
 
         const std::string pattern() {return _pattern; }
 
-        //Overloaded, format the message and put string into IO stream
-        std::ostream& format(std::ostream& out, const LogMsg& msg)
+        virtual ~Formatter() {}
+
+        //Run the compiled pattern, appending straight into out
+        //Derived formatters (see structured.hpp) replace this to render messages their own way
+        virtual void format(FmtBuffer& out, const LogMsg& msg)
         {
-            //Get the corresponding information from msg one by one in the order of parsing
-            for(auto& item : _items)
+            for(const FormatOp& op : _ops)
             {
-                //Each derived classes overloads format
-                item->format(out, msg);
+                switch(op._code)
+                {
+                case FormatOp::OP_LITERAL: out.append(_strings.data() + op._offset, op._len); break;
+                case FormatOp::OP_MSG: out.append(msg._payload.data(), msg._payload.size()); break;
+                case FormatOp::OP_LEVEL: out.append(LogLevel::toString(msg._level)); break;
+                case FormatOp::OP_TIME: _times[op._offset].format(out, msg._ctime, msg._nsec); break;
+                case FormatOp::OP_FILE: out.append(msg._file.data(), msg._file.size()); break;
+                case FormatOp::OP_LINE: ArgWriter::writeUnsigned(out, msg._line); break;
+                case FormatOp::OP_THREAD: appendThread(out, msg); break;
+                case FormatOp::OP_THREAD_NAME:
+                    if (msg._tname.empty()) appendThread(out, msg);
+                    else out.append(msg._tname.data(), msg._tname.size());
+                    break;
+                case FormatOp::OP_NAME: out.append(msg._name.data(), msg._name.size()); break;
+                case FormatOp::OP_CUSTOM: _customs[op._offset]->append(out, msg); break;
+                }
             }
+        }
+
+        //Overloaded, format the message and put string into IO stream
+        std::ostream& format(std::ostream& out, const LogMsg& msg)
+        {
+            FmtBuffer buf;
+            format(buf, msg);
+            out.write(buf.data(), buf.size());
             return out;
         }
 
         //Format message and return the formatted string
         std::string format(const LogMsg& msg)
         {
-            std::stringstream ss;
-            for(auto& it : _items) it->format(ss, msg);
-            return ss.str();
+            FmtBuffer buf;
+            format(buf, msg);
+            return std::string(buf.data(), buf.size());
         }
+
+        static void appendThread(FmtBuffer& out, const LogMsg& msg)
+        {
+            //The logging thread converted its id once, only deferred messages need converting here
+            if (msg._tid_str.empty()) ArgWriter::writeSigned(out, msg._tid);
+            else out.append(msg._tid_str.data(), msg._tid_str.size());
+        }
+    protected:
+        //For derived formatters that don't use a % pattern
+        struct Unparsed {};
+        Formatter(const std::string& pattern, Unparsed) : _pattern(pattern) {}
     private:
         //Parse the formatting rule string and add it to the array
         bool parsePattern()
@@ -289,59 +600,71 @@ namespace Logs
             //If it doesn't cross the boundary, continue. At this time, it's still the same situation as in the previous sentence
             
 
-            //2、Use the parsed data to initialize the formatted child array members
-            //According to the above changes, at this time
+            //2、Compile the parsed data into the op array
             //The contents in arr are correct formatting characters, or formatting characters + subformat, or non-formatting characters
             for (auto &it : arr)
             {
                 //Non-formatting character: (string_row, "", 0)
                 if (std::get<2>(it) == 0)//get<2> means taking out the third parameter. 0 means it's an unformatted character
+                    addLiteral(std::get<0>(it));
+                else if (compileItem(std::get<0>(it), std::get<1>(it)) == false)//Format characters: (key, val, 1)
                 {
-                    FormatItem::ptr fi(new OtherFormatItem(std::get<0>(it)));//Take out the corresponding string_row
-                    _items.push_back(fi);
-                }
-                else//Format characters: (key, val, 1)
-                {
-                    FormatItem::ptr fi = createItem(std::get<0>(it), std::get<1>(it));//Pass in key， val
-                    if (fi.get() == nullptr)
-                    {
-                        std::cout << "No corresponding formatting character: %" << std::get<0>(it) << std::endl;
-                        return false;
-                    }
-                    _items.push_back(fi);
+                    std::cout << "No corresponding formatting character: %" << std::get<0>(it) << std::endl;
+                    return false;
                 }
             }
             return true;
         }
-    
-        //Create different formatting subkey objects based on different formatting characters
-        FormatItem::ptr createItem(const std::string& key, const std::string& val)
-        {
-            if (key == "m") return FormatItem::ptr(new MsgFormatItem(val));
-            if (key == "p") return FormatItem::ptr(new LevelFormatItem(val));
-            if (key == "d") return FormatItem::ptr(new TimeFormatItem(val));
-            if (key == "f") return FormatItem::ptr(new FileFormatItem(val));
-            if (key == "l") return FormatItem::ptr(new LineFormatItem(val));
-            if (key == "t") return FormatItem::ptr(new ThreadFormatItem(val));
-            if (key == "c") return FormatItem::ptr(new NameFormatItem(val));
-            if (key == "T") return FormatItem::ptr(new TabFormatItem(val));
-            if (key == "n") return FormatItem::ptr(new NLineFormatItem(val));
-            return FormatItem::ptr();
-
-            /*if(key == "m") return std::make_shared<MsgFormatItem>(val);
-            if(key == "p") return std::make_shared<LevelFormatItem>(val);
-            if(key == "d") return std::make_shared<TimeFormatItem>(val);
-            if(key == "f") return std::make_shared<FileFormatItem>(val);
-            if(key == "l") return std::make_shared<LineFormatItem>(val);
-            if(key == "t") return std::make_shared<ThreadFormatItem>(val);
-            if(key == "c") return std::make_shared<NameFormatItem>(val);
-            if(key == "T") return std::make_shared<TabFormatItem>(val);
-            if(key == "n") return std::make_shared<NLineFormatItem>(val);
-            if(key.empty()) return std::make_shared<OtherFormatItem>(val);*/
+
+        //Adjacent literals (including %T and %n) are merged into one span
+        void addLiteral(const std::string& str)
+        {
+            if (_ops.empty() == false && _ops.back()._code == FormatOp::OP_LITERAL
+                && _ops.back()._offset + _ops.back()._len == _strings.size())
+            {
+                _ops.back()._len += str.size();
+            }
+            else _ops.push_back(FormatOp(FormatOp::OP_LITERAL, _strings.size(), str.size()));
+            _strings += str;
         }
+
+        //Turn a formatting character into its op
+        bool compileItem(const std::string& key, const std::string& val)
+        {
+            auto cit = _creators.find(key);
+            if (cit != _creators.end())
+            {
+                FormatItem::ptr fi = cit->second(val);
+                if (fi.get() == nullptr) return false;
+                _ops.push_back(FormatOp(FormatOp::OP_CUSTOM, _customs.size()));
+                _customs.push_back(fi);
+                return true;
+            }
+            if (key == "m") _ops.push_back(FormatOp(FormatOp::OP_MSG));
+            else if (key == "p") _ops.push_back(FormatOp(FormatOp::OP_LEVEL));
+            else if (key == "d")
+            {
+                _ops.push_back(FormatOp(FormatOp::OP_TIME, _times.size()));
+                _times.push_back(TimeFormat(val));
+            }
+            else if (key == "f") _ops.push_back(FormatOp(FormatOp::OP_FILE));
+            else if (key == "l") _ops.push_back(FormatOp(FormatOp::OP_LINE));
+            else if (key == "t") _ops.push_back(FormatOp(FormatOp::OP_THREAD));
+            else if (key == "N") _ops.push_back(FormatOp(FormatOp::OP_THREAD_NAME));
+            else if (key == "c") _ops.push_back(FormatOp(FormatOp::OP_NAME));
+            else if (key == "T") addLiteral("\t");
+            else if (key == "n") addLiteral("\n");
+            else return false;
+            return true;
+        }
+
     private:
         std::string _pattern;//Formatting rule string
-        std::vector<FormatItem::ptr> _items;
+        std::unordered_map<std::string, ItemCreator> _creators;
+        std::vector<FormatOp> _ops;//Compiled pattern
+        std::string _strings;//Literal spans referenced by _ops
+        std::vector<TimeFormat> _times;
+        std::vector<FormatItem::ptr> _customs;
     };
 }
 
@@ -0,0 +1,330 @@
+/*File sink writing through io_uring
+    1、log() copies the batch into one of _buffers buffers and submits it as a write, then returns:
+       the backend formats the next batch while the kernel writes this one
+    2、Completions are reaped without blocking on every call, log() only waits when every buffer is in flight
+    3、Writes carry their file offset, the sink owns the end of the file
+    4、Without io_uring (old kernel, seccomp, no headers) the same buffers are written with pwrite
+    No liburing: the two system calls and the shared rings are used directly
+        builder->buildSink<Logs::IoUringFileSink>("./logs/trace.log");
+*/
+
+#ifndef __M_USINK_H__
+#define __M_USINK_H__
+
+#include "sink.hpp"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define LOGS_HAS_IO_URING 1
+#endif
+
+namespace Logs
+{
+    struct IoUringConfig
+    {
+        IoUringConfig() : _buffers(4), _buffer_size(1024 * 1024), _use_io_uring(true) {}
+
+        size_t _buffers;//Writes in flight at most, plus the one being filled. At least 2
+        size_t _buffer_size;//A larger log() call is split over several buffers
+        bool _use_io_uring;//false: always pwrite
+    };
+
+    class IoUringFileSink : public LogSink
+    {
+    public:
+        using ptr = std::shared_ptr<IoUringFileSink>;
+
+        IoUringFileSink(const std::string& filename, const IoUringConfig& config = IoUringConfig())
+            : _filename(filename), _config(config), _cur(0), _inflight(0), _busy(false), _failed(false)
+            , _broken(false), _ring_fd(-1), _sq_ptr(nullptr), _cq_ptr(nullptr), _sqes(nullptr), _sq_size(0), _cq_size(0), _sqes_size(0)
+        {
+            if (_config._buffers < 2) _config._buffers = 2;
+            if (_config._buffer_size == 0) _config._buffer_size = 4096;
+            _slots.resize(_config._buffers);
+            for (auto& s : _slots) s._data.reset(new char[_config._buffer_size]);
+            LogUtil::File::createDirectory(LogUtil::File::path(_filename));
+            _fd = ::open(_filename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            assert(_fd >= 0);
+            struct stat st;
+            _offset = fstat(_fd, &st) == 0 ? st.st_size : 0;
+            if (_config._use_io_uring) setupRing();
+        }
+
+        ~IoUringFileSink()
+        {
+            flush();
+            teardownRing();
+            ::close(_fd);
+        }
+
+        const std::string& file() {return _filename; }
+
+        //True if writes go through io_uring, false if the sink fell back to pwrite
+        bool usingIoUring() {return _ring_fd >= 0 && _broken == false; }
+
+        void log(const char* data, size_t len)
+        {
+            _busy.store(true, std::memory_order_seq_cst);
+            reap(false);
+            while (len > 0)
+            {
+                Slot& s = _slots[_cur];
+                size_t part = len < _config._buffer_size - s._len ? len : _config._buffer_size - s._len;
+                memcpy(s._data.get() + s._len, data, part);
+                s._len += part;
+                data += part;
+                len -= part;
+                if (s._len == _config._buffer_size) submitCurrent();
+            }
+            //Nothing is left behind in the current buffer, the next call may be a long time away
+            submitCurrent();
+            _busy.store(false, std::memory_order_seq_cst);
+        }
+
+        //Returns once everything logged so far is written
+        void flush()
+        {
+            _busy.store(true, std::memory_order_seq_cst);
+            submitCurrent();
+            while (_inflight > 0) reap(true);
+            _busy.store(false, std::memory_order_seq_cst);
+        }
+
+        //Signal handler: the buffer being filled, unless the sink was interrupted, then data after it
+        //Writes still in flight are the kernel's, they may or may not complete
+        void crashWrite(const char* data, size_t len)
+        {
+            if (_busy.load(std::memory_order_seq_cst) == false)
+            {
+                Slot& s = _slots[_cur];
+                pwriteAll(s._data.get(), s._len, _offset);
+                _offset += s._len;
+                s._len = 0;
+            }
+            pwriteAll(data, len, _offset);
+            _offset += len;
+        }
+    private:
+        struct Slot
+        {
+            Slot() : _len(0), _done(0), _offset(0), _inflight(false) {}
+            std::unique_ptr<char[]> _data;
+            size_t _len;
+            size_t _done;//Bytes the kernel reported written
+            off_t _offset;
+            bool _inflight;
+        };
+
+        //The current buffer becomes a write, the next one becomes current, waiting for it if it is in flight
+        void submitCurrent()
+        {
+            Slot& s = _slots[_cur];
+            if (s._len == 0) return ;
+            s._offset = _offset;
+            s._done = 0;
+            _offset += s._len;
+            if (submit(_cur) == false)
+            {
+                if (pwriteAll(s._data.get(), s._len, s._offset) == false) reportError(errno);
+                s._len = 0;
+                return ;
+            }
+            s._inflight = true;
+            ++_inflight;
+            _cur = (_cur + 1) % _slots.size();
+            while (_slots[_cur]._inflight) reap(true);
+        }
+
+        bool pwriteAll(const char* data, size_t len, off_t off)
+        {
+            while (len > 0)
+            {
+                ssize_t n = pwrite(_fd, data, len, off);
+                if (n < 0)
+                {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                data += n;
+                len -= n;
+                off += n;
+            }
+            return true;
+        }
+
+        void reportError(int err)
+        {
+            if (_failed) return ;
+            _failed = true;
+            std::cout << "io_uring log file write failed: " << strerror(err) << "\n";
+        }
+
+#ifdef LOGS_HAS_IO_URING
+        void setupRing()
+        {
+            struct io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            int fd = (int)syscall(__NR_io_uring_setup, (unsigned)_config._buffers, &p);
+            if (fd < 0) return ;//pwrite from now on
+            _sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            _cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+            if (p.features & IORING_FEAT_SINGLE_MMAP)
+            {
+                if (_cq_size > _sq_size) _sq_size = _cq_size;
+                _cq_size = 0;
+            }
+            void* sq = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            void* cq = sq;
+            if (sq != MAP_FAILED && _cq_size > 0)
+                cq = mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            _sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+            void* sqes = MAP_FAILED;
+            if (sq != MAP_FAILED && cq != MAP_FAILED)
+                sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED)
+            {
+                if (sq != MAP_FAILED) munmap(sq, _sq_size);
+                if (cq != MAP_FAILED && cq != sq) munmap(cq, _cq_size);
+                ::close(fd);
+                return ;
+            }
+            _ring_fd = fd;
+            _sq_ptr = (char*)sq;
+            _cq_ptr = (char*)cq;
+            _sqes = (struct io_uring_sqe*)sqes;
+            _sq_tail = (unsigned*)(_sq_ptr + p.sq_off.tail);
+            _sq_mask = (unsigned*)(_sq_ptr + p.sq_off.ring_mask);
+            _sq_array = (unsigned*)(_sq_ptr + p.sq_off.array);
+            _cq_head = (unsigned*)(_cq_ptr + p.cq_off.head);
+            _cq_tail = (unsigned*)(_cq_ptr + p.cq_off.tail);
+            _cq_mask = (unsigned*)(_cq_ptr + p.cq_off.ring_mask);
+            _cqes = (struct io_uring_cqe*)(_cq_ptr + p.cq_off.cqes);
+        }
+
+        void teardownRing()
+        {
+            if (_ring_fd < 0) return ;
+            munmap(_sqes, _sqes_size);
+            if (_cq_ptr != _sq_ptr) munmap(_cq_ptr, _cq_size);
+            munmap(_sq_ptr, _sq_size);
+            ::close(_ring_fd);
+            _ring_fd = -1;
+        }
+
+        //One write of the rest of slot i. Never more in flight than there are entries, one per buffer
+        //False if io_uring can't be used, the caller writes the slot itself
+        bool submit(size_t i)
+        {
+            if (_ring_fd < 0 || _broken) return false;
+            Slot& s = _slots[i];
+            unsigned tail = *_sq_tail;
+            unsigned idx = tail & *_sq_mask;
+            struct io_uring_sqe* sqe = &_sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = _fd;
+            sqe->addr = (unsigned long)(s._data.get() + s._done);
+            sqe->len = s._len - s._done;
+            sqe->off = s._offset + s._done;
+            sqe->user_data = i;
+            _sq_array[idx] = idx;
+            __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+            while (1)
+            {
+                int n = (int)syscall(__NR_io_uring_enter, _ring_fd, 1, 0, 0, nullptr, 0);
+                if (n >= 0) return true;
+                if (errno != EINTR && errno != EAGAIN) break;
+            }
+            //Taken back before the kernel saw it. The writes in flight still complete, nothing new is submitted
+            __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+            _broken = true;
+            return false;
+        }
+
+        //Handle the completions, waiting for at least one if wait is set
+        void reap(bool wait)
+        {
+            if (_inflight == 0) return ;
+            unsigned head = *_cq_head;
+            if (wait && head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+                syscall(__NR_io_uring_enter, _ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            for (; head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE); ++head)
+            {
+                struct io_uring_cqe* cqe = &_cqes[head & *_cq_mask];
+                size_t i = cqe->user_data;
+                int res = cqe->res;
+                __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+                Slot& s = _slots[i];
+                if (res > 0) s._done += res;
+                else if (res == -EINVAL || res == -EOPNOTSUPP) _broken = true;//Kernel without IORING_OP_WRITE
+                else if (res < 0 && res != -EINTR && res != -EAGAIN)
+                {
+                    reportError(-res);
+                    finish(s);
+                    continue;
+                }
+                if (s._done < s._len)
+                {
+                    //Short or interrupted write, or no io_uring after all: the rest goes again
+                    if (submit(i)) continue;
+                    if (pwriteAll(s._data.get() + s._done, s._len - s._done, s._offset + s._done) == false) reportError(errno);
+                }
+                finish(s);
+            }
+        }
+#else
+        void setupRing() {}
+        void teardownRing() {}
+        bool submit(size_t) {return false; }
+        void reap(bool) {}
+#endif
+
+        void finish(Slot& s)
+        {
+            s._inflight = false;
+            s._len = 0;
+            --_inflight;
+        }
+    private:
+        std::string _filename;
+        IoUringConfig _config;
+        int _fd;
+        off_t _offset;//Where the next write goes
+        std::vector<Slot> _slots;
+        size_t _cur;//Slot being filled
+        size_t _inflight;
+        std::atomic<bool> _busy;//In a call, crashWrite must leave the current buffer alone
+        bool _failed;
+        bool _broken;//io_uring failed after setup: pwrite for new writes, the ones in flight are still reaped
+        int _ring_fd;//-1: pwrite
+        char* _sq_ptr;
+        char* _cq_ptr;
+#ifdef LOGS_HAS_IO_URING
+        struct io_uring_sqe* _sqes;
+        struct io_uring_cqe* _cqes;
+#else
+        void* _sqes;
+#endif
+        size_t _sq_size;
+        size_t _cq_size;
+        size_t _sqes_size;
+        unsigned* _sq_tail;
+        unsigned* _sq_mask;
+        unsigned* _sq_array;
+        unsigned* _cq_head;
+        unsigned* _cq_tail;
+        unsigned* _cq_mask;
+    };
+}
+
+#endif
@@ -9,6 +9,19 @@
 #include <iostream>
 #include <string>
 
+//Same values as LogLevel::value, usable in #if
+#define LOGS_LEVEL_DEBUG 1
+#define LOGS_LEVEL_INFO 2
+#define LOGS_LEVEL_WARN 3
+#define LOGS_LEVEL_ERROR 4
+#define LOGS_LEVEL_FATAL 5
+#define LOGS_LEVEL_OFF 6
+
+//Statements below this level are removed by the preprocessor, e.g. -DLOGS_ACTIVE_LEVEL=LOGS_LEVEL_INFO
+#ifndef LOGS_ACTIVE_LEVEL
+#define LOGS_ACTIVE_LEVEL LOGS_LEVEL_DEBUG
+#endif
+
 namespace Logs
 {
     class LogLevel
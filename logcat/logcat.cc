@@ -0,0 +1,131 @@
+/*Query tool for the binary segments written by SegmentSink
+    logcat [-l level] [-n logger] [-s time] [-e time] [-p pattern] [-v] segment...
+    Example, Error and above from logger "net" between 10:00 and 10:05:
+        ./logcat -l Error -n net -s "2026-10-17 10:00:00" -e "2026-10-17 10:05:00" ../logs/seg-*.logseg
+    Closed segments are searched through their index, only the parts that can hold a match are read.
+*/
+
+#include "../segment.hpp"
+#include <getopt.h>
+#include <cstdio>
+#include <cstdlib>
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: logcat [options] segment...\n"
+        "  -l LEVEL    this level and above: Debug, Info, Warn, Error, Fatal\n"
+        "  -n NAME     logger name\n"
+        "  -s TIME     from, \"YYYY-mm-dd HH:MM:SS\" local time or seconds since the epoch\n"
+        "  -e TIME     to, included\n"
+        "  -p PATTERN  output pattern, default \"[%%d{%%Y-%%m-%%d %%H:%%M:%%S.%%3N}][%%t][%%p][%%c][%%f:%%l] %%m%%n\"\n"
+        "  -v          index use per segment on stderr\n");
+}
+
+static bool parseLevel(const char* s, Logs::LogLevel::value& level)
+{
+    for (int i = (int)Logs::LogLevel::value::Debug; i <= (int)Logs::LogLevel::value::Fatal; ++i)
+    {
+        if (strcasecmp(s, Logs::LogLevel::toString((Logs::LogLevel::value)i)) == 0)
+        {
+            level = (Logs::LogLevel::value)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+//Nanoseconds since the epoch, the whole second: -e includes every record of it
+static bool parseTime(const char* s, bool end, int64_t& ns)
+{
+    struct tm lt;
+    memset(&lt, 0, sizeof(lt));
+    time_t t;
+    const char* rest = strptime(s, "%Y-%m-%d %H:%M:%S", &lt);
+    if (rest != nullptr && *rest == '\0')
+    {
+        lt.tm_isdst = -1;
+        t = mktime(&lt);
+    }
+    else
+    {
+        char* e;
+        t = strtoll(s, &e, 10);
+        if (*s == '\0' || *e != '\0') return false;
+    }
+    ns = (int64_t)t * 1000000000LL + (end ? 999999999LL : 0);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    Logs::SegmentQuery q;
+    std::string pattern = "[%d{%Y-%m-%d %H:%M:%S.%3N}][%t][%p][%c][%f:%l] %m%n";
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:n:s:e:p:vh")) != -1)
+    {
+        Logs::LogLevel::value level;
+        switch (opt)
+        {
+        case 'l':
+            if (parseLevel(optarg, level) == false)
+            {
+                fprintf(stderr, "logcat: unknown level %s\n", optarg);
+                return 2;
+            }
+            q._levels = (uint16_t)(0xFFFF << (int)level);
+            break;
+        case 'n': q._name = optarg; break;
+        case 's':
+        case 'e':
+            if (parseTime(optarg, opt == 'e', opt == 's' ? q._from : q._to) == false)
+            {
+                fprintf(stderr, "logcat: bad time %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'p': pattern = optarg; break;
+        case 'v': verbose = true; break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage();
+        return 2;
+    }
+
+    Logs::Formatter formatter(pattern);
+    Logs::FmtBuffer out;
+    int status = 0;
+    for (int i = optind; i < argc; ++i)
+    {
+        Logs::SegmentReader reader;
+        if (reader.open(argv[i]) == false)
+        {
+            fprintf(stderr, "logcat: %s is not a log segment\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        size_t n = reader.query(q, [&](const Logs::LogMsg& msg){
+            formatter.format(out, msg);
+            if (out.size() >= 64 * 1024)
+            {
+                fwrite(out.data(), 1, out.size(), stdout);
+                out.clear();
+            }
+        });
+        if (verbose)
+        {
+            if (reader.indexed())
+                fprintf(stderr, "%s: %zu records, %zu index entries read, %zu skipped\n", argv[i], n, reader.blocksRead(), reader.blocksSkipped());
+            else
+                fprintf(stderr, "%s: %zu records, no index (segment not closed), scanned\n", argv[i], n);
+        }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    return status;
+}
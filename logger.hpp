@@ -7,8 +7,19 @@
 #define __M_LOG_H__
 
 #include "format.hpp"
+#include "structured.hpp"
+#include "staticfmt.hpp"
+#include "fmtbuf.hpp"
+#include "deferred.hpp"
 #include "sink.hpp"
+#include "asyncsink.hpp"
+#include "mmapsink.hpp"
+#include "iouringsink.hpp"
+#include "segment.hpp"
+#include "netsink.hpp"
 #include "looper.hpp"
+#include "pipeline.hpp"
+#include "crash.hpp"
 #include <atomic>
 #include <mutex>
 #include <cstdarg>
@@ -21,6 +32,14 @@ namespace Logs
     class SyncLogger;
     class AsyncLogger;
 
+    //Call site of a log statement, used by the "{}" style interfaces
+    struct SourceLoc
+    {
+        SourceLoc(const char* file, size_t line) : _file(file), _line(line) {}
+        const char* _file;
+        size_t _line;
+    };
+
     class Logger
     {
     public:
@@ -38,11 +57,34 @@ namespace Logs
                LogLevel::value level = LogLevel::value::Info) : _logger_name(logger_name),
                                                                  _formatter(formatter),
                                                                  _sinks(sinks.begin(), sinks.end()),
-                                                                 _level(level) {}
+                                                                 _level(level),
+                                                                 _flush_level(LogLevel::value::OFF),
+                                                                 _deferred(false) {}
 
         //A reference modified by const, so that it can't be changed externally, or std::string without &
         const std::string& name() {return _logger_name; }
         LogLevel::value loggerLevel() {return _level; }
+        bool shouldLog(LogLevel::value level) {return level >= _level; }
+        //Messages at this level or above are flushed before the log call returns, e.g. Fatal. OFF: never
+        void setFlushLevel(LogLevel::value level) {_flush_level = level; }
+
+        //Used by the macros in logs.h: the level is checked before any argument of the call is evaluated
+        template <typename Func>
+        void when(LogLevel::value level, Func&& func)
+        {
+            if(level < _level) {return ;}
+            func(*this);
+        }
+
+        //What a statement removed by LOGS_ACTIVE_LEVEL turns into
+        void stripped() {}
+
+        //Returns once every message logged before the call reached the sinks and the sinks pushed it out
+        virtual void flush()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (auto &sink : _sinks) sink->flush();
+        }
 
         //Construct the log message object by passing in parameters, format the log, and finally sink
         void debug(const char* file, size_t line, const char* fmt, ...)
@@ -93,34 +135,159 @@ namespace Logs
             log(LogLevel::value::Fatal, file, line, fmt, ap);
             va_end(ap);
         }
+
+        //"{}" style, e.g. logger->info(Logs::SourceLoc(__FILE__, __LINE__), "x={} y={}", x, y)
+        //Arguments are type checked and written into a stack buffer, no vasprintf and no malloc
+        template <typename... Args>
+        void debug(const SourceLoc& loc, const char* fmt, const Args&... args)
+        {
+            if(LogLevel::value::Debug < _level) {return ;}
+            log(LogLevel::value::Debug, loc, fmt, args...);
+        }
+
+        template <typename... Args>
+        void info(const SourceLoc& loc, const char* fmt, const Args&... args)
+        {
+            if(LogLevel::value::Info < _level) {return ;}
+            log(LogLevel::value::Info, loc, fmt, args...);
+        }
+
+        template <typename... Args>
+        void warn(const SourceLoc& loc, const char* fmt, const Args&... args)
+        {
+            if(LogLevel::value::Warn < _level) {return ;}
+            log(LogLevel::value::Warn, loc, fmt, args...);
+        }
+
+        template <typename... Args>
+        void error(const SourceLoc& loc, const char* fmt, const Args&... args)
+        {
+            if(LogLevel::value::Error < _level) {return ;}
+            log(LogLevel::value::Error, loc, fmt, args...);
+        }
+
+        template <typename... Args>
+        void fatal(const SourceLoc& loc, const char* fmt, const Args&... args)
+        {
+            if(LogLevel::value::Fatal < _level) {return ;}
+            log(LogLevel::value::Fatal, loc, fmt, args...);
+        }
+
+        //Statement described by a static LogSite, see LOGS_DEFER in logs.h
+        //A deferred logger only copies the argument bytes here, the rest happens on the backend thread
+        template <typename... Args>
+        void logSite(const LogSite& site, const Args&... args)
+        {
+            if(site._level < _level) {return ;}
+            if(_deferred == false)
+            {
+                FmtBuffer payload;
+                ArgWriter::format(payload, site._fmt, args...);
+                output(site._level, site._file, site._line, payload);
+                return ;
+            }
+            FmtBuffer rec;
+            rec.reserve(sizeof(DeferredRecord));
+            rec.commit(sizeof(DeferredRecord));
+            ArgPack<Args...>::encode(rec, args...);
+            pushRecord(rec, site._id, &ArgPack<Args...>::decode);
+            if(site._level >= _flush_level) flush();
+        }
     protected:
         void log(LogLevel::value level, const char* file, size_t line, const char* fmt, va_list ap)
         {
-            char* buf;
-            std::string msg;
-            int len = vasprintf(&buf, fmt, ap);
-            if(len < 0) msg = "Failed to format log message! ";
+            //Format into the stack buffer first, only a message larger than it needs a second pass
+            FmtBuffer payload;
+            va_list cp;
+            va_copy(cp, ap);
+            int len = vsnprintf(payload.tail(), payload.writeAbleSize(), fmt, ap);
+            if(len < 0) payload.append("Failed to format log message! ");
             else
             {
-                msg.assign(buf, len);
-                free(buf);
+                if((size_t)len >= payload.writeAbleSize())
+                    vsnprintf(payload.reserve(len + 1), len + 1, fmt, cp);
+                payload.commit(len);
+            }
+            va_end(cp);
+            output(level, file, line, payload);
+        }
+
+        template <typename... Args>
+        void log(LogLevel::value level, const SourceLoc& loc, const char* fmt, const Args&... args)
+        {
+            FmtBuffer payload;
+            ArgWriter::format(payload, fmt, args...);
+            output(level, loc._file, loc._line, payload);
+        }
+
+        void output(LogLevel::value level, const char* file, size_t line, const FmtBuffer& payload)
+        {
+            if(_deferred)
+            {
+                //The backend expects records only, so already formatted text travels as a site 0 record
+                FmtBuffer rec;
+                rec.reserve(sizeof(DeferredRecord));
+                rec.commit(sizeof(DeferredRecord));
+                uint8_t lv = (uint8_t)level;
+                rec.append((const char*)&lv, sizeof(lv));
+                rec.append((const char*)&line, sizeof(line));
+                StrCodec::encode(rec, file, strlen(file));
+                StrCodec::encode(rec, payload.data(), payload.size());
+                pushRecord(rec, 0, nullptr);
+                if(level >= _flush_level) flush();
+                return ;
             }
             //3、Construct log message object
-            LogMsg lm(level, line, file, _logger_name, msg);
-            //4、Get the formatted string
-            std::stringstream ss;
-            _formatter->format(ss, lm);
+            LogMsg lm(level, line, file, _logger_name, LogUtil::StrView(payload.data(), payload.size()));
+            //4、Format straight into a stack buffer
+            FmtBuffer out;
+            _formatter->format(out, lm);
             //5、Log sink
-            logIt(ss.str());
+            logIt(out.data(), out.size());
+            //6、Severe enough to be on disk before the caller goes on, it may be about to die
+            if(level >= _flush_level) flush();
         }
 
-        virtual void logIt(const std::string& msg) = 0;
+        //Fill in the header reserved at the front of rec and hand the record to the async buffer
+        void pushRecord(FmtBuffer& rec, uint32_t site, ArgDecoder decode)
+        {
+            DeferredRecord hdr;
+            hdr._size = rec.size();
+            hdr._site = site;
+            hdr._decode = decode;
+            hdr._sec = LogUtil::Date::now(hdr._nsec);
+            const LogUtil::Thread::Info& ti = LogUtil::Thread::info();
+            hdr._tid = ti._tid;
+            memcpy(hdr._tname, ti._name, sizeof(hdr._tname));
+            memcpy(rec.data(), &hdr, sizeof(hdr));
+            logIt(rec.data(), rec.size());
+        }
+
+        virtual void logIt(const char* data, size_t len) = 0;
+
+        //Queued sinks all get the same copy of the bytes, the others write them right away
+        void writeSinks(const char* data, size_t len)
+        {
+            SinkBatch::ptr shared;
+            for (auto &sink : _sinks)
+            {
+                if (sink->queued() == false)
+                {
+                    sink->log(data, len);
+                    continue;
+                }
+                if (shared == nullptr) shared = SinkBatch::copy(data, len);
+                sink->logShared(shared);
+            }
+        }
     protected:
         std::mutex _mutex;//Ensure the thread safety of log sink
         std::string _logger_name;
         Formatter::ptr _formatter;//The Formatter class in format.hpp uses smart pointer
         std::vector<LogSink::ptr> _sinks;//Sink
         std::atomic<LogLevel::value> _level;//Restriction level, only atomic access in multi-threads can avoid lock conflicts, etc
+        std::atomic<LogLevel::value> _flush_level;
+        bool _deferred;//Async buffer holds DeferredRecords instead of formatted text
     };
 
     //Synchronous logger
@@ -139,19 +306,17 @@ namespace Logs
 
     protected:
         //Sink the log through the sink module handle
-        virtual void logIt(const std::string& msg)
+        virtual void logIt(const char* data, size_t len)
         {
             //Automatically lock and automatically unlock when lock destroyed
             std::unique_lock<std::mutex> lock(_mutex);
             if (_sinks.empty()) return ;
-            for (auto &sink : _sinks)
-            {
-                sink->log(msg.c_str(), msg.size());
-            }
+            writeSinks(data, len);
         }
     };
 
-    class AsyncLogger : public Logger
+    //Registered with CrashHandler for its whole life, see LoggerManager::installCrashHandler
+    class AsyncLogger : public Logger, public CrashTarget
     {
     public:
         using ptr = std::shared_ptr<AsyncLogger>;
@@ -159,25 +324,197 @@ namespace Logs
         AsyncLogger(const std::string& logger_name,
                     Formatter::ptr formatter,
                     std::vector<LogSink::ptr>& sinks,
-                    LogLevel::value level = LogLevel::value::Debug)
+                    LogLevel::value level = LogLevel::value::Debug,
+                    bool deferred = false,
+                    const LooperConfig& config = LooperConfig(),
+                    const PipelineConfig& pipeline = PipelineConfig())
             : Logger(logger_name, formatter, sinks, level)
-            , _looper(std::make_shared<AsyncLooper>(std::bind(&AsyncLogger::backendLogIt, this, std::placeholders::_1)))
+            , _pipeline(pipeline._depth == 0 ? nullptr : new Pipeline(pipeline,
+                        std::bind(&AsyncLogger::writeSinks, this, std::placeholders::_1, std::placeholders::_2),
+                        std::bind(&AsyncLogger::flushSinks, this)))
+            , _looper(std::make_shared<AsyncLooper>(std::bind(&AsyncLogger::backendLogIt, this, std::placeholders::_1), config,
+                                                    std::bind(&AsyncLogger::backendFlush, this)))
         {
+            _deferred = deferred;
+            CrashHandler::add(this);
             std::cout << LogLevel::toString(level) << " Asynchronous logger: " << name() << " created successfully...\n" << std::endl;
         }//Use bind, because backendLogIt also comes with a this pointer
         //After using bind, there is only 1, which means that backendLogIt has been bound, so just pass one parameter instead of this
 
+        ~AsyncLogger() {CrashHandler::remove(this); }
+
     protected:
         //Write data to buffer
-        void logIt(const std::string& msg) {_looper->push(msg); }
+        void logIt(const char* data, size_t len) {_looper->push(data, len); }
+
+    public:
+        //Messages and bytes lost to the overflow policy since the logger was created
+        uint64_t droppedMessages() {return _looper->droppedMessages(); }
+        uint64_t droppedBytes() {return _looper->droppedBytes(); }
+
+        //Hands the queue to the backend right away, whatever batching was waiting for
+        void flush() override {_looper->flush(); }
+
+        //Signal handler: whatever is still queued goes straight to the sinks' descriptors
+        //A batch the backend (or the pipeline) was holding when the process crashed is lost or cut short
+        //Deferred records are formatted here without allocating: a message too big for the stack buffer is cut short
+        void crashDrain(CrashScratch& scratch) override
+        {
+            TimeFormat::signalSafe() = true;
+            _looper->crashVisit([&](const char* data, size_t len){
+                if (_deferred == false)
+                {
+                    crashAppend(scratch, data, len);
+                    return ;
+                }
+                //A spilled batch comes in one piece
+                while (len >= sizeof(DeferredRecord))
+                {
+                    DeferredRecord hdr;
+                    memcpy(&hdr, data, sizeof(hdr));
+                    if (hdr._size < sizeof(hdr) || hdr._size > len) break;
+                    FmtBuffer text((FmtBuffer::Bounded()));
+                    crashFormat(text, hdr, data + sizeof(hdr));
+                    crashAppend(scratch, text.data(), text.size());
+                    data += hdr._size;
+                    len -= hdr._size;
+                }
+            }, scratch._record, sizeof(scratch._record));
+            crashWriteSinks(scratch._out, scratch._len);
+            scratch._len = 0;
+            TimeFormat::signalSafe() = false;
+        }
 
+    protected:
         void backendLogIt(Buffer &msg)
         {
             if (_sinks.empty()) return;
-            for (auto &sink : _sinks) sink->log(msg.begin(), msg.readAbleSize());
+            if (_pipeline)
+            {
+                //Only format here, the pipeline's writer thread does the I/O
+                Pipeline::Batch* batch = _pipeline->acquire();
+                reportDrops(batch->_text);
+                if (_deferred) formatBatch(msg, batch->_text);
+                else batch->_raw.swap(msg);//No copy, the looper resets whatever buffer it gets back
+                _pipeline->submit(batch);
+                return ;
+            }
+            //Format the whole batch first, then each sink gets it in one call
+            _backend_out.clear();
+            reportDrops(_backend_out);
+            if (_deferred) formatBatch(msg, _backend_out);
+            if (_backend_out.empty() == false) writeSinks(_backend_out.data(), _backend_out.size());
+            if (_deferred == false && msg.empty() == false) writeSinks(msg.begin(), msg.readAbleSize());
+        }
+
+        void backendFlush()
+        {
+            if (_pipeline) _pipeline->flush();
+            else flushSinks();
+        }
+
+        void flushSinks()
+        {
+            for (auto &sink : _sinks) sink->flush();
+        }
+
+        void crashAppend(CrashScratch& scratch, const char* data, size_t len)
+        {
+            if (scratch._len + len > sizeof(scratch._out))
+            {
+                crashWriteSinks(scratch._out, scratch._len);
+                scratch._len = 0;
+            }
+            if (len > sizeof(scratch._out))
+            {
+                crashWriteSinks(data, len);
+                return ;
+            }
+            memcpy(scratch._out + scratch._len, data, len);
+            scratch._len += len;
+        }
+
+        void crashWriteSinks(const char* data, size_t len)
+        {
+            if (len == 0) return ;
+            for (auto &sink : _sinks) sink->crashWrite(data, len);
+        }
+
+        //A Warn line in the stream itself, so readers know where messages are missing
+        void reportDrops(FmtBuffer& out)
+        {
+            uint64_t msgs, bytes;
+            if (_looper->takeDrops(msgs, bytes) == false) return ;
+            FmtBuffer payload;
+            ArgWriter::format(payload, "{} messages ({} bytes) dropped, the async queue was full", msgs, bytes);
+            LogMsg lm(LogLevel::value::Warn, __LINE__, __FILE__, _logger_name, LogUtil::StrView(payload.data(), payload.size()));
+            _formatter->format(out, lm);
+        }
+
+        void formatBatch(Buffer& msg, FmtBuffer& out)
+        {
+            while (msg.readAbleSize() >= sizeof(DeferredRecord))
+            {
+                DeferredRecord hdr;
+                memcpy(&hdr, msg.begin(), sizeof(hdr));
+                formatRecord(out, hdr, msg.begin() + sizeof(hdr));
+                msg.pop(hdr._size);
+            }
+        }
+
+        void formatRecord(FmtBuffer& out, const DeferredRecord& hdr, const char* args)
+        {
+            const LogSite* site = hdr._site == 0 ? nullptr : LogSiteRegistry::get(_sites, hdr._site);
+            if (hdr._site != 0 && site == nullptr) return ;
+            FmtBuffer payload;
+            formatRecord(out, payload, hdr, args, site);
+        }
+
+        //The backend may be updating _sites, the registry's lock-free table is read instead
+        void crashFormat(FmtBuffer& out, const DeferredRecord& hdr, const char* args)
+        {
+            const LogSite* site = hdr._site == 0 ? nullptr : LogSiteRegistry::find(hdr._site);
+            if (hdr._site != 0 && site == nullptr) return ;
+            FmtBuffer payload((FmtBuffer::Bounded()));
+            formatRecord(out, payload, hdr, args, site);
+        }
+
+        //site: nullptr for a record carrying its own text
+        void formatRecord(FmtBuffer& out, FmtBuffer& payload, const DeferredRecord& hdr, const char* args, const LogSite* site)
+        {
+            LogLevel::value level;
+            const char* file;
+            uint32_t file_len;
+            size_t line;
+            if (site == nullptr)
+            {
+                uint8_t lv;
+                memcpy(&lv, args, sizeof(lv));
+                memcpy(&line, args + sizeof(lv), sizeof(line));
+                level = (LogLevel::value)lv;
+                args = StrCodec::decode(args + sizeof(lv) + sizeof(line), file, file_len);
+                StrCodec::decode(payload, args);
+            }
+            else
+            {
+                level = site->_level;
+                file = site->_file;
+                file_len = strlen(file);
+                line = site->_line;
+                hdr._decode(payload, site->_fmt, args);
+            }
+            LogMsg lm(level, line, LogUtil::StrView(file, file_len), _logger_name,
+                      LogUtil::StrView(payload.data(), payload.size()), hdr._sec, hdr._nsec, hdr._tid);
+            lm._tname = LogUtil::StrView(hdr._tname, strnlen(hdr._tname, sizeof(hdr._tname)));
+            _formatter->format(out, lm);
         }
 
     private:
+        //Only touched by the backend thread, declared before _looper so they outlive it
+        FmtBuffer _backend_out;
+        std::vector<const LogSite*> _sites;//Snapshot of LogSiteRegistry
+        //Declared before _looper: the looper's last batches go through it, then it writes what is left
+        std::unique_ptr<Pipeline> _pipeline;
         AsyncLooper::ptr _looper;
     };
 
@@ -190,20 +527,50 @@ namespace Logs
         using ptr = std::shared_ptr<Builder>;
 
         Builder()
-            : _logger_type(Logger::Type::LOGGER_SYNC), _level(LogLevel::value::Info)
+            : _logger_type(Logger::Type::LOGGER_SYNC), _level(LogLevel::value::Info), _flush_level(LogLevel::value::OFF), _deferred(false)
         {}
 
         void buildLoggerType(Logger::Type type) { _logger_type = type; }
         void buildLoggerName(const std::string& name) { _logger_name = name; }
         void buildLoggerLevel(LogLevel::value level) { _level = level; }
+        //Messages at this level or above are flushed before the call returns, e.g. Fatal
+        void buildFlushOn(LogLevel::value level) { _flush_level = level; }
+        //Asynchronous loggers only: format on the backend thread, see LOGS_DEFER
+        void buildDeferred(bool deferred = true) { _deferred = deferred; }
+        //Asynchronous loggers only: one queue per logging thread instead of one shared queue
+        void buildPerThreadQueues(bool per_thread = true) { _looper_config._per_thread = per_thread; }
+        //Asynchronous loggers only: bytes of the queue, 4MB by default. Per thread with buildPerThreadQueues, 256KB by default
+        void buildBufferSize(size_t capacity) { _looper_config._capacity = capacity; }
+        //Asynchronous loggers only: serviced by a shared pool instead of a thread of their own
+        //GlobalLoggerBuilder defaults to LoggerManager's pool when one was set
+        void buildBackendPool(const BackendPool::ptr& pool) { _looper_config._pool = pool; }
+        //Asynchronous loggers only: what happens when the queue is full, timeout is for ASYNC_TIMEOUT
+        void buildAsyncType(AsyncType type, std::chrono::milliseconds timeout = std::chrono::milliseconds(10))
+        {
+            _looper_config._type = type;
+            _looper_config._timeout = timeout;
+        }
+        //Asynchronous loggers only: hand the sinks batches of at least bytes, or whatever is queued after max_latency
+        void buildBatching(size_t bytes, std::chrono::microseconds max_latency = std::chrono::microseconds(2000))
+        {
+            _looper_config._batch_bytes = bytes;
+            _looper_config._max_latency = max_latency;
+        }
+        //Asynchronous loggers only: format, encode and write overlap, with depth batches in flight
+        //encode_threads run encoder, which may be empty
+        void buildPipeline(size_t depth, size_t encode_threads = 1, const PipelineConfig::Encoder& encoder = PipelineConfig::Encoder())
+        {
+            _pipeline_config._depth = depth;
+            _pipeline_config._encode_threads = encode_threads;
+            _pipeline_config._encoder = encoder;
+        }
         void buildFormatter(const std::string& pattern) { _formatter = std::make_shared<Formatter>(pattern); }
         void buildFormatter(const Formatter::ptr& formatter) { _formatter = formatter; }
-        /*void changeLooperType()
+        //JSON or logfmt lines, fields are constant key/value pairs added to every line
+        void buildFormatter(StructuredFormatter::Style style, const StructuredFormatter::Fields& fields = StructuredFormatter::Fields())
         {
-            if (_looper_type == AsyncType::ASYNC_UNSAFE)
-                _looper_type = AsyncType::ASYNC_SAFE;
-            else _looper_type = AsyncType::ASYNC_UNSAFE;
-        }*/
+            _formatter = std::make_shared<StructuredFormatter>(style, fields);
+        }
 
         template <typename SinkType, typename... Args>
         void buildSink(Args &&...args)
@@ -211,6 +578,12 @@ namespace Logs
             auto psink = SinkFactory::create<SinkType>(std::forward<Args>(args)...);
             _sinks.push_back(psink);
         }
+        //A sink built elsewhere, possibly shared with other loggers: unless it queues, calls to it are serialized
+        void buildSink(const LogSink::ptr& sink)
+        {
+            if (sink->queued()) _sinks.push_back(sink);
+            else _sinks.push_back(std::make_shared<SerialSink>(sink));
+        }
 
         virtual Logger::ptr build() = 0;
 
@@ -218,6 +591,10 @@ namespace Logs
         Logger::Type _logger_type;
         std::string _logger_name;//Find the logger by _logger_name
         LogLevel::value _level;
+        LogLevel::value _flush_level;
+        bool _deferred;
+        LooperConfig _looper_config;
+        PipelineConfig _pipeline_config;
         Formatter::ptr _formatter;
         std::vector<LogSink::ptr> _sinks;
     };
@@ -247,9 +624,10 @@ namespace Logs
             }
             Logger::ptr lp;
             if(_logger_type == Logger::Type::LOGGER_ASYNC)
-                lp = std::make_shared<AsyncLogger>(_logger_name, _formatter, _sinks, _level);
+                lp = std::make_shared<AsyncLogger>(_logger_name, _formatter, _sinks, _level, _deferred, _looper_config, _pipeline_config);
             else
                 lp = std::make_shared<SyncLogger>(_logger_name, _formatter, _sinks, _level);
+            lp->setFlushLevel(_flush_level);
             return lp;
         }
     };
@@ -300,6 +678,33 @@ namespace Logs
             std::unique_lock<std::mutex> lock(_mutex);
             return _root_logger; 
         }
+
+        //One pool of threads servicing every asynchronous logger built afterwards by GlobalLoggerBuilder
+        //Loggers that already exist keep their own thread
+        void setBackendPool(size_t threads)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _pool = std::make_shared<BackendPool>(threads);
+        }
+
+        BackendPool::ptr backendPool()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _pool;
+        }
+
+        //Memory of the async buffers, shared by every logger: limit in bytes (0 for none), huge page backing
+        //Rings and records too big for them count too. Past the limit, ASYNC_UNSAFE loggers drop what they would have spilled,
+        //the other policies (except ASYNC_SAFE) drop oversize records and new threads get smaller rings in per-thread mode
+        void setBufferMemory(size_t limit, bool huge_pages = false)
+        {
+            BlockArena::instance().setLimit(limit);
+            BlockArena::instance().setHugePages(huge_pages);
+        }
+
+        //On SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT, every asynchronous logger writes what it still queues
+        //to its sinks before the process dies. Call it from the main thread early, see crash.hpp
+        void installCrashHandler() {CrashHandler::install(); }
     private:
         LoggerManager()
         {
@@ -316,6 +721,7 @@ namespace Logs
         }
     private:
         std::mutex _mutex;
+        BackendPool::ptr _pool;//Declared first, destroyed after the loggers using it
         Logger::ptr _root_logger;
         std::unordered_map<std::string, Logger::ptr> _loggers;//Easy to find
     };
@@ -341,11 +747,14 @@ namespace Logs
                 std::cout << "Current logger: " << _logger_name << " doesn't detect the sink direction, and default setting is standard output! \n";
                 buildSink<StdoutSink>(); 
             }
+            if(_looper_config._pool == nullptr)
+                _looper_config._pool = LoggerManager::getInstance().backendPool();
             Logger::ptr lp;
             if(_logger_type == Logger::Type::LOGGER_ASYNC)
-                lp = std::make_shared<AsyncLogger>(_logger_name, _formatter, _sinks, _level);
+                lp = std::make_shared<AsyncLogger>(_logger_name, _formatter, _sinks, _level, _deferred, _looper_config, _pipeline_config);
             else
                 lp = std::make_shared<SyncLogger>(_logger_name, _formatter, _sinks, _level);
+            lp->setFlushLevel(_flush_level);
             LoggerManager::getInstance().addLogger(_logger_name, lp);
             return lp;
         }
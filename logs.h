@@ -15,17 +15,94 @@ namespace Logs
         return Logs::LoggerManager::getInstance().rootLogger();
     }
 
-    #define DeBug(fmt, ...) debug(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
-    #define InFo(fmt, ...) info(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
-    #define WaRn(fmt, ...) warn(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
-    #define ErrOr(fmt, ...) error(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
-    #define FaTal(fmt, ...) fatal(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
+    //Runs the call only if the logger accepts the level, so its arguments are never evaluated otherwise
+    #define LOGS_WHEN(level, ...) when(level, [&](Logs::Logger& logs_l_) { logs_l_.__VA_ARGS__; })
 
+    //Deferred style, fmt must be a string literal. A deferred asynchronous logger only copies
+    //the argument bytes on the caller thread, other loggers format immediately
+    #define LOGS_DEFER(logger, level, fmt, ...) do { \
+        auto&& logs_l_ = (logger); \
+        if (logs_l_->shouldLog(level) == false) break; \
+        static const Logs::LogSite logs_site_(level, __FILE__, __LINE__, fmt); \
+        logs_l_->logSite(logs_site_, ##__VA_ARGS__); \
+    } while(0)
+
+    /*Per level:
+        DeBug/InFo/...: logger->InFo("%d", x), printf style
+        DeBugF/InFoF/...: logger->InFoF("{}", x), "{}" style
+        DEFER_DEBUG/DEFER_INFO/...: DEFER_INFO(logger, "{}", x), deferred style
+        DEBUG/INFO/... and DEBUGF/INFOF/...: the same on the root logger
+      Below LOGS_ACTIVE_LEVEL they expand to nothing, arguments included
+    */
+    #if LOGS_ACTIVE_LEVEL <= LOGS_LEVEL_DEBUG
+    #define DeBug(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Debug, debug(__FILE__, __LINE__, fmt, ##__VA_ARGS__))
+    #define DeBugF(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Debug, debug(Logs::SourceLoc(__FILE__, __LINE__), fmt, ##__VA_ARGS__))
+    #define DEFER_DEBUG(logger, fmt, ...) LOGS_DEFER(logger, Logs::LogLevel::value::Debug, fmt, ##__VA_ARGS__)
     #define DEBUG(fmt, ...) Logs::rootLogger()->DeBug(fmt, ##__VA_ARGS__)
+    #define DEBUGF(fmt, ...) Logs::rootLogger()->DeBugF(fmt, ##__VA_ARGS__)
+    #else
+    #define DeBug(fmt, ...) stripped()
+    #define DeBugF(fmt, ...) stripped()
+    #define DEFER_DEBUG(logger, fmt, ...) do {} while(0)
+    #define DEBUG(fmt, ...) ((void)0)
+    #define DEBUGF(fmt, ...) ((void)0)
+    #endif
+
+    #if LOGS_ACTIVE_LEVEL <= LOGS_LEVEL_INFO
+    #define InFo(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Info, info(__FILE__, __LINE__, fmt, ##__VA_ARGS__))
+    #define InFoF(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Info, info(Logs::SourceLoc(__FILE__, __LINE__), fmt, ##__VA_ARGS__))
+    #define DEFER_INFO(logger, fmt, ...) LOGS_DEFER(logger, Logs::LogLevel::value::Info, fmt, ##__VA_ARGS__)
     #define INFO(fmt, ...) Logs::rootLogger()->InFo(fmt, ##__VA_ARGS__)
+    #define INFOF(fmt, ...) Logs::rootLogger()->InFoF(fmt, ##__VA_ARGS__)
+    #else
+    #define InFo(fmt, ...) stripped()
+    #define InFoF(fmt, ...) stripped()
+    #define DEFER_INFO(logger, fmt, ...) do {} while(0)
+    #define INFO(fmt, ...) ((void)0)
+    #define INFOF(fmt, ...) ((void)0)
+    #endif
+
+    #if LOGS_ACTIVE_LEVEL <= LOGS_LEVEL_WARN
+    #define WaRn(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Warn, warn(__FILE__, __LINE__, fmt, ##__VA_ARGS__))
+    #define WaRnF(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Warn, warn(Logs::SourceLoc(__FILE__, __LINE__), fmt, ##__VA_ARGS__))
+    #define DEFER_WARN(logger, fmt, ...) LOGS_DEFER(logger, Logs::LogLevel::value::Warn, fmt, ##__VA_ARGS__)
     #define WARN(fmt, ...) Logs::rootLogger()->WaRn(fmt, ##__VA_ARGS__)
+    #define WARNF(fmt, ...) Logs::rootLogger()->WaRnF(fmt, ##__VA_ARGS__)
+    #else
+    #define WaRn(fmt, ...) stripped()
+    #define WaRnF(fmt, ...) stripped()
+    #define DEFER_WARN(logger, fmt, ...) do {} while(0)
+    #define WARN(fmt, ...) ((void)0)
+    #define WARNF(fmt, ...) ((void)0)
+    #endif
+
+    #if LOGS_ACTIVE_LEVEL <= LOGS_LEVEL_ERROR
+    #define ErrOr(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Error, error(__FILE__, __LINE__, fmt, ##__VA_ARGS__))
+    #define ErrOrF(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Error, error(Logs::SourceLoc(__FILE__, __LINE__), fmt, ##__VA_ARGS__))
+    #define DEFER_ERROR(logger, fmt, ...) LOGS_DEFER(logger, Logs::LogLevel::value::Error, fmt, ##__VA_ARGS__)
     #define ERROR(fmt, ...) Logs::rootLogger()->ErrOr(fmt, ##__VA_ARGS__)
+    #define ERRORF(fmt, ...) Logs::rootLogger()->ErrOrF(fmt, ##__VA_ARGS__)
+    #else
+    #define ErrOr(fmt, ...) stripped()
+    #define ErrOrF(fmt, ...) stripped()
+    #define DEFER_ERROR(logger, fmt, ...) do {} while(0)
+    #define ERROR(fmt, ...) ((void)0)
+    #define ERRORF(fmt, ...) ((void)0)
+    #endif
+
+    #if LOGS_ACTIVE_LEVEL <= LOGS_LEVEL_FATAL
+    #define FaTal(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Fatal, fatal(__FILE__, __LINE__, fmt, ##__VA_ARGS__))
+    #define FaTalF(fmt, ...) LOGS_WHEN(Logs::LogLevel::value::Fatal, fatal(Logs::SourceLoc(__FILE__, __LINE__), fmt, ##__VA_ARGS__))
+    #define DEFER_FATAL(logger, fmt, ...) LOGS_DEFER(logger, Logs::LogLevel::value::Fatal, fmt, ##__VA_ARGS__)
     #define FATAL(fmt, ...) Logs::rootLogger()->FaTal(fmt, ##__VA_ARGS__)
+    #define FATALF(fmt, ...) Logs::rootLogger()->FaTalF(fmt, ##__VA_ARGS__)
+    #else
+    #define FaTal(fmt, ...) stripped()
+    #define FaTalF(fmt, ...) stripped()
+    #define DEFER_FATAL(logger, fmt, ...) do {} while(0)
+    #define FATAL(fmt, ...) ((void)0)
+    #define FATALF(fmt, ...) ((void)0)
+    #endif
 }
 
 #endif
\ No newline at end of file
@@ -4,6 +4,8 @@
 #define __M_LOOP_H__
 
 #include "buffer.hpp"
+#include "ring.hpp"
+#include "pool.hpp"
 #include "util.hpp"
 #include <thread>
 #include <mutex>
@@ -11,83 +13,809 @@
 #include <functional>
 #include <memory>
 #include <atomic>
+#include <vector>
+#include <algorithm>
+#include <chrono>
 
 namespace Logs
 {
     //using Functor = std::function<void(Buffer &)>;
 
+    #define DEFAULT_THREAD_RING_SIZE (256 * 1024)//Per-thread mode: every logging thread holds one
+    //Per-thread mode: past BlockArena's limit a new thread's ring is halved down to this size, which is always granted
+    #define MIN_THREAD_RING_SIZE (64 * 1024)
+
+    //What push does when the ring is full
     enum class AsyncType
     {
         ASYNC_SAFE,//Blocked when full
-        ASYNC_UNSAFE//Unlimited expansion for testing
+        ASYNC_UNSAFE,//Expansion up to BlockArena's limit: full rings spill into a locked overflow buffer
+        ASYNC_TIMEOUT,//Blocked for at most LooperConfig::_timeout, then the message is dropped
+        ASYNC_DROP_NEWEST,//The new message is dropped, the caller never waits
+        ASYNC_DROP_OLDEST//The oldest queued messages are dropped, a batch at a time, to make room
+    };
+
+    struct LooperConfig
+    {
+        LooperConfig()
+            : _capacity(0), _per_thread(false), _type(AsyncType::ASYNC_SAFE)
+            , _timeout(10), _drop_report_interval(1000), _batch_bytes(0), _max_latency(2000)
+        {}
+
+        //Bytes of the shared ring, or of each per-thread ring. 0: DEFAULT_BUFFER_SIZE, DEFAULT_THREAD_RING_SIZE per thread
+        size_t _capacity;
+        //Every producer thread gets its own ring, the worker merges them by timestamp
+        //Removes the contention on the shared ring, costs _capacity bytes per logging thread
+        bool _per_thread;
+        AsyncType _type;
+        std::chrono::milliseconds _timeout;//ASYNC_TIMEOUT only
+        //Dropped messages are reported in the log itself, at most once per interval
+        std::chrono::milliseconds _drop_report_interval;
+        //Serviced by this shared pool instead of a thread of its own, see pool.hpp
+        //Drops are then reported with the next batch rather than on a timer
+        BackendPool::ptr _pool;
+        //Batching, off when 0: the worker waits for this many queued bytes, or for _max_latency
+        //after it noticed the first record, before handing a batch to the callback
+        //Capped at half a ring (per ring in per-thread mode), a full ring always wakes the worker
+        size_t _batch_bytes;
+        std::chrono::microseconds _max_latency;
     };
 
-    class AsyncLooper
+    //Without a pool: one worker thread per looper
+    //With a pool: _scheduled says whether the looper sits in a pool deque or is being run,
+    //whoever moves it from IDLE to SCHEDULED (or ARMED) is the only one allowed to drain it
+    class AsyncLooper : public BackendTask
     {
     public:
         using Functor = std::function<void(Buffer& buffer)>;
+        using FlushFunctor = std::function<void()>;
         using ptr = std::shared_ptr<AsyncLooper>;
 
-        AsyncLooper(const Functor &cb)//, AsyncType loop_type = AsyncType::ASYNC_SAFE
-            : _stop(false), _thread(std::thread(&AsyncLooper::worker_loop, this)), _callBack(cb)//, _looper_type(loop_type)
-        {}
+        enum
+        {
+            IDLE,//Pool only: nothing to do
+            ARMED,//Pool only, batching: a pool timer will run it after _max_latency
+            SCHEDULED,//Pool only: queued or being run
+            RESCHEDULE//Pool only: being run, and more was published since it started
+        };
 
-        ~AsyncLooper() {stop(); };
+        //flush_cb runs on the worker side once a flush() request has been through cb
+        AsyncLooper(const Functor &cb, const LooperConfig& config = LooperConfig(), const FlushFunctor& flush_cb = FlushFunctor())
+            : _stop(false), _sleeping(false), _lingering(false), _urgent(false), _scheduled(IDLE), _active(0)
+            , _callBack(cb), _flushCallBack(flush_cb), _config(withCapacity(config)), _id(nextId())
+            , _batch_threshold(config._batch_bytes == 0 ? 0 : std::min(config._batch_bytes, _config._capacity / 2))
+            , _flush_pending(false), _flush_closed(false), _flush_reserved(0), _flush_gen(0)
+            , _ring(config._per_thread ? 64 : _config._capacity)
+            , _overflowing(false), _overflow_gen(1), _dropped_msgs(0), _dropped_bytes(0), _reported_msgs(0), _reported_bytes(0)
+            , _stage(config._per_thread ? new Buffer() : nullptr)
+            , _held(config._per_thread ? new Buffer() : nullptr)
+            , _overflow(config._type == AsyncType::ASYNC_UNSAFE ? new Buffer() : nullptr)
+            , _tasks_pop(config._pool ? nullptr : new Buffer())
+        {
+            //Started last, worker_loop uses the rings and the buffers
+            if (_config._pool == nullptr) _thread = std::thread(&AsyncLooper::worker_loop, this);
+        }
+
+        ~AsyncLooper()
+        {
+            stop();
+            //Threads still holding our rings drop them the next time they look theirs up
+            for (auto& q : _queues) q->orphan();
+        }
 
         void stop()
         {
-            _stop = true;//Corresponds to worker_loop
+            if (_config._pool)
+            {
+                stopPooled();
+                return ;
+            }
+            {
+                //Set under the lock, otherwise the worker may check _stop, miss the notify and sleep forever
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;//Corresponds to worker_loop
+            }
             _pop_cond.notify_all();
             _thread.join();//Wait for the worker thread to exit and then recycle
+            closeFlush();
         }
 
-        void push(const std::string &msg)
+        //Everything logged before this call goes through the callback, then the flush callback runs,
+        //whatever batching was waiting for. Callers are served one at a time
+        void flush()
+        {
+            std::unique_lock<std::mutex> serial(_flusher_mutex);
+            std::unique_lock<std::mutex> lock(_flush_mutex);
+            if (_flush_closed) return ;
+            //What the worker has to get past, read before it can see the request
+            _flush_reserved = _config._per_thread ? 0 : _ring.reserved();
+            _flush_gen = _overflowing.load(std::memory_order_acquire) ? _overflow_gen.load(std::memory_order_acquire) : 0;
+            _flush_pending.store(true, std::memory_order_release);
+            lock.unlock();
+            wakeUp(true);
+            lock.lock();
+            _flush_cond.wait(lock, [&]{ return _flush_pending.load(std::memory_order_acquire) == false; });
+        }
+
+        //No lock on this path: reserve, copy and publish in the ring,
+        //then wake the worker only if it went to sleep. A full ring is handled by the AsyncType
+        //With batching, only the first record of a batch and a full batch wake it
+        void push(const char* data, size_t len)
         {
             if (_stop) return;
+            size_t pending = 0;
+            bool queued = _config._per_thread ? pushLocal(data, len, pending) : pushShared(data, len, pending);
+            if (queued == false)
             {
-                std::unique_lock<std::mutex> lock(_mutex);
-                //Directly implemented as blocking waiting, which is the original AsyncType::ASYNC_SAFE
-                _push_cond.wait(lock, [&]{ return _tasks_push.writeAbleSize() >= msg.size(); });
-                _tasks_push.push(msg.c_str(), msg.size());
+                _dropped_msgs.fetch_add(1, std::memory_order_relaxed);
+                _dropped_bytes.fetch_add(len, std::memory_order_relaxed);
+                return ;
             }
-            _pop_cond.notify_all();
+            wakeUp(pending >= _batch_threshold);
+        }
+
+        //Totals since the looper was created
+        uint64_t droppedMessages() {return _dropped_msgs.load(std::memory_order_relaxed); }
+        uint64_t droppedBytes() {return _dropped_bytes.load(std::memory_order_relaxed); }
+
+        //Worker side: drops not reported yet, at most once per _drop_report_interval
+        bool takeDrops(uint64_t& msgs, uint64_t& bytes)
+        {
+            uint64_t total = _dropped_msgs.load(std::memory_order_relaxed);
+            if (total == _reported_msgs) return false;
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (_stop == false && now - _last_report < _config._drop_report_interval) return false;
+            msgs = total - _reported_msgs;
+            bytes = _dropped_bytes.load(std::memory_order_relaxed) - _reported_bytes;
+            _reported_msgs = total;
+            _reported_bytes += bytes;
+            _last_report = now;
+            return true;
+        }
+
+        //Crash handler side: fn(data, len) on every record still queued, nothing is consumed and no lock is taken
+        //Records already drained into a batch are not seen. Per-thread rings come one after another, not merged,
+        //after the records the last pass held back
+        template <typename Fn>
+        void crashVisit(Fn fn, char* scratch, size_t cap)
+        {
+            if (_config._per_thread == false)
+            {
+                _ring.crashVisit(fn, scratch, cap);
+                //Spilled records follow the ring, in one piece
+                if (_overflowing.load(std::memory_order_acquire) && _overflow->readAbleSize() > 0)
+                    fn(_overflow->begin(), _overflow->readAbleSize());
+                return ;
+            }
+            visitStaged(fn, _held->begin(), _held->readAbleSize());
+            //A thread's spilled records are older than what is in its ring
+            if (_overflowing.load(std::memory_order_acquire)) visitStaged(fn, _overflow->begin(), _overflow->readAbleSize());
+            for (size_t i = 0; i < _queues.size(); ++i)
+                _queues[i]->crashVisit([&](uint64_t, const char* data, size_t len){ fn(data, len); }, scratch, cap);
+        }
+
+        //Pool side: drain one batch, then go back to the end of a deque if more arrived meanwhile,
+        //so that a busy logger doesn't starve the others
+        void run(Buffer& out) override
+        {
+            _active.fetch_add(1, std::memory_order_acquire);
+            //Fired by the timer: from here on producers see a run in progress
+            int state = ARMED;
+            _scheduled.compare_exchange_strong(state, SCHEDULED, std::memory_order_acq_rel);
+            //Pairs with wakeUp: a producer that saw ARMED and left without waking anyone has its record drained below
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool flushing = _flush_pending.load(std::memory_order_acquire);
+            if (drainInto(out, flushing) > 0 || _dropped_msgs.load(std::memory_order_relaxed) != _reported_msgs)
+                _callBack(out);
+            if (flushing) serveFlush();
+            state = SCHEDULED;
+            if (_flush_pending.load(std::memory_order_acquire) || holding())
+            {
+                //A flush still waits for records being written, or records were held back, come back right away
+                _scheduled.store(SCHEDULED, std::memory_order_release);
+                _config._pool->submit(this);
+            }
+            else if (_scheduled.compare_exchange_strong(state, IDLE, std::memory_order_acq_rel) == false)
+            {
+                //RESCHEDULE: a producer published while we were draining
+                if (_batch_threshold == 0 || _urgent.exchange(false, std::memory_order_relaxed))
+                {
+                    _scheduled.store(SCHEDULED, std::memory_order_release);
+                    _config._pool->submit(this);
+                }
+                else
+                {
+                    _scheduled.store(ARMED, std::memory_order_release);
+                    _config._pool->submitAt(this, std::chrono::steady_clock::now() + _config._max_latency);
+                }
+            }
+            _active.fetch_sub(1, std::memory_order_release);//Last access, stopPooled may destroy us right after
         }
     private:
+        //Take the looper away from the pool for good, then drain what is left on this thread
+        void stopPooled()
+        {
+            _stop = true;
+            while (1)
+            {
+                int state = IDLE;
+                if (_scheduled.compare_exchange_strong(state, SCHEDULED, std::memory_order_acq_rel)) break;
+                //Waiting for a timer: ours if we can take it back, otherwise it fired and the run will go IDLE
+                if (state == ARMED && _scheduled.compare_exchange_strong(state, SCHEDULED, std::memory_order_acq_rel)
+                    && _config._pool->cancel(this)) break;
+                std::this_thread::yield();
+            }
+            while (_active.load(std::memory_order_acquire) > 0) std::this_thread::yield();
+            Buffer out;
+            //A reserved record is always published soon after
+            while (emptyLocked() == false)
+            {
+                if (drainInto(out, true) == 0) std::this_thread::yield();
+                else
+                {
+                    _callBack(out);
+                    out.reset();
+                }
+            }
+            if (_dropped_msgs.load(std::memory_order_relaxed) != _reported_msgs) _callBack(out);
+            closeFlush();
+        }
+
+        //Worker side, in a pass that started after the flush request and whose batch went through the callback
+        //Per-thread rings are drained completely by such a pass, the shared ring up to the records reserved before flush()
+        void serveFlush()
+        {
+            if ((_config._per_thread == false && _ring.consumed() < _flush_reserved)
+                || _overflow_gen.load(std::memory_order_acquire) <= _flush_gen)
+            {
+                std::this_thread::yield();//A record reserved earlier is still being written, or the spill is not taken yet
+                return ;
+            }
+            if (_flushCallBack) _flushCallBack();
+            std::unique_lock<std::mutex> lock(_flush_mutex);
+            _flush_pending.store(false, std::memory_order_release);
+            _flush_cond.notify_all();
+        }
+
+        //Stopped and drained: release a waiting flush() and refuse new ones
+        void closeFlush()
+        {
+            std::unique_lock<std::mutex> lock(_flush_mutex);
+            _flush_closed = true;
+            if (_flush_pending.load(std::memory_order_acquire) == false) return ;
+            if (_flushCallBack) _flushCallBack();
+            _flush_pending.store(false, std::memory_order_release);
+            _flush_cond.notify_all();
+        }
+
+        //all: flush or stop, per-thread mode holds nothing back for the next pass
+        size_t drainInto(Buffer& out, bool all)
+        {
+            if (_config._per_thread) return drainLocal(out, all);
+            return _ring.drain(out, _ring.capacity()) + drainOverflow(out);
+        }
+
+        //pending: bytes queued after the push, a spill counts as a full batch
+        bool pushShared(const char* data, size_t len, size_t& pending)
+        {
+            bool queued = true;
+            switch (_config._type)
+            {
+            case AsyncType::ASYNC_TIMEOUT:
+                queued = _ring.pushUntil(data, len, std::chrono::steady_clock::now() + _config._timeout);
+                break;
+            case AsyncType::ASYNC_DROP_NEWEST:
+                queued = _ring.tryPush(data, len);
+                break;
+            case AsyncType::ASYNC_DROP_OLDEST:
+                while (_ring.tryPush(data, len) == false)
+                {
+                    //Nothing left to drop: BlockArena refused the copy of an oversize record
+                    if (_ring.empty())
+                    {
+                        queued = _ring.tryPush(data, len);
+                        break;
+                    }
+                    dropOldest(_ring);
+                }
+                break;
+            case AsyncType::ASYNC_UNSAFE:
+                //Once something spilled, everything spills until the worker takes it, to keep the order
+                if (_overflowing.load(std::memory_order_acquire) || _ring.tryPush(data, len) == false)
+                {
+                    pending = (size_t)-1;
+                    return pushOverflow(data, len, 0) != 0;
+                }
+                break;
+            default:
+                _ring.push(data, len);
+            }
+            pending = _ring.pendingBytes();
+            return queued;
+        }
+
+        //Per-thread mode: the calling thread's ring, created on its first message
+        bool pushLocal(const char* data, size_t len, size_t& pending)
+        {
+            SpscRing* q = localQueue();
+            q->beginPush();
+            bool queued = pushStamped(q, q->stamp(LogUtil::Date::steady()), data, len, pending);
+            q->endPush();
+            return queued;
+        }
+
+        bool pushStamped(SpscRing* q, uint64_t stamp, const char* data, size_t len, size_t& pending)
+        {
+            //ASYNC_UNSAFE: once this thread spilled, it keeps spilling until the worker has taken that batch,
+            //otherwise its next records could be merged before the spilled ones
+            pending = (size_t)-1;
+            if (_config._type == AsyncType::ASYNC_UNSAFE && q->spillGeneration() == _overflow_gen.load(std::memory_order_acquire))
+                return spill(q, data, len, stamp);
+            //Only ASYNC_SAFE copies an oversize record past BlockArena's limit, the others apply their policy
+            bool capped = _config._type != AsyncType::ASYNC_SAFE;
+            if (q->tryPush(data, len, stamp, capped))
+            {
+                pending = q->pendingBytes();
+                return true;
+            }
+            std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + _config._timeout;
+            switch (_config._type)
+            {
+            case AsyncType::ASYNC_DROP_NEWEST:
+                return false;
+            case AsyncType::ASYNC_DROP_OLDEST:
+                while (q->tryPush(data, len, stamp, capped) == false)
+                {
+                    if (q->empty()) return q->tryPush(data, len, stamp, capped);
+                    dropOldest(*q);
+                }
+                return true;
+            case AsyncType::ASYNC_UNSAFE:
+                return spill(q, data, len, stamp);
+            default:
+                //Full: make sure the worker is draining, back off while it does
+                for (size_t spins = 0; q->tryPush(data, len, stamp, capped) == false; ++spins)
+                {
+                    if (_config._type == AsyncType::ASYNC_TIMEOUT && std::chrono::steady_clock::now() >= deadline) return false;
+                    wakeUp(true);
+                    if (spins < 64) std::this_thread::yield();
+                    else std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+                return true;
+            }
+        }
+
+        //Throw away a quarter of the ring, oldest first, and count it as dropped
+        template <typename Ring>
+        void dropOldest(Ring& ring)
+        {
+            wakeUp(true);
+            size_t records = 0, bytes = 0;
+            if (ring.discard(ring.capacity() / 4, records, bytes) && records > 0)
+            {
+                _dropped_msgs.fetch_add(records, std::memory_order_relaxed);
+                _dropped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            }
+            else std::this_thread::yield();//The worker is draining, or the oldest record is still being written
+        }
+
+        bool spill(SpscRing* q, const char* data, size_t len, uint64_t stamp)
+        {
+            uint64_t gen = pushOverflow(data, len, stamp);
+            if (gen == 0) return false;
+            q->setSpillGeneration(gen);
+            return true;
+        }
+
+        //Per-thread mode keeps the stamp in front of the record, like SpscRing::drain does
+        //Returns the generation of the batch the record went into, 0 if BlockArena's limit was reached and it was dropped
+        uint64_t pushOverflow(const char* data, size_t len, uint64_t stamp)
+        {
+            std::unique_lock<std::mutex> lock(_overflow_mutex);
+            if (_overflow->tryReserve(len + (_config._per_thread ? sizeof(StagedRecord) : 0)) == false) return 0;
+            if (_config._per_thread)
+            {
+                StagedRecord staged;
+                staged._stamp = stamp;
+                staged._len = len;
+                _overflow->push((const char*)&staged, sizeof(staged));
+            }
+            _overflow->push(data, len);
+            _overflowing.store(true, std::memory_order_release);
+            return _overflow_gen.load(std::memory_order_relaxed);
+        }
+
+        //Worker side: take the spilled records
+        //Shared ring: behind the ring, and only once it is empty, a record reserved before the spill may still be unpublished
+        //Per-thread rings: before the rings, sorted by stamp, threads append in lock order but stamp before locking
+        size_t drainOverflow(Buffer& out)
+        {
+            if (_overflowing.load(std::memory_order_acquire) == false) return 0;
+            if (_config._per_thread == false && _ring.empty() == false) return 0;
+            std::unique_lock<std::mutex> lock(_overflow_mutex);
+            size_t len = _overflow->readAbleSize();
+            if (_config._per_thread) sortOverflow(out);
+            else out.push(_overflow->begin(), len);
+            _overflow->reset();
+            _overflow->shrink();//Spills are bursts, the ring has room again
+            _overflow_gen.fetch_add(1, std::memory_order_release);
+            _overflowing.store(false, std::memory_order_release);
+            return len;
+        }
+
+        //Each thread's records are already in order, a stable sort keeps it that way
+        void sortOverflow(Buffer& out)
+        {
+            const char* base = _overflow->begin();
+            size_t len = _overflow->readAbleSize();
+            _order.clear();
+            for (size_t pos = 0; pos < len;)
+            {
+                StagedRecord staged;
+                memcpy(&staged, base + pos, sizeof(staged));
+                _order.push_back(std::make_pair(staged._stamp, pos));
+                pos += sizeof(staged) + staged._len;
+            }
+            std::stable_sort(_order.begin(), _order.end(),
+                [](const std::pair<uint64_t, size_t>& a, const std::pair<uint64_t, size_t>& b){ return a.first < b.first; });
+            for (auto& o : _order)
+            {
+                StagedRecord staged;
+                memcpy(&staged, base + o.second, sizeof(staged));
+                out.push(base + o.second, sizeof(staged) + staged._len);
+            }
+        }
+
+        //urgent: a full batch, a full ring or a flush, the worker must not wait for the batching deadline
+        void wakeUp(bool urgent)
+        {
+            //Pairs with the fence in worker_loop: either the worker sees the record, or we see it sleeping
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_config._pool)
+            {
+                //Only a plain load while a reschedule is already pending, the common case under load
+                int state = _scheduled.load(std::memory_order_relaxed);
+                while (state != RESCHEDULE)
+                {
+                    if (state == IDLE)
+                    {
+                        if (_scheduled.compare_exchange_weak(state, urgent ? SCHEDULED : ARMED, std::memory_order_acq_rel))
+                        {
+                            if (urgent) _config._pool->submit(this);
+                            else _config._pool->submitAt(this, std::chrono::steady_clock::now() + _config._max_latency);
+                            return ;
+                        }
+                    }
+                    else if (state == ARMED)
+                    {
+                        if (urgent == false) return ;//A flush is already scheduled
+                        //Run now instead, unless the timer fired already
+                        if (_scheduled.compare_exchange_weak(state, SCHEDULED, std::memory_order_acq_rel))
+                        {
+                            if (_config._pool->cancel(this)) _config._pool->submit(this);
+                            return ;
+                        }
+                    }
+                    else
+                    {
+                        if (urgent) _urgent.store(true, std::memory_order_relaxed);
+                        if (_scheduled.compare_exchange_weak(state, RESCHEDULE, std::memory_order_acq_rel)) return ;
+                    }
+                }
+                if (urgent) _urgent.store(true, std::memory_order_relaxed);
+                return ;
+            }
+            if (_sleeping.load(std::memory_order_relaxed) || (urgent && _lingering.load(std::memory_order_relaxed)))
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _pop_cond.notify_one();
+            }
+        }
+
+        //Rings owned by one thread, one per looper it logged to
+        //Destroyed at thread exit, which tells every looper that the ring will not grow anymore
+        struct ThreadQueues
+        {
+            ~ThreadQueues()
+            {
+                for (auto& q : _list) q.second->close();
+            }
+            std::vector<std::pair<uint64_t, SpscRing::ptr>> _list;
+        };
+
+        SpscRing* localQueue()
+        {
+            static thread_local ThreadQueues tq;
+            for (auto& q : tq._list)
+            {
+                if (q.first == _id) return q.second.get();
+            }
+            //First message from this thread: forget rings of loopers that are gone, then register a new one
+            for (size_t i = 0; i < tq._list.size();)
+            {
+                if (tq._list[i].second->orphaned())
+                {
+                    tq._list[i] = tq._list.back();
+                    tq._list.pop_back();
+                }
+                else ++i;
+            }
+            //Past BlockArena's limit the ring shrinks, a thread always gets one
+            SpscRing::ptr q;
+            for (size_t cap = _config._capacity; q == nullptr || q->valid() == false; cap /= 2)
+                q = std::make_shared<SpscRing>(cap, cap > MIN_THREAD_RING_SIZE);
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _queues.push_back(q);
+            }
+            tq._list.push_back(std::make_pair(_id, q));
+            return q.get();
+        }
+
+        static LooperConfig withCapacity(LooperConfig config)
+        {
+            if (config._capacity == 0) config._capacity = config._per_thread ? DEFAULT_THREAD_RING_SIZE : DEFAULT_BUFFER_SIZE;
+            return config;
+        }
+
+        //Ids are never reused, a thread can't mistake a new looper for a destroyed one at the same address
+        static uint64_t nextId()
+        {
+            static std::atomic<uint64_t> id(0);
+            return ++id;
+        }
+
         //threadRoutine function
-        //After the thread is awakened, it will execute this function
-        //Process the data in the consumption buffer, initialize the buffer after processing, and exchange the buffer
+        //Move everything published into the consumption buffer, process it, and sleep only when there is nothing left
         void worker_loop()
         {
             while(1)
             {
-                {//{} is to set a life cycle so that the added lock will be automatically unlocked after the exchange.
-                    // 1、Determine whether there is data in the production buffer, exchange if there is, or block if not
-                    std::unique_lock<std::mutex> lock(_mutex);
-                    if (_stop && _tasks_push.empty()) { return; }//Prevent the production buffer from exiting without processing data
-                    //This means that there is still data in the production buffer or the whole is about to stop working
-                    _pop_cond.wait(lock, [&]{ return !_tasks_push.empty() || _stop; });
-                    _tasks_push.swap(_tasks_pop);
-                }
-                //2、Wake up producers
-                //The code has been implemented in blocking mode. Only when blocked can threads need to be awakened
-                _push_cond.notify_all();
-                //3、After waking up, perform data processing on the consumption buffer
-                _callBack(_tasks_pop);
-                //4、Initialize consumption buffer
-                _tasks_pop.reset();
+                // 1、Take a batch out of the ring(s), the space goes back to the producers right away
+                bool flushing = _flush_pending.load(std::memory_order_acquire);
+                size_t count = drainInto(*_tasks_pop, flushing || _stop);
+                if (count > 0)
+                {
+                    // 2、Process the data in the consumption buffer, then initialize it
+                    _callBack(*_tasks_pop);
+                    _tasks_pop->reset();
+                }
+                if (flushing) serveFlush();
+                if (count > 0 && _batch_threshold == 0) continue;
+                //Held back records go out with the next pass, even if nothing else comes in
+                if (holding())
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                // 3、Nothing published, sleep until a producer wakes us up
+                std::unique_lock<std::mutex> lock(_mutex);
+                //Prevent the rings from exiting without processing data: a reserved record is always published soon after
+                if (_stop && empty())
+                {
+                    //Last chance to report drops, the interval no longer applies
+                    if (_dropped_msgs.load(std::memory_order_relaxed) != _reported_msgs)
+                    {
+                        lock.unlock();
+                        _callBack(*_tasks_pop);
+                    }
+                    return;
+                }
+                //Whatever a burst left in the buffers goes back to the arena before sleeping
+                _tasks_pop->shrink();
+                if (_stage) _stage->shrink();
+                if (_held) _held->shrink();
+                _sleeping.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (_dropped_msgs.load(std::memory_order_relaxed) == _reported_msgs)
+                {
+                    _pop_cond.wait(lock, [&]{ return readable() || _stop || _flush_pending.load(std::memory_order_relaxed); });
+                }
+                else if (_pop_cond.wait_for(lock, _config._drop_report_interval,
+                    [&]{ return readable() || _stop || _flush_pending.load(std::memory_order_relaxed); }) == false)
+                {
+                    //Drops still to be reported and nothing else to log: an empty batch lets the callback report them
+                    _sleeping.store(false, std::memory_order_relaxed);
+                    lock.unlock();
+                    _callBack(*_tasks_pop);
+                    continue;
+                }
+                _sleeping.store(false, std::memory_order_relaxed);
+                // 4、Batching: something is queued, let it grow until the threshold or the deadline
+                if (_batch_threshold > 0) linger(lock);
             }
             return ;
         }
+
+        //Producers only notify once the pending bytes reach the threshold, the deadline bounds the staleness
+        void linger(std::unique_lock<std::mutex>& lock)
+        {
+            std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + _config._max_latency;
+            _lingering.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            _pop_cond.wait_until(lock, deadline,
+                [&]{ return pendingBytes() >= _batch_threshold || _stop || _flush_pending.load(std::memory_order_relaxed); });
+            _lingering.store(false, std::memory_order_relaxed);
+        }
+
+        bool emptyLocked()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return empty();
+        }
+
+        //Worker side: per-thread records merged but not emitted yet
+        bool holding() {return _held && _held->readAbleSize() > 0; }
+
+        //Called with _mutex held
+        bool readable()
+        {
+            if (_overflowing.load(std::memory_order_acquire) || holding()) return true;
+            if (_config._per_thread == false) return _ring.readable();
+            for (auto& q : _queues)
+            {
+                if (q->empty() == false) return true;
+            }
+            return false;
+        }
+
+        //Called with _mutex held
+        size_t pendingBytes()
+        {
+            if (_overflowing.load(std::memory_order_acquire)) return (size_t)-1;
+            if (_config._per_thread == false) return _ring.pendingBytes();
+            size_t bytes = 0;
+            for (auto& q : _queues) bytes += q->pendingBytes();
+            return bytes;
+        }
+
+        //Called with _mutex held
+        bool empty()
+        {
+            if (_overflowing.load(std::memory_order_acquire) || holding()) return false;
+            if (_config._per_thread == false) return _ring.empty();
+            for (auto& q : _queues)
+            {
+                if (q->empty() == false) return false;
+            }
+            return true;
+        }
+
+        //Drain every thread's ring into _stage, then merge them into out by timestamp
+        //Each ring is already in order, so this is a k-way merge. Returns the number of records
+        //A record stamped before the pass can still be published after its ring or the spill was taken: only the
+        //records stamped before the clock reads taken ahead of the drain go out, the others are merged again next pass
+        size_t drainLocal(Buffer& out, bool all)
+        {
+            //What the last pass held back is one run, already merged
+            std::swap(_stage, _held);
+            _held->reset();
+            _cursors.clear();
+            if (_stage->readAbleSize() > 0) _cursors.push_back(Cursor(0, _stage->readAbleSize()));
+            uint64_t watermark = (uint64_t)-1;
+            if (all == false)
+            {
+                //Sampled before taking anything: a record whose push ended earlier is in this pass
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (auto& q : _queues) watermark = std::min(watermark, q->watermark(LogUtil::Date::steady()));
+            }
+            //Spilled records next: once they are taken, whatever they follow is already in the rings
+            size_t begin = _stage->readAbleSize();
+            if (drainOverflow(*_stage) > 0) _cursors.push_back(Cursor(begin, _stage->readAbleSize()));
+            {
+                //Only contended by threads logging here for the first time
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (size_t i = 0; i < _queues.size();)
+                {
+                    begin = _stage->readAbleSize();
+                    bool closed = _queues[i]->closed();//Checked first, a closed ring gets no more records
+                    if (_queues[i]->drain(*_stage) > 0) _cursors.push_back(Cursor(begin, _stage->readAbleSize()));
+                    if (closed && _queues[i]->empty())
+                    {
+                        _queues[i] = _queues.back();
+                        _queues.pop_back();
+                    }
+                    else ++i;
+                }
+            }
+            if (_cursors.empty()) return 0;
+            for (auto& c : _cursors) c._stamp = stampAt(c._pos);
+            //Min-heap on the stamp of each ring's next record
+            std::make_heap(_cursors.begin(), _cursors.end());
+            size_t count = 0;
+            while (_cursors.empty() == false)
+            {
+                std::pop_heap(_cursors.begin(), _cursors.end());
+                Cursor& c = _cursors.back();
+                StagedRecord staged;
+                const char* rec = _stage->begin() + c._pos;
+                memcpy(&staged, rec, sizeof(staged));
+                if (c._stamp < watermark)
+                {
+                    out.push(rec + sizeof(staged), staged._len);
+                    ++count;
+                }
+                else _held->push(rec, sizeof(staged) + staged._len);//Comes out in merge order, one run
+                c._pos += sizeof(staged) + staged._len;
+                if (c._pos == c._end) _cursors.pop_back();
+                else
+                {
+                    c._stamp = stampAt(c._pos);
+                    std::push_heap(_cursors.begin(), _cursors.end());
+                }
+            }
+            return count;
+        }
+
+        //StagedRecord + payload one after another, a record cut short is left out
+        template <typename Fn>
+        static void visitStaged(Fn& fn, const char* base, size_t len)
+        {
+            for (size_t pos = 0; pos + sizeof(StagedRecord) <= len;)
+            {
+                StagedRecord staged;
+                memcpy(&staged, base + pos, sizeof(staged));
+                if (pos + sizeof(staged) + staged._len > len) break;
+                fn(base + pos + sizeof(staged), (size_t)staged._len);
+                pos += sizeof(staged) + staged._len;
+            }
+        }
+
+        uint64_t stampAt(size_t pos)
+        {
+            uint64_t stamp;
+            memcpy(&stamp, _stage->begin() + pos, sizeof(stamp));
+            return stamp;
+        }
+
+        //Next unmerged record of one ring inside _stage
+        struct Cursor
+        {
+            Cursor(size_t pos, size_t end) : _pos(pos), _end(end), _stamp(0) {}
+            //Reversed so that std heap functions build a min-heap
+            bool operator<(const Cursor& c) const {return _stamp > c._stamp; }
+            size_t _pos;
+            size_t _end;
+            uint64_t _stamp;
+        };
     private:
         std::atomic<bool> _stop;//Used to stop logger
-        std::mutex _mutex;
+        std::atomic<bool> _sleeping;//The worker is waiting on _pop_cond
+        std::atomic<bool> _lingering;//Batching: the worker waits for a full batch or the deadline
+        std::atomic<bool> _urgent;//Pool, batching: a full batch came in during a run
+        std::atomic<int> _scheduled;//Pool only: IDLE, ARMED, SCHEDULED or RESCHEDULE
+        std::atomic<int> _active;//Pool only: runs in progress
+        std::mutex _mutex;//Sleeping and waking up the worker, and the list of per-thread rings
         std::thread _thread;//Async worker worker thread
         Functor _callBack;//Callback function for buffer data processing
-        AsyncType _looper_type;
-        std::condition_variable _push_cond;//Producer condition variable
+        FlushFunctor _flushCallBack;
+        LooperConfig _config;
+        uint64_t _id;
+        size_t _batch_threshold;//0: no batching
+        std::mutex _flusher_mutex;//One flush() at a time
+        std::mutex _flush_mutex;
+        std::condition_variable _flush_cond;
+        std::atomic<bool> _flush_pending;
+        bool _flush_closed;
+        uint64_t _flush_reserved;//Shared ring position the flush waits for
+        uint64_t _flush_gen;//Spilled batch the flush waits for, 0 if none
         std::condition_variable _pop_cond;//Consumer condition variable
-        Buffer _tasks_push;//Production buffer
-        Buffer _tasks_pop;//Consumption buffer
+        MpscRing _ring;//Shared by all producers
+        std::mutex _overflow_mutex;
+        std::atomic<bool> _overflowing;//ASYNC_UNSAFE: _overflow holds records
+        std::atomic<uint64_t> _overflow_gen;//ASYNC_UNSAFE: batches of spilled records taken so far + 1
+        std::atomic<uint64_t> _dropped_msgs;
+        std::atomic<uint64_t> _dropped_bytes;
+        uint64_t _reported_msgs;//Worker only, totals already written by takeDrops
+        uint64_t _reported_bytes;
+        std::chrono::steady_clock::time_point _last_report;
+        std::vector<SpscRing::ptr> _queues;//Per-thread mode: one ring per producer thread
+        std::unique_ptr<Buffer> _stage;//Per-thread mode: records drained from every ring, before the merge
+        std::unique_ptr<Buffer> _held;//Per-thread mode: merged records at or past the last pass's watermark
+        std::vector<Cursor> _cursors;
+        std::vector<std::pair<uint64_t, size_t>> _order;//Per-thread ASYNC_UNSAFE: stamp and offset of the spilled records
+        std::unique_ptr<Buffer> _overflow;//ASYNC_UNSAFE only
+        std::unique_ptr<Buffer> _tasks_pop;//Consumption buffer, the pool workers have their own
     };
 }
 
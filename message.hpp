@@ -8,23 +8,45 @@
 
 namespace Logs
 {
+    //Everything a message refers to is borrowed: the file is a string literal, the name belongs to the Logger,
+    //and the payload sits in the caller's stack buffer (or the async buffer on the backend thread).
+    //So a LogMsg is only valid during the log call that created it and is never stored.
     struct LogMsg
     {
         using ptr = std::shared_ptr<LogMsg>;
         time_t _ctime;//Timestamp of log generation
+        long _nsec;//Nanoseconds within _ctime
         size_t _line;//Line number
-        std::thread::id _tid;//Thread ID
-        std::string _file;//Source code file name
-        std::string _name;//Logger name
-        std::string _payload;//Payload
+        pid_t _tid;//Kernel thread ID
+        LogUtil::StrView _tid_str;//_tid as text, empty if it has to be converted
+        LogUtil::StrView _tname;//Thread name, may be empty
+        LogUtil::StrView _file;//Source code file name
+        LogUtil::StrView _name;//Logger name
+        LogUtil::StrView _payload;//Payload
         LogLevel::value _level;//Log level
 
         LogMsg(LogLevel::value level,
                size_t line,
-               const std::string file,
-               const std::string& name,
-               const std::string& payload) : _ctime(LogUtil::Date::now()), _level(level), _line(line),
-                                              _tid(std::this_thread::get_id()), _file(file), _name(name), _payload(payload) {}
+               LogUtil::StrView file,
+               LogUtil::StrView name,
+               LogUtil::StrView payload) : _line(line), _tid(LogUtil::Thread::tid()),
+                                           _tid_str(LogUtil::Thread::tidText()), _tname(LogUtil::Thread::name()),
+                                           _file(file), _name(name), _payload(payload), _level(level)
+        {
+            _ctime = LogUtil::Date::now(_nsec);
+        }
+
+        //Rebuilt on the backend thread from a deferred record, time and thread come from the caller
+        //The caller's thread may be gone by now, so _tid_str is left empty and _tname is filled in by the caller
+        LogMsg(LogLevel::value level,
+               size_t line,
+               LogUtil::StrView file,
+               LogUtil::StrView name,
+               LogUtil::StrView payload,
+               time_t ctime,
+               long nsec,
+               pid_t tid) : _ctime(ctime), _nsec(nsec), _line(line),
+                                      _tid(tid), _file(file), _name(name), _payload(payload), _level(level) {}
     };
 
     //In util.hpp, Date::now returns time_t type, which matches the _ctime here.
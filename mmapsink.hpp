@@ -0,0 +1,234 @@
+/*Memory mapped file sink
+    1、The file grows by fixed-size segments: each one is preallocated with fallocate, then mapped shared
+    2、log() is a memcpy into the mapping, no system call until the segment is full
+    3、The pages belong to the page cache: what was copied survives a crash of the process (not of the machine)
+    4、Optional msync: on a background thread every _sync_interval, or on every flush()
+    The unused part of the last segment is cut off on close. After a crash the file ends with zeros instead,
+    the next MmapFileSink on that file trims them before appending, so it is meant for text
+        builder->buildSink<Logs::MmapFileSink>("./logs/trace.log");
+*/
+
+#ifndef __M_MSINK_H__
+#define __M_MSINK_H__
+
+#include "sink.hpp"
+#include "filewriter.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+
+namespace Logs
+{
+    struct MmapConfig
+    {
+        MmapConfig() : _segment_size(64 * 1024 * 1024), _durability(Durability::DURABLE_NONE), _sync_interval(1000) {}
+
+        size_t _segment_size;//Rounded up to whole pages
+        //DURABLE_PERIODIC: msync every _sync_interval on a thread of the sink's own
+        //DURABLE_ON_FLUSH: msync on every flush()
+        Durability _durability;
+        std::chrono::milliseconds _sync_interval;
+    };
+
+    class MmapFileSink : public LogSink
+    {
+    public:
+        using ptr = std::shared_ptr<MmapFileSink>;
+
+        MmapFileSink(const std::string& filename, const MmapConfig& config = MmapConfig())
+            : _filename(filename), _config(config), _page(sysconf(_SC_PAGESIZE)), _map(nullptr)
+            , _base(0), _pos(0), _synced(0), _failed(false), _stop(false)
+        {
+            _config._segment_size = (_config._segment_size + _page - 1) / _page * _page;
+            LogUtil::File::createDirectory(LogUtil::File::path(_filename));
+            _fd = ::open(_filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            assert(_fd >= 0);
+            //Append after what is there, and after a crash, before the zeros of the segment that was in use
+            size_t end = dataEnd();
+            if (ftruncate(_fd, end) != 0) std::cout << "Memory mapped log file truncate failed! \n";
+            _base = end / _page * _page;
+            _pos.store(end - _base, std::memory_order_relaxed);
+            _synced = end - _base;
+            mapSegment();
+            if (_config._durability == Durability::DURABLE_PERIODIC && _config._sync_interval.count() > 0)
+                _thread = std::thread(&MmapFileSink::sync_loop, this);
+        }
+
+        ~MmapFileSink()
+        {
+            if (_thread.joinable())
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _stop = true;
+                }
+                _cond.notify_all();
+                _thread.join();
+            }
+            size_t end = _base + _pos.load(std::memory_order_relaxed);
+            unmapSegment();
+            //The preallocated rest of the segment goes away
+            if (ftruncate(_fd, end) != 0) std::cout << "Memory mapped log file truncate failed! \n";
+            ::close(_fd);
+        }
+
+        const std::string& file() {return _filename; }
+
+        void log(const char* data, size_t len)
+        {
+            while (len > 0)
+            {
+                size_t pos = _pos.load(std::memory_order_relaxed);
+                if (_map == nullptr || pos == _config._segment_size)
+                {
+                    if (nextSegment() == false) return ;//No segment could be mapped, the bytes are lost
+                    pos = _pos.load(std::memory_order_relaxed);
+                }
+                size_t part = len < _config._segment_size - pos ? len : _config._segment_size - pos;
+                memcpy(_map + pos, data, part);
+                _pos.store(pos + part, std::memory_order_release);
+                data += part;
+                len -= part;
+            }
+        }
+
+        //The data is in the page cache already, only DURABLE_ON_FLUSH waits for the disk
+        void flush()
+        {
+            if (_config._durability != Durability::DURABLE_ON_FLUSH) return ;
+            std::unique_lock<std::mutex> lock(_mutex);
+            syncLocked(MS_SYNC);
+        }
+
+        //Signal handler: pwrite at the end of the data, the page cache keeps it coherent with the mapping
+        void crashWrite(const char* data, size_t len)
+        {
+            size_t pos = _pos.load(std::memory_order_acquire);
+            while (len > 0)
+            {
+                ssize_t n = pwrite(_fd, data, len, _base + pos);
+                if (n < 0)
+                {
+                    if (errno == EINTR) continue;
+                    return ;
+                }
+                data += n;
+                len -= n;
+                pos += n;
+                _pos.store(pos, std::memory_order_release);//The next call appends after it
+            }
+        }
+    private:
+        //Size of the file without the zeros a crash left behind, searched within one segment from the end
+        size_t dataEnd()
+        {
+            struct stat st;
+            if (fstat(_fd, &st) != 0) return 0;
+            size_t end = st.st_size;
+            size_t limit = end > _config._segment_size ? end - _config._segment_size : 0;
+            char chunk[4096];
+            while (end > limit)
+            {
+                size_t len = end - limit < sizeof(chunk) ? end - limit : sizeof(chunk);
+                if (pread(_fd, chunk, len, end - len) != (ssize_t)len) break;
+                size_t i = len;
+                while (i > 0 && chunk[i - 1] == '\0') --i;
+                end -= len - i;
+                if (i > 0) break;
+            }
+            return end;
+        }
+
+        bool mapSegment()
+        {
+            int err = posix_fallocate(_fd, _base, _config._segment_size);
+            if (err != 0)
+            {
+                //A mapping past the end of the file would crash the process on the first store
+                if (_failed == false) std::cout << "Memory mapped log file allocation failed: " << strerror(err) << "\n";
+                _failed = true;
+                return false;
+            }
+            void* p = mmap(nullptr, _config._segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, _base);
+            if (p == MAP_FAILED)
+            {
+                if (_failed == false) std::cout << "Memory mapped log file mapping failed! \n";
+                _failed = true;
+                return false;
+            }
+            _map = (char*)p;
+            _failed = false;
+            return true;
+        }
+
+        void unmapSegment()
+        {
+            if (_map == nullptr) return ;
+            //Periodic: start the write back of what the sync thread hasn't covered yet
+            //On flush: a later flush only covers the new segment, this one has to be on disk already
+            if (_config._durability == Durability::DURABLE_PERIODIC) syncLocked(MS_ASYNC);
+            else if (_config._durability == Durability::DURABLE_ON_FLUSH) syncLocked(MS_SYNC);
+            munmap(_map, _config._segment_size);
+            _map = nullptr;
+        }
+
+        //The current segment is full, or couldn't be mapped last time and is tried again
+        //The sync thread only looks at the current segment, it is swapped under _mutex
+        bool nextSegment()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_map != nullptr)
+            {
+                unmapSegment();
+                _base += _config._segment_size;
+                _pos.store(0, std::memory_order_relaxed);
+                _synced = 0;
+            }
+            return mapSegment();
+        }
+
+        //Called with _mutex held: the pages written since the last sync
+        void syncLocked(int flags)
+        {
+            if (_map == nullptr) return ;
+            size_t pos = _pos.load(std::memory_order_acquire);
+            size_t from = _synced / _page * _page;
+            if (pos <= from) return ;
+            if (msync(_map + from, pos - from, flags) != 0) std::cout << "Memory mapped log file sync failed! \n";
+            _synced = pos;
+        }
+
+        void sync_loop()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_stop == false)
+            {
+                _cond.wait_for(lock, _config._sync_interval, [&]{ return _stop; });
+                syncLocked(MS_SYNC);
+            }
+        }
+    private:
+        std::string _filename;
+        MmapConfig _config;
+        size_t _page;
+        int _fd;
+        char* _map;//Current segment, nullptr if it couldn't be mapped
+        size_t _base;//File offset of the current segment
+        std::atomic<size_t> _pos;//Bytes written into the current segment
+        size_t _synced;//Guarded by _mutex: bytes of the current segment already synced
+        bool _failed;
+        std::mutex _mutex;//Segment switches against the sync thread
+        std::condition_variable _cond;
+        bool _stop;
+        std::thread _thread;
+    };
+}
+
+#endif
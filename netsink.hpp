@@ -0,0 +1,467 @@
+/*Network sink: log batches to a collector over TCP or UDP
+    1、TCP framing: octet counting ("LEN SP MSG", RFC 6587), a 4-byte big-endian length, or the bytes as they are
+       Every line of a batch is one message, the frames and the lines go out together in one sendmsg
+    2、UDP: one datagram per line, sent many at a time with sendmmsg
+    3、Nonblocking sockets, a send waits at most _send_timeout for the collector before the connection is given up
+    4、Reconnect with exponential backoff, no waiting in between: a batch arriving meanwhile is spilled
+    5、Spill file: batches written while the collector is unreachable, sent in order once it is back.
+       It survives a restart of the logging process
+    Delivery is best effort: a batch counts as sent once the kernel took it, there is no acknowledgement.
+    If the collector dies, whatever it had not read yet is lost, and a batch cut short is sent again in full.
+    No loss while the collector is down or unreachable, as long as the spill file has room
+    nettest/ runs these cases against a collector on localhost
+    The sink writes on the caller's thread. The queue, its bound and what happens when it is full come from
+    AsyncSinkAdapter, which is how it is meant to be used:
+        builder->buildSink<Logs::AsyncSinkAdapter<Logs::NetworkSink>>(Logs::SinkQueueConfig(), "10.0.0.5", 6514, config);
+*/
+
+#ifndef __M_NSINK_H__
+#define __M_NSINK_H__
+
+#include "sink.hpp"
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace Logs
+{
+    enum class NetProtocol
+    {
+        NET_TCP,
+        NET_UDP
+    };
+
+    enum class NetFraming
+    {
+        FRAME_OCTET_COUNTING,//"LEN SP MSG" per line, the newline isn't sent
+        FRAME_LENGTH_PREFIXED,//4-byte big-endian length per line, the newline isn't sent
+        FRAME_NONE//Bytes as they are: newline delimited syslog, or records that delimit themselves
+    };
+
+    struct NetConfig
+    {
+        NetConfig()
+            : _protocol(NetProtocol::NET_TCP), _framing(NetFraming::FRAME_OCTET_COUNTING)
+            , _connect_timeout(1000), _send_timeout(5000), _backoff_min(100), _backoff_max(30000)
+            , _spill_max_bytes(1024 * 1024 * 1024)
+        {}
+
+        NetProtocol _protocol;
+        NetFraming _framing;//TCP only
+        std::chrono::milliseconds _connect_timeout;
+        std::chrono::milliseconds _send_timeout;//Collector not reading for this long: the connection is closed
+        std::chrono::milliseconds _backoff_min;//First wait after a failure, doubled up to _backoff_max
+        std::chrono::milliseconds _backoff_max;
+        std::string _spill_path;//TCP only, empty: batches are dropped while the collector is unreachable
+        size_t _spill_max_bytes;//Dropped beyond it
+    };
+
+    struct NetStats
+    {
+        NetStats() : _sent_bytes(0), _spilled_bytes(0), _dropped_bytes(0), _connects(0), _failures(0) {}
+
+        size_t _sent_bytes;//Log bytes, without the framing
+        size_t _spilled_bytes;
+        size_t _dropped_bytes;
+        size_t _connects;
+        size_t _failures;//Connects and sends that failed
+    };
+
+    //Direction: a log collector
+    class NetworkSink : public LogSink
+    {
+    public:
+        using ptr = std::shared_ptr<NetworkSink>;
+        using Clock = std::chrono::steady_clock;
+
+        NetworkSink(const std::string& host, uint16_t port, const NetConfig& config = NetConfig())
+            : _host(host), _port(std::to_string(port)), _config(config), _fd(-1), _spill_fd(-1), _spill_read(0)
+            , _backoff(config._backoff_min), _next_attempt(Clock::now())
+            , _sent_bytes(0), _spilled_bytes(0), _dropped_bytes(0), _connects(0), _failures(0)
+        {
+            if (_config._protocol == NetProtocol::NET_TCP && _config._spill_path.empty() == false) openSpill();
+            connect();
+        }
+
+        ~NetworkSink()
+        {
+            //Last chance for what was spilled
+            if (spilled() && (_fd >= 0 || connect())) replay(false);
+            if (_fd >= 0) ::close(_fd);
+            if (_spill_fd >= 0) ::close(_spill_fd);
+        }
+
+        void log(const char* data, size_t len)
+        {
+            if (len == 0) return ;
+            if (_fd < 0) connect();
+            if (_fd >= 0 && spilled()) replay(true);
+            //Order is kept: nothing goes out directly while older batches wait in the spill file
+            if (_fd >= 0 && spilled() == false)
+            {
+                if (send(data, len)) return ;
+                disconnect();
+            }
+            spill(data, len);
+        }
+
+        //Nothing is buffered in the sink, but the collector may be back for what was spilled
+        void flush()
+        {
+            if (spilled() == false) return ;
+            if (_fd < 0) connect();
+            if (_fd >= 0) replay(false);
+        }
+
+        //Signal handler: appended to the spill file, the socket may be in the middle of a frame
+        void crashWrite(const char* data, size_t len)
+        {
+            if (_spill_fd >= 0) LogUtil::File::writeAll(_spill_fd, data, len);
+        }
+
+        bool connected() {return _fd >= 0; }
+
+        NetStats stats()
+        {
+            NetStats st;
+            st._sent_bytes = _sent_bytes.load(std::memory_order_relaxed);
+            st._spilled_bytes = _spilled_bytes.load(std::memory_order_relaxed);
+            st._dropped_bytes = _dropped_bytes.load(std::memory_order_relaxed);
+            st._connects = _connects.load(std::memory_order_relaxed);
+            st._failures = _failures.load(std::memory_order_relaxed);
+            return st;
+        }
+    private:
+        enum
+        {
+            BATCH_IOV = 512,//iovecs per sendmsg, and datagrams per sendmmsg
+            MAX_DATAGRAM = 65507,//Longer UDP lines are cut
+            REPLAY_CHUNK = 1024 * 1024,
+            REPLAY_PER_CALL = 16//Chunks replayed per log call, the queue in front keeps moving
+        };
+
+        //False while backing off, or if the collector can't be reached now
+        bool connect()
+        {
+            if (Clock::now() < _next_attempt) return false;
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = _config._protocol == NetProtocol::NET_TCP ? SOCK_STREAM : SOCK_DGRAM;
+            struct addrinfo* res = nullptr;
+            //Resolved on every attempt, the collector may have moved
+            if (getaddrinfo(_host.c_str(), _port.c_str(), &hints, &res) == 0)
+            {
+                for (struct addrinfo* ai = res; ai != nullptr && _fd < 0; ai = ai->ai_next) _fd = open(ai);
+                freeaddrinfo(res);
+            }
+            if (_fd < 0)
+            {
+                backOff();
+                return false;
+            }
+            _backoff = _config._backoff_min;
+            _connects.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        //Nonblocking connect, waited for at most _connect_timeout
+        int open(struct addrinfo* ai)
+        {
+            int fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) return -1;
+            if (_config._protocol == NetProtocol::NET_TCP)
+            {
+                int on = 1;
+                setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+            }
+            if (::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+            {
+                int err = errno;
+                if (err == EINPROGRESS && wait(fd, POLLOUT, Clock::now() + _config._connect_timeout))
+                {
+                    socklen_t len = sizeof(err);
+                    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) err = errno;
+                }
+                if (err != 0)
+                {
+                    ::close(fd);
+                    return -1;
+                }
+            }
+            return fd;
+        }
+
+        void disconnect()
+        {
+            ::close(_fd);
+            _fd = -1;
+            backOff();
+        }
+
+        //No attempt before the wait is over, each failure in a row doubles it
+        void backOff()
+        {
+            _failures.fetch_add(1, std::memory_order_relaxed);
+            _next_attempt = Clock::now() + _backoff;
+            _backoff = _backoff * 2 < _config._backoff_max ? _backoff * 2 : _config._backoff_max;
+        }
+
+        //events on fd, or false once deadline passed
+        static bool wait(int fd, short events, Clock::time_point deadline)
+        {
+            while (1)
+            {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+                if (left <= 0) return false;
+                struct pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = events;
+                pfd.revents = 0;
+                int n = poll(&pfd, 1, (int)left);
+                if (n > 0) return true;
+                if (n < 0 && errno != EINTR) return false;
+            }
+        }
+
+        //The whole batch, or false and the connection is to be dropped. A batch cut short is sent again in full
+        //true only means the kernel has it, a collector that dies before reading it loses it
+        bool send(const char* data, size_t len)
+        {
+            if (_config._protocol == NetProtocol::NET_UDP)
+            {
+                //No connection to lose: what the network refused is dropped
+                if (sendDatagrams(data, len) == false) _dropped_bytes.fetch_add(len, std::memory_order_relaxed);
+                else _sent_bytes.fetch_add(len, std::memory_order_relaxed);
+                return true;
+            }
+            //A collector that went away is only noticed by a read, the kernel accepts writes a while longer
+            char c;
+            ssize_t n = recv(_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return false;
+            Clock::time_point deadline = Clock::now() + _config._send_timeout;
+            if (_config._framing == NetFraming::FRAME_NONE)
+            {
+                struct iovec iov;
+                iov.iov_base = (void*)data;
+                iov.iov_len = len;
+                if (sendAll(&iov, 1, deadline) == false) return false;
+                _sent_bytes.fetch_add(len, std::memory_order_relaxed);
+                return true;
+            }
+            //All the headers first, their addresses are stable once the vector stops growing
+            _lines.clear();
+            splitLines(data, len);
+            _headers.clear();
+            _header_len.clear();
+            for (size_t i = 0; i < _lines.size(); ++i) frame(_lines[i].iov_len);
+            _iov.clear();
+            size_t hdr = 0;
+            for (size_t i = 0; i < _lines.size(); ++i)
+            {
+                struct iovec h;
+                h.iov_base = &_headers[hdr];
+                h.iov_len = _header_len[i];
+                hdr += _header_len[i];
+                _iov.push_back(h);
+                _iov.push_back(_lines[i]);
+            }
+            for (size_t i = 0; i < _iov.size(); i += BATCH_IOV)
+            {
+                size_t cnt = _iov.size() - i < (size_t)BATCH_IOV ? _iov.size() - i : (size_t)BATCH_IOV;
+                if (sendAll(&_iov[i], cnt, deadline) == false) return false;
+            }
+            _sent_bytes.fetch_add(len, std::memory_order_relaxed);
+            return true;
+        }
+
+        //Lines without their newline, a last line without one is a line too
+        void splitLines(const char* data, size_t len)
+        {
+            const char* end = data + len;
+            while (data < end)
+            {
+                const char* nl = (const char*)memchr(data, '\n', end - data);
+                const char* stop = nl ? nl : end;
+                struct iovec line;
+                line.iov_base = (void*)data;
+                line.iov_len = stop - data;
+                _lines.push_back(line);
+                data = nl ? nl + 1 : end;
+            }
+        }
+
+        //Header of a message of len bytes
+        void frame(size_t len)
+        {
+            char buf[24];
+            size_t n;
+            if (_config._framing == NetFraming::FRAME_OCTET_COUNTING) n = snprintf(buf, sizeof(buf), "%zu ", len);
+            else
+            {
+                uint32_t be = htonl((uint32_t)len);
+                memcpy(buf, &be, sizeof(be));
+                n = sizeof(be);
+            }
+            _headers.insert(_headers.end(), buf, buf + n);
+            _header_len.push_back(n);
+        }
+
+        //Partial sends continue where the kernel stopped, EAGAIN waits for room until deadline
+        bool sendAll(struct iovec* iov, size_t cnt, Clock::time_point deadline)
+        {
+            while (cnt > 0)
+            {
+                while (cnt > 0 && iov->iov_len == 0) {++iov; --cnt; }
+                if (cnt == 0) break;
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = cnt;
+                ssize_t n = sendmsg(_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n < 0)
+                {
+                    if (errno == EINTR) continue;
+                    if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait(_fd, POLLOUT, deadline)) continue;
+                    return false;
+                }
+                for (size_t left = n; left > 0;)
+                {
+                    size_t part = left < iov->iov_len ? left : iov->iov_len;
+                    iov->iov_base = (char*)iov->iov_base + part;
+                    iov->iov_len -= part;
+                    left -= part;
+                    if (iov->iov_len == 0) {++iov; --cnt; }
+                }
+            }
+            return true;
+        }
+
+        //One datagram per line, BATCH_IOV of them per system call
+        bool sendDatagrams(const char* data, size_t len)
+        {
+            _lines.clear();
+            splitLines(data, len);
+            Clock::time_point deadline = Clock::now() + _config._send_timeout;
+            std::vector<struct mmsghdr>& msgs = _msgs;
+            bool ok = true;
+            for (size_t i = 0; i < _lines.size();)
+            {
+                size_t cnt = _lines.size() - i < (size_t)BATCH_IOV ? _lines.size() - i : (size_t)BATCH_IOV;
+                msgs.assign(cnt, mmsghdr());
+                for (size_t j = 0; j < cnt; ++j)
+                {
+                    struct iovec& line = _lines[i + j];
+                    if (line.iov_len > MAX_DATAGRAM) line.iov_len = MAX_DATAGRAM;
+                    msgs[j].msg_hdr.msg_iov = &line;
+                    msgs[j].msg_hdr.msg_iovlen = 1;
+                }
+                int n = sendmmsg(_fd, msgs.data(), cnt, MSG_DONTWAIT);
+                if (n < 0)
+                {
+                    if (errno == EINTR) continue;
+                    if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait(_fd, POLLOUT, deadline)) continue;
+                    //ECONNREFUSED reports an earlier datagram nobody received, skip the line it stopped at
+                    ok = false;
+                    n = 1;
+                }
+                i += n;
+            }
+            return ok;
+        }
+
+        void openSpill()
+        {
+            LogUtil::File::createDirectory(LogUtil::File::path(_config._spill_path));
+            _spill_fd = ::open(_config._spill_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (_spill_fd < 0) std::cout << "Network sink spill file open failed: " << _config._spill_path << "\n";
+        }
+
+        //Left over from an earlier run counts too
+        bool spilled()
+        {
+            if (_spill_fd < 0) return false;
+            struct stat st;
+            return fstat(_spill_fd, &st) == 0 && (size_t)st.st_size > _spill_read;
+        }
+
+        void spill(const char* data, size_t len)
+        {
+            struct stat st;
+            if (_spill_fd < 0 || fstat(_spill_fd, &st) != 0 || st.st_size + len > _config._spill_max_bytes
+                || LogUtil::File::writeAll(_spill_fd, data, len) == false)
+            {
+                _dropped_bytes.fetch_add(len, std::memory_order_relaxed);
+                return ;
+            }
+            _spilled_bytes.fetch_add(len, std::memory_order_relaxed);
+        }
+
+        //Send the spill file from where the last replay stopped, emptied once all of it went out
+        //Whole lines only, the framing splits on them. limited: REPLAY_PER_CALL chunks
+        void replay(bool limited)
+        {
+            if (_buffer.empty()) _buffer.resize(REPLAY_CHUNK);
+            for (size_t chunks = 0; limited == false || chunks < REPLAY_PER_CALL; ++chunks)
+            {
+                ssize_t n = pread(_spill_fd, _buffer.data(), _buffer.size(), _spill_read);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                size_t len = n;
+                if (_config._framing != NetFraming::FRAME_NONE && (size_t)n == _buffer.size())
+                {
+                    //Cut after the last newline, a line longer than a chunk goes as it is
+                    const char* nl = (const char*)memrchr(_buffer.data(), '\n', n);
+                    if (nl != nullptr) len = nl + 1 - _buffer.data();
+                }
+                if (send(_buffer.data(), len) == false)
+                {
+                    disconnect();
+                    return ;
+                }
+                _spill_read += len;
+            }
+            struct stat st;
+            if (fstat(_spill_fd, &st) == 0 && (size_t)st.st_size <= _spill_read)
+            {
+                if (ftruncate(_spill_fd, 0) != 0) return ;
+                _spill_read = 0;
+            }
+        }
+    private:
+        std::string _host;
+        std::string _port;
+        NetConfig _config;
+        int _fd;//-1: not connected
+        int _spill_fd;
+        size_t _spill_read;//Spill file bytes already sent
+        std::chrono::milliseconds _backoff;
+        Clock::time_point _next_attempt;
+        //Reused between calls
+        std::vector<struct iovec> _lines;
+        std::vector<struct iovec> _iov;
+        std::vector<char> _headers;
+        std::vector<size_t> _header_len;
+        std::vector<struct mmsghdr> _msgs;
+        std::vector<char> _buffer;//Replay
+        std::atomic<size_t> _sent_bytes;
+        std::atomic<size_t> _spilled_bytes;
+        std::atomic<size_t> _dropped_bytes;
+        std::atomic<size_t> _connects;
+        std::atomic<size_t> _failures;
+    };
+}
+
+#endif
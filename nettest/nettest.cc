@@ -0,0 +1,316 @@
+/*NetworkSink against a collector on localhost
+    1、Collector: TCP (octet counting) or UDP listener on 127.0.0.1, keeps every line it receives
+    2、Each scenario logs numbered lines through AsyncSinkAdapter<NetworkSink>, then checks what arrived
+       tcp, spill: every line, in order. The spill covers a collector that is down or unreachable
+       crash: the collector dies with bytes its kernel already accepted, those lines are lost (best effort)
+       udp: whatever the network kept
+    Usage: ./nettest [scenario], all of them by default. Exit status 1 if a checked scenario failed
+*/
+
+#include "../logs.h"
+#include "../netsink.hpp"
+#include <chrono>
+#include <cstdio>
+
+static const size_t LINES = 100000;
+
+class Collector
+{
+public:
+    Collector(Logs::NetProtocol protocol, uint16_t port = 0)
+        : _protocol(protocol), _port(port), _listen_fd(-1), _stop(false), _stall(false)
+    {}
+
+    ~Collector() {stop(false); }
+
+    //port 0: any free port, the same one again after a restart
+    bool start()
+    {
+        bool tcp = _protocol == Logs::NetProtocol::NET_TCP;
+        _listen_fd = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+        int on = 1;
+        setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || (tcp && listen(_listen_fd, 4) != 0))
+        {
+            std::cout << "Collector bind failed: " << strerror(errno) << "\n";
+            ::close(_listen_fd);
+            _listen_fd = -1;
+            return false;
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(_listen_fd, (struct sockaddr*)&addr, &len);
+        _port = ntohs(addr.sin_port);
+        _stop = false;
+        _stall = false;
+        _thread = std::thread(tcp ? &Collector::acceptLoop : &Collector::datagramLoop, this);
+        return true;
+    }
+
+    //crash: stop reading first, then reset the connection, what the kernel holds is thrown away
+    void stop(bool crash)
+    {
+        if (_listen_fd < 0) return ;
+        if (crash)
+        {
+            _stall = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+        _crash = crash;
+        _stop = true;
+        _thread.join();
+        ::close(_listen_fd);
+        _listen_fd = -1;
+    }
+
+    uint16_t port() {return _port; }
+
+    std::vector<long> lines()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _lines;
+    }
+
+    size_t count()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _lines.size();
+    }
+private:
+    void acceptLoop()
+    {
+        int conn = -1;
+        std::string pending;
+        char buf[64 * 1024];
+        while (_stop == false)
+        {
+            struct pollfd pfd;
+            pfd.fd = conn >= 0 ? conn : _listen_fd;
+            pfd.events = POLLIN;
+            if (_stall || poll(&pfd, 1, 10) <= 0)
+            {
+                if (_stall) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            if (conn < 0)
+            {
+                conn = accept(_listen_fd, nullptr, nullptr);
+                pending.clear();
+                continue;
+            }
+            ssize_t n = recv(conn, buf, sizeof(buf), 0);
+            if (n <= 0)
+            {
+                //The sink gave up on this connection, the next one starts on a frame boundary
+                ::close(conn);
+                conn = -1;
+                continue;
+            }
+            pending.append(buf, n);
+            parseFrames(pending);
+        }
+        if (conn < 0) return ;
+        if (_crash)
+        {
+            struct linger lg;
+            lg.l_onoff = 1;
+            lg.l_linger = 0;
+            setsockopt(conn, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        }
+        ::close(conn);
+    }
+
+    //"LEN SP MSG", as many whole frames as pending holds
+    void parseFrames(std::string& pending)
+    {
+        size_t pos = 0;
+        while (1)
+        {
+            size_t sp = pending.find(' ', pos);
+            if (sp == std::string::npos) break;
+            size_t len = strtoul(pending.c_str() + pos, nullptr, 10);
+            if (pending.size() < sp + 1 + len) break;
+            addLine(pending.c_str() + sp + 1, len);
+            pos = sp + 1 + len;
+        }
+        pending.erase(0, pos);
+    }
+
+    void datagramLoop()
+    {
+        char buf[64 * 1024];
+        while (_stop == false)
+        {
+            struct pollfd pfd;
+            pfd.fd = _listen_fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 10) <= 0) continue;
+            ssize_t n = recv(_listen_fd, buf, sizeof(buf), 0);
+            if (n > 0) addLine(buf, n);
+        }
+    }
+
+    //"line N", the number is what the checks look at
+    void addLine(const char* data, size_t len)
+    {
+        std::string line(data, len);
+        std::unique_lock<std::mutex> lock(_mutex);
+        _lines.push_back(line.compare(0, 5, "line ") == 0 ? atol(line.c_str() + 5) : -1);
+    }
+private:
+    Logs::NetProtocol _protocol;
+    uint16_t _port;
+    int _listen_fd;
+    std::atomic<bool> _stop;
+    std::atomic<bool> _stall;//Crash: the collector hangs before it dies
+    bool _crash;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::vector<long> _lines;
+};
+
+//Lines from 0 to LINES - 1 that never arrived, and lines out of order (a resent batch counts there)
+static void check(const std::vector<long>& lines, size_t& missing, size_t& disorder)
+{
+    std::vector<bool> seen(LINES, false);
+    missing = 0;
+    disorder = 0;
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        if (lines[i] >= 0 && (size_t)lines[i] < LINES) seen[lines[i]] = true;
+        if (i > 0 && lines[i] != lines[i - 1] + 1) ++disorder;
+    }
+    for (size_t i = 0; i < LINES; ++i) missing += seen[i] ? 0 : 1;
+}
+
+//Logs LINES numbered lines, during: called with the index every 1000 lines
+template <typename Fn>
+static Logs::NetStats run(const std::string& name, uint16_t port, const Logs::NetConfig& config, Fn during)
+{
+    typedef Logs::AsyncSinkAdapter<Logs::NetworkSink> NetSink;
+    std::shared_ptr<NetSink> sink = std::make_shared<NetSink>(Logs::SinkQueueConfig(), "127.0.0.1", port, config);
+    {
+        std::unique_ptr<Logs::LocalLoggerBuilder> builder(new Logs::LocalLoggerBuilder());
+        builder->buildLoggerType(Logs::Logger::Type::LOGGER_ASYNC);
+        builder->buildLoggerName(name);
+        builder->buildFormatter("%m%n");
+        builder->buildSink(sink);
+        Logs::Logger::ptr logger = builder->build();
+        for (size_t i = 0; i < LINES; ++i)
+        {
+            logger->InFo("line %zu", i);
+            if (i % 1000 == 0)
+            {
+                during(i);
+                std::this_thread::sleep_for(std::chrono::microseconds(500));
+            }
+        }
+        logger->flush();
+    }
+    Logs::NetStats stats = sink->sink().stats();
+    sink.reset();//The sink replays what is left of the spill before it goes
+    return stats;
+}
+
+//Waits up to a second for the collector to read the last lines
+static std::vector<long> settle(Collector& collector)
+{
+    size_t last = (size_t)-1;
+    for (int i = 0; i < 100 && collector.count() != last; ++i)
+    {
+        last = collector.count();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return collector.lines();
+}
+
+static bool report(const std::string& scenario, const std::vector<long>& lines, const Logs::NetStats& stats, bool strict)
+{
+    size_t missing, disorder;
+    check(lines, missing, disorder);
+    bool ok = strict == false || (missing == 0 && disorder == 0 && lines.size() == LINES);
+    std::cout << scenario << ": received " << lines.size() << "/" << LINES << ", missing " << missing
+              << ", out of order " << disorder << ", spilled " << stats._spilled_bytes << "B, dropped " << stats._dropped_bytes
+              << "B, connects " << stats._connects << ", failures " << stats._failures
+              << (strict ? (ok ? "  PASS" : "  FAIL") : "  (best effort, not checked)") << std::endl;
+    return ok;
+}
+
+//1、Collector up the whole time
+bool tcpSteady()
+{
+    Collector collector(Logs::NetProtocol::NET_TCP);
+    if (collector.start() == false) return false;
+    Logs::NetConfig config;
+    Logs::NetStats stats = run("net_tcp", collector.port(), config, [](size_t){});
+    return report("tcp", settle(collector), stats, true);
+}
+
+//2、Collector down at first, then restarted cleanly: what couldn't go out waits in the spill file
+bool tcpSpill()
+{
+    Collector probe(Logs::NetProtocol::NET_TCP);
+    if (probe.start() == false) return false;
+    uint16_t port = probe.port();
+    probe.stop(false);
+    Collector collector(Logs::NetProtocol::NET_TCP, port);
+    Logs::NetConfig config;
+    config._backoff_min = std::chrono::milliseconds(20);
+    config._backoff_max = std::chrono::milliseconds(200);
+    config._spill_path = "./spill/nettest.spill";
+    unlink(config._spill_path.c_str());
+    Logs::NetStats stats = run("net_spill", port, config, [&](size_t i){
+        if (i == LINES / 2) collector.start();
+    });
+    return report("spill", settle(collector), stats, true);
+}
+
+//3、Collector hangs and dies mid-run, then comes back: lines its kernel had accepted are gone
+bool tcpCrash()
+{
+    Collector collector(Logs::NetProtocol::NET_TCP);
+    if (collector.start() == false) return false;
+    Logs::NetConfig config;
+    config._backoff_min = std::chrono::milliseconds(20);
+    config._backoff_max = std::chrono::milliseconds(200);
+    config._spill_path = "./spill/nettest.spill";
+    unlink(config._spill_path.c_str());
+    std::thread killer;
+    Logs::NetStats stats = run("net_crash", collector.port(), config, [&](size_t i){
+        //Logging goes on while the collector hangs, the sink keeps writing to it
+        if (i == LINES / 4) killer = std::thread([&]{ collector.stop(true); });
+        //The second half goes out once the collector is back
+        if (i == LINES / 2)
+        {
+            killer.join();
+            collector.start();
+        }
+    });
+    return report("crash", settle(collector), stats, false);
+}
+
+//4、UDP: nothing is resent
+bool udp()
+{
+    Collector collector(Logs::NetProtocol::NET_UDP);
+    if (collector.start() == false) return false;
+    Logs::NetConfig config;
+    config._protocol = Logs::NetProtocol::NET_UDP;
+    Logs::NetStats stats = run("net_udp", collector.port(), config, [](size_t){});
+    return report("udp", settle(collector), stats, false);
+}
+
+int main(int argc, char* argv[])
+{
+    std::string only = argc > 1 ? argv[1] : "";
+    bool ok = true;
+    if (only.empty() || only == "tcp") ok = tcpSteady() && ok;
+    if (only.empty() || only == "spill") ok = tcpSpill() && ok;
+    if (only.empty() || only == "crash") ok = tcpCrash() && ok;
+    if (only.empty() || only == "udp") ok = udp() && ok;
+    return ok ? 0 : 1;
+}
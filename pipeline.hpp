@@ -0,0 +1,208 @@
+/*Pipelined backend for asynchronous loggers
+    1、Format: the looper's callback decodes and formats a drained batch into a free Batch
+    2、Encode (optional): encoder threads transform batches, several at a time
+    3、Write: one thread hands the batches to the sinks, in the order they were submitted
+    _depth batches rotate between the stages, so a slow write doesn't stop the next batches from being
+    formatted and encoded. With all of them in flight the format stage waits, and the queues fill up behind it.
+*/
+
+#ifndef __M_PIPE_H__
+#define __M_PIPE_H__
+
+#include "buffer.hpp"
+#include "fmtbuf.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+
+namespace Logs
+{
+    struct PipelineConfig
+    {
+        //Appends the encoded form of data to out, called for each part of a batch
+        using Encoder = std::function<void(const char* data, size_t len, FmtBuffer& out)>;
+
+        PipelineConfig() : _depth(0), _encode_threads(1) {}
+
+        size_t _depth;//Batches in flight, at least 2. 0: no pipeline, the backend thread writes the sinks itself
+        size_t _encode_threads;//Only used with an encoder
+        Encoder _encoder;
+    };
+
+    class Pipeline
+    {
+    public:
+        using Writer = std::function<void(const char* data, size_t len)>;
+        using Flusher = std::function<void()>;
+
+        struct Batch
+        {
+            Batch() : _seq(0), _flush(false), _ready(false) {}
+            FmtBuffer _text;//Formatted records, and drop reports. Written first
+            Buffer _raw;//Records already formatted by the caller threads, swapped in from the looper
+            FmtBuffer _encoded;//With an encoder, the only part written
+            uint64_t _seq;
+            bool _flush;//Flush the sinks once written
+            bool _ready;//Done with the encode stage
+        };
+
+        Pipeline(const PipelineConfig& config, const Writer& writer, const Flusher& flusher)
+            : _config(config), _writer(writer), _flusher(flusher), _submitted(0), _written(0), _stop(false)
+        {
+            if (_config._depth < 2) _config._depth = 2;
+            if (_config._encode_threads == 0) _config._encode_threads = 1;
+            _batches.resize(_config._depth);
+            _slots.resize(_config._depth, nullptr);
+            for (auto& b : _batches)
+            {
+                b.reset(new Batch());
+                _free.push_back(b.get());
+            }
+            if (_config._encoder)
+            {
+                for (size_t i = 0; i < _config._encode_threads; ++i)
+                    _encoders.emplace_back(&Pipeline::encode_loop, this);
+            }
+            _write_thread = std::thread(&Pipeline::write_loop, this);
+        }
+
+        //Everything submitted is written before this returns
+        ~Pipeline()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _encode_cond.notify_all();
+            _write_cond.notify_all();
+            for (auto& t : _encoders) t.join();
+            _write_thread.join();
+        }
+
+        Pipeline(const Pipeline&) = delete;
+        Pipeline& operator=(const Pipeline&) = delete;
+
+        //Format stage: an empty batch, waits while every batch is in flight
+        Batch* acquire()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _free_cond.wait(lock, [&]{ return _free.empty() == false; });
+            Batch* b = _free.front();
+            _free.pop_front();
+            return b;
+        }
+
+        //Format stage: batches are written in the order they are submitted here
+        //Returns the sequence number of the batch
+        uint64_t submit(Batch* b)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            b->_seq = _submitted++;
+            _slots[b->_seq % _config._depth] = b;
+            if (_config._encoder)
+            {
+                _encode_q.push_back(b);
+                _encode_cond.notify_one();
+            }
+            else
+            {
+                b->_ready = true;
+                _write_cond.notify_one();
+            }
+            return b->_seq;
+        }
+
+        //Returns once every batch submitted so far is written and the sinks are flushed
+        void flush()
+        {
+            Batch* b = acquire();
+            b->_flush = true;
+            uint64_t seq = submit(b);
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done_cond.wait(lock, [&]{ return _written > seq; });
+        }
+    private:
+        void encode_loop()
+        {
+            while (1)
+            {
+                Batch* b = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _encode_cond.wait(lock, [&]{ return _encode_q.empty() == false || _stop; });
+                    if (_encode_q.empty()) return ;//Stopped and nothing left
+                    b = _encode_q.front();
+                    _encode_q.pop_front();
+                }
+                if (b->_text.empty() == false) _config._encoder(b->_text.data(), b->_text.size(), b->_encoded);
+                if (b->_raw.empty() == false) _config._encoder(b->_raw.begin(), b->_raw.readAbleSize(), b->_encoded);
+                std::unique_lock<std::mutex> lock(_mutex);
+                b->_ready = true;
+                //Other encoders may finish later batches first, only the one the writer waits for matters
+                if (b->_seq == _written) _write_cond.notify_one();
+            }
+        }
+
+        void write_loop()
+        {
+            while (1)
+            {
+                Batch* b = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _write_cond.wait(lock, [&]{
+                        Batch* next = _slots[_written % _config._depth];
+                        return (next != nullptr && next->_ready) || (_stop && _written == _submitted);
+                    });
+                    b = _slots[_written % _config._depth];
+                    if (b == nullptr) return ;//Stopped and everything written
+                }
+                if (_config._encoder)
+                {
+                    if (b->_encoded.empty() == false) _writer(b->_encoded.data(), b->_encoded.size());
+                }
+                else
+                {
+                    if (b->_text.empty() == false) _writer(b->_text.data(), b->_text.size());
+                    if (b->_raw.empty() == false) _writer(b->_raw.begin(), b->_raw.readAbleSize());
+                }
+                if (b->_flush) _flusher();
+                b->_text.clear();
+                b->_raw.reset();
+                b->_encoded.clear();
+                b->_flush = false;
+                b->_ready = false;
+                std::unique_lock<std::mutex> lock(_mutex);
+                _slots[_written % _config._depth] = nullptr;
+                ++_written;
+                _free.push_back(b);
+                _free_cond.notify_one();
+                _done_cond.notify_all();
+            }
+        }
+    private:
+        PipelineConfig _config;
+        Writer _writer;
+        Flusher _flusher;
+        std::vector<std::unique_ptr<Batch>> _batches;
+        std::mutex _mutex;
+        std::condition_variable _free_cond;
+        std::condition_variable _encode_cond;
+        std::condition_variable _write_cond;
+        std::condition_variable _done_cond;//flush() waiting for _written
+        std::deque<Batch*> _free;
+        std::deque<Batch*> _encode_q;
+        std::vector<Batch*> _slots;//Submitted and not yet written, indexed by _seq % _depth
+        uint64_t _submitted;
+        uint64_t _written;//Next batch to write
+        bool _stop;
+        std::vector<std::thread> _encoders;
+        std::thread _write_thread;
+    };
+}
+
+#endif
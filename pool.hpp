@@ -0,0 +1,231 @@
+/*Shared backend for asynchronous loggers
+    A fixed number of worker threads service the queues of every logger attached to the pool,
+    instead of one thread per logger. Each worker has its own deque of runnable tasks and steals
+    from the others when it runs dry. A task is in at most one deque at a time (see AsyncLooper),
+    so one logger is never drained by two workers at once and its order is kept.
+    Tasks can also be submitted for later (submitAt), an idle worker moves them to a deque when they are due.
+*/
+
+#ifndef __M_POOL_H__
+#define __M_POOL_H__
+
+#include "buffer.hpp"
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+
+namespace Logs
+{
+    class BackendTask
+    {
+    public:
+        virtual ~BackendTask() {}
+        //Process one batch, out is the worker's scratch buffer
+        virtual void run(Buffer& out) = 0;
+    };
+
+    class BackendPool
+    {
+    public:
+        using ptr = std::shared_ptr<BackendPool>;
+
+        explicit BackendPool(size_t threads) : _next(0), _pending(0), _idle(0), _timed(0), _due(0), _stop(false)
+        {
+            if (threads == 0) threads = 1;
+            for (size_t i = 0; i < threads; ++i) _workers.emplace_back(new Worker());
+            //Started last, every worker may steal from every deque
+            for (size_t i = 0; i < threads; ++i)
+                _workers[i]->_thread = std::thread(&BackendPool::worker_loop, this, i);
+        }
+
+        //Loggers hold a reference to the pool, so no task is left when this runs
+        ~BackendPool()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _cond.notify_all();
+            for (auto& w : _workers) w->_thread.join();
+        }
+
+        BackendPool(const BackendPool&) = delete;
+        BackendPool& operator=(const BackendPool&) = delete;
+
+        size_t size() {return _workers.size(); }
+
+        //A worker resubmitting goes to its own deque, other threads spread tasks round robin
+        void submit(BackendTask* task)
+        {
+            size_t i = current() == this ? index() : _next.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+            {
+                std::unique_lock<std::mutex> lock(_workers[i]->_mutex);
+                _workers[i]->_tasks.push_back(task);
+            }
+            //Pairs with worker_loop: either the worker sees the task, or we see it idle
+            _pending.fetch_add(1, std::memory_order_seq_cst);
+            if (_idle.load(std::memory_order_seq_cst) > 0)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cond.notify_one();
+            }
+        }
+
+        //Run task once when is reached, not before. Idle workers sleep until the earliest of these
+        void submitAt(BackendTask* task, std::chrono::steady_clock::time_point when)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            bool earliest = _timers.empty() || when < _timers.front()._when;
+            _timers.push_back(Timer(when, task));
+            std::push_heap(_timers.begin(), _timers.end());
+            _due.store(_timers.front()._when.time_since_epoch().count(), std::memory_order_relaxed);
+            _timed.store(_timers.size(), std::memory_order_release);
+            //A sleeping worker may be waiting for a later timer, or for none at all
+            if (earliest && _idle.load(std::memory_order_relaxed) > 0) _cond.notify_one();
+        }
+
+        //Remove task from the timers, false if it was not there (already due and moved to a deque)
+        //Once this returns, a removed timer can no longer fire
+        bool cancel(BackendTask* task)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            size_t before = _timers.size();
+            _timers.erase(std::remove_if(_timers.begin(), _timers.end(), [&](const Timer& t){ return t._task == task; }), _timers.end());
+            if (_timers.size() == before) return false;
+            std::make_heap(_timers.begin(), _timers.end());
+            if (_timers.empty() == false) _due.store(_timers.front()._when.time_since_epoch().count(), std::memory_order_relaxed);
+            _timed.store(_timers.size(), std::memory_order_release);
+            return true;
+        }
+    private:
+        struct Timer
+        {
+            Timer(std::chrono::steady_clock::time_point when, BackendTask* task) : _when(when), _task(task) {}
+            //Reversed so that std heap functions build a min-heap
+            bool operator<(const Timer& t) const {return _when > t._when; }
+            std::chrono::steady_clock::time_point _when;
+            BackendTask* _task;
+        };
+
+        struct Worker
+        {
+            std::mutex _mutex;
+            std::deque<BackendTask*> _tasks;
+            Buffer _out;
+            std::thread _thread;
+        };
+
+        //Which pool and worker the calling thread belongs to
+        static BackendPool*& current()
+        {
+            static thread_local BackendPool* pool = nullptr;
+            return pool;
+        }
+        static size_t& index()
+        {
+            static thread_local size_t i = 0;
+            return i;
+        }
+
+        //Newest task of our own deque first, it is still warm in this core's cache,
+        //then the oldest task of the other deques
+        BackendTask* take(size_t i)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_workers[i]->_mutex);
+                if (_workers[i]->_tasks.empty() == false)
+                {
+                    BackendTask* task = _workers[i]->_tasks.back();
+                    _workers[i]->_tasks.pop_back();
+                    return task;
+                }
+            }
+            for (size_t k = 1; k < _workers.size(); ++k)
+            {
+                Worker& victim = *_workers[(i + k) % _workers.size()];
+                std::unique_lock<std::mutex> lock(victim._mutex, std::try_to_lock);
+                if (lock.owns_lock() == false || victim._tasks.empty()) continue;
+                BackendTask* task = victim._tasks.front();
+                victim._tasks.pop_front();
+                return task;
+            }
+            return nullptr;
+        }
+
+        //Move due timers to worker i's deque. Done under _mutex, so that cancel() either finds a timer or it has fired
+        //Busy workers only pay for a load and a clock read, and only while timers exist
+        void fireTimers(size_t i)
+        {
+            if (_timed.load(std::memory_order_acquire) == 0) return ;
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now.time_since_epoch().count() < _due.load(std::memory_order_relaxed)) return ;
+            std::unique_lock<std::mutex> lock(_mutex);
+            size_t fired = 0;
+            while (_timers.empty() == false && _timers.front()._when <= now)
+            {
+                {
+                    std::unique_lock<std::mutex> wlock(_workers[i]->_mutex);
+                    _workers[i]->_tasks.push_back(_timers.front()._task);
+                }
+                std::pop_heap(_timers.begin(), _timers.end());
+                _timers.pop_back();
+                ++fired;
+            }
+            if (_timers.empty() == false) _due.store(_timers.front()._when.time_since_epoch().count(), std::memory_order_relaxed);
+            _timed.store(_timers.size(), std::memory_order_release);
+            if (fired == 0) return ;
+            _pending.fetch_add(fired, std::memory_order_seq_cst);
+            //One task is ours, the rest can be stolen by whoever is sleeping
+            if (fired > 1 && _idle.load(std::memory_order_relaxed) > 0) _cond.notify_all();
+        }
+
+        void worker_loop(size_t i)
+        {
+            current() = this;
+            index() = i;
+            while (1)
+            {
+                fireTimers(i);
+                BackendTask* task = take(i);
+                if (task != nullptr)
+                {
+                    _pending.fetch_sub(1, std::memory_order_relaxed);
+                    task->run(_workers[i]->_out);
+                    _workers[i]->_out.reset();
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (_stop) return;
+                _idle.fetch_add(1, std::memory_order_seq_cst);
+                //A steal that lost a try_lock leaves _pending above zero, the loop then simply retries
+                //No predicate: after any wake-up the loop fires timers and looks again, the earliest timer may have changed
+                if (_pending.load(std::memory_order_seq_cst) == 0)
+                {
+                    _workers[i]->_out.shrink();
+                    if (_timers.empty()) _cond.wait(lock);
+                    else _cond.wait_until(lock, _timers.front()._when);
+                }
+                _idle.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+    private:
+        std::vector<std::unique_ptr<Worker>> _workers;
+        std::atomic<size_t> _next;//Round robin for submissions from outside the pool
+        std::atomic<size_t> _pending;//Tasks sitting in the deques
+        std::atomic<int> _idle;//Workers waiting on _cond
+        std::atomic<size_t> _timed;//Size of _timers
+        std::atomic<int64_t> _due;//Earliest timer, steady_clock ticks
+        std::vector<Timer> _timers;//Min-heap on _when, guarded by _mutex
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        bool _stop;
+    };
+}
+
+#endif
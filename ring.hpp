@@ -0,0 +1,591 @@
+/*Lock-free rings for the asynchronous logger
+    1、MpscRing: one ring shared by every producer thread
+    2、SpscRing: one ring per producer thread, records carry a timestamp so the backend can merge them
+    MpscRing: producers reserve space with one fetch_add on _write, copy their bytes, then publish the record
+    by storing its header last. The consumer walks the published records in reservation order,
+    copies them out, zeroes the space and hands it back by moving _read.
+    Nothing on this path takes a lock; only a producer that finds the ring full parks.
+    The rings and the records too big for them are mapped from BlockArena and count against its limit.
+*/
+
+#ifndef __M_RING_H__
+#define __M_RING_H__
+
+#include "buffer.hpp"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+namespace Logs
+{
+    //Power of two sized memory shared by the rings, records may wrap around its end
+    class RingMemory
+    {
+    public:
+        //With capped set, a ring that isn't valid() instead of going over BlockArena's limit
+        RingMemory(size_t capacity, bool capped) : _capacity(roundUp(capacity)), _mask(_capacity - 1)
+        {
+            size_t size = _capacity;
+            _ring = BlockArena::instance().acquirePages(size, capped);
+            if (_ring == nullptr && capped == false)
+            {
+                std::cout << "Log ring allocation failed! \n";
+                abort();
+            }
+        }
+        ~RingMemory()
+        {
+            if (_ring != nullptr) BlockArena::instance().releasePages(_ring, _capacity);
+        }
+
+        RingMemory(const RingMemory&) = delete;
+        RingMemory& operator=(const RingMemory&) = delete;
+
+        size_t capacity() {return _capacity; }
+        bool valid() {return _ring != nullptr; }
+    protected:
+        static size_t roundUp(size_t n)
+        {
+            size_t cap = 64;
+            while (cap < n) cap <<= 1;
+            return cap;
+        }
+
+        //Copies that may wrap around the end of the ring
+        void copyIn(uint64_t pos, const char* data, size_t len)
+        {
+            size_t off = pos & _mask;
+            size_t first = len < _capacity - off ? len : _capacity - off;
+            memcpy(_ring + off, data, first);
+            memcpy(_ring, data + first, len - first);
+        }
+
+        void copyOut(uint64_t pos, char* dst, size_t len)
+        {
+            size_t off = pos & _mask;
+            size_t first = len < _capacity - off ? len : _capacity - off;
+            memcpy(dst, _ring + off, first);
+            memcpy(dst + first, _ring, len - first);
+        }
+
+        void appendOut(Buffer& out, uint64_t pos, size_t len)
+        {
+            size_t off = pos & _mask;
+            size_t first = len < _capacity - off ? len : _capacity - off;
+            out.push(_ring + off, first);
+            if (len > first) out.push(_ring, len - first);
+        }
+
+        //len bytes at pos in one piece: in place, or copied to scratch if they wrap. nullptr if scratch is too small
+        const char* view(uint64_t pos, size_t len, char* scratch, size_t cap)
+        {
+            size_t off = pos & _mask;
+            if (len <= _capacity - off) return _ring + off;
+            if (len > cap) return nullptr;
+            copyOut(pos, scratch, len);
+            return scratch;
+        }
+
+        //Records too big for the ring carry a pointer to a size_t length + bytes, mapped from BlockArena
+        //nullptr if capped and the arena's limit is reached
+        static char* copyOversize(const char* data, size_t len, bool capped)
+        {
+            size_t size = sizeof(size_t) + len;
+            char* heap = BlockArena::instance().acquirePages(size, capped);
+            if (heap == nullptr)
+            {
+                if (capped) return nullptr;
+                std::cout << "Log record allocation failed! \n";
+                abort();
+            }
+            memcpy(heap, &len, sizeof(size_t));
+            memcpy(heap + sizeof(size_t), data, len);
+            return heap;
+        }
+
+        static void freeOversize(char* heap)
+        {
+            size_t len;
+            memcpy(&len, heap, sizeof(size_t));
+            BlockArena::instance().releasePages(heap, sizeof(size_t) + len);
+        }
+
+        void zero(uint64_t pos, size_t len)
+        {
+            size_t off = pos & _mask;
+            size_t first = len < _capacity - off ? len : _capacity - off;
+            memset(_ring + off, 0, first);
+            memset(_ring, 0, len - first);
+        }
+    protected:
+        char* _ring;
+        const size_t _capacity;
+        const size_t _mask;
+    };
+
+    /*Record: 8 byte header + payload, padded to a multiple of 8
+        header bit 63     committed, the record may be read
+        header bits 32-39 flags
+        header bits 0-31  payload length
+      A zero header means "not written yet", the consumer zeroes everything it consumed.
+    */
+    class MpscRing : public RingMemory
+    {
+    public:
+        enum
+        {
+            HEADER_SIZE = 8,
+            FLAG_INDIRECT = 1//Too big for the ring, the payload is a pointer to a copy, see copyOversize
+        };
+
+        explicit MpscRing(size_t capacity = DEFAULT_BUFFER_SIZE)
+            : RingMemory(capacity, false), _write(0), _read(0), _waiting(0)
+        {}
+
+        ~MpscRing()
+        {
+            size_t records;
+            consume(nullptr, _capacity, records);//Frees indirect payloads still in the ring
+        }
+
+        MpscRing(const MpscRing&) = delete;
+        MpscRing& operator=(const MpscRing&) = delete;
+
+        //Producer side, blocks while the ring is full. Oversize records ignore BlockArena's limit
+        void push(const char* data, size_t len)
+        {
+            char* heap = nullptr;
+            uint32_t flags;
+            indirect(data, len, heap, flags, false);
+            size_t rec = recordSize(len);
+            uint64_t pos = _write.fetch_add(rec, std::memory_order_relaxed);
+            waitForSpace(pos + rec);
+            publish(pos, data, len, flags);
+        }
+
+        //Producer side, never waits: false if the ring has no room for the record
+        //A compare-and-swap instead of fetch_add, a failed reservation can't be given back
+        //Also false if the record is too big for the ring and BlockArena's limit is reached
+        bool tryPush(const char* data, size_t len)
+        {
+            char* heap = nullptr;
+            uint32_t flags;
+            if (indirect(data, len, heap, flags, true) == false) return false;
+            uint64_t pos;
+            if (tryReserve(recordSize(len), pos) == false)
+            {
+                if (heap != nullptr) freeOversize(heap);
+                return false;
+            }
+            publish(pos, data, len, flags);
+            return true;
+        }
+
+        //Producer side, waits for room until deadline. Like tryPush for BlockArena's limit
+        bool pushUntil(const char* data, size_t len, std::chrono::steady_clock::time_point deadline)
+        {
+            char* heap = nullptr;
+            uint32_t flags;
+            if (indirect(data, len, heap, flags, true) == false) return false;
+            size_t rec = recordSize(len);
+            uint64_t pos;
+            while (tryReserve(rec, pos) == false)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _waiting.fetch_add(1, std::memory_order_seq_cst);
+                bool room = _space_cond.wait_until(lock, deadline, [&]{
+                    return _write.load(std::memory_order_relaxed) + rec <= _read.load(std::memory_order_seq_cst) + _capacity;
+                });
+                _waiting.fetch_sub(1, std::memory_order_relaxed);
+                if (room == false)
+                {
+                    if (heap != nullptr) freeOversize(heap);
+                    return false;
+                }
+            }
+            publish(pos, data, len, flags);
+            return true;
+        }
+
+        //Consumer side: append up to max_bytes of published records to out and free their space
+        //Returns the number of payload bytes appended
+        size_t drain(Buffer& out, size_t max_bytes)
+        {
+            size_t records;
+            return consume(&out, max_bytes, records);
+        }
+
+        //Producer side, drop-oldest policy: throw away up to max_bytes of the oldest records to make room
+        //Returns false if the consumer is busy draining, it will free space anyway
+        bool discard(size_t max_bytes, size_t& records, size_t& bytes)
+        {
+            std::unique_lock<std::mutex> lock(_consume_mutex, std::try_to_lock);
+            if (lock.owns_lock() == false) return false;
+            bytes = consumeLocked(nullptr, max_bytes, records);
+            return true;
+        }
+
+        //A published record is waiting at the read position
+        bool readable()
+        {
+            uint64_t header = __atomic_load_n((uint64_t*)(_ring + (_read.load(std::memory_order_relaxed) & _mask)), __ATOMIC_ACQUIRE);
+            return (header >> 63) != 0;
+        }
+
+        //Nothing reserved and not yet consumed
+        bool empty() {return _write.load(std::memory_order_acquire) == _read.load(std::memory_order_acquire); }
+
+        //Bytes reserved and not yet consumed, including headers
+        size_t pendingBytes() {return _write.load(std::memory_order_relaxed) - _read.load(std::memory_order_relaxed); }
+
+        //Every record reserved before reserved() returned x is consumed once consumed() reaches x
+        uint64_t reserved() {return _write.load(std::memory_order_acquire); }
+        uint64_t consumed() {return _read.load(std::memory_order_acquire); }
+
+        //Crash handler side: fn(data, len) on every published record, in order, without consuming anything
+        //No lock, the other threads may be stopped anywhere: stops at the first record not published yet
+        template <typename Fn>
+        void crashVisit(Fn fn, char* scratch, size_t cap)
+        {
+            uint64_t start = _read.load(std::memory_order_acquire);
+            for (uint64_t r = start; r - start < _capacity;)
+            {
+                uint64_t header = __atomic_load_n((uint64_t*)(_ring + (r & _mask)), __ATOMIC_ACQUIRE);
+                if ((header >> 63) == 0) break;
+                size_t len = header & 0xffffffffULL;
+                if (((header >> 32) & 0xff) & FLAG_INDIRECT)
+                {
+                    char* heap;
+                    copyOut(r + HEADER_SIZE, (char*)&heap, sizeof(heap));
+                    size_t heap_len;
+                    memcpy(&heap_len, heap, sizeof(size_t));
+                    fn((const char*)heap + sizeof(size_t), heap_len);
+                }
+                else
+                {
+                    const char* data = view(r + HEADER_SIZE, len, scratch, cap);
+                    if (data) fn(data, len);
+                }
+                r += recordSize(len);
+            }
+        }
+
+    private:
+        static size_t recordSize(size_t len) {return (HEADER_SIZE + len + 7) & ~(size_t)7; }
+
+        //Records too big for the ring are replaced by a pointer to their copy. False if capped and the copy was refused
+        bool indirect(const char*& data, size_t& len, char*& heap, uint32_t& flags, bool capped)
+        {
+            flags = 0;
+            if (recordSize(len) <= _capacity) return true;
+            heap = copyOversize(data, len, capped);
+            if (heap == nullptr) return false;
+            data = (const char*)&heap;
+            len = sizeof(heap);
+            flags = FLAG_INDIRECT;
+            return true;
+        }
+
+        bool tryReserve(size_t rec, uint64_t& pos)
+        {
+            pos = _write.load(std::memory_order_relaxed);
+            do
+            {
+                //_read is loaded after pos and may be ahead of it, then the CAS fails anyway
+                if (pos + rec > _read.load(std::memory_order_acquire) + _capacity) return false;
+            } while (_write.compare_exchange_weak(pos, pos + rec, std::memory_order_relaxed) == false);
+            return true;
+        }
+
+        void publish(uint64_t pos, const char* data, size_t len, uint32_t flags)
+        {
+            copyIn(pos + HEADER_SIZE, data, len);
+            uint64_t header = (1ULL << 63) | ((uint64_t)flags << 32) | len;
+            __atomic_store_n((uint64_t*)(_ring + (pos & _mask)), header, __ATOMIC_RELEASE);
+        }
+
+        size_t consume(Buffer* out, size_t max_bytes, size_t& records)
+        {
+            std::unique_lock<std::mutex> lock(_consume_mutex);
+            return consumeLocked(out, max_bytes, records);
+        }
+
+        //Appends the payloads to out, or only counts them when out is null
+        size_t consumeLocked(Buffer* out, size_t max_bytes, size_t& records)
+        {
+            uint64_t start = _read.load(std::memory_order_relaxed);
+            uint64_t r = start;
+            size_t bytes = 0;
+            for (records = 0; r - start < max_bytes; ++records)
+            {
+                uint64_t header = __atomic_load_n((uint64_t*)(_ring + (r & _mask)), __ATOMIC_ACQUIRE);
+                if ((header >> 63) == 0) break;//Not published yet, later records have to wait for it
+                size_t len = header & 0xffffffffULL;
+                uint32_t flags = (header >> 32) & 0xff;
+                if (flags & FLAG_INDIRECT)
+                {
+                    char* heap;
+                    copyOut(r + HEADER_SIZE, (char*)&heap, sizeof(heap));
+                    size_t heap_len;
+                    memcpy(&heap_len, heap, sizeof(size_t));
+                    if (out) out->push(heap + sizeof(size_t), heap_len);
+                    bytes += heap_len;
+                    freeOversize(heap);
+                }
+                else
+                {
+                    if (out) appendOut(*out, r + HEADER_SIZE, len);
+                    bytes += len;
+                }
+                r += recordSize(len);
+            }
+            if (r == start) return 0;
+            //Zero before handing the space back, stale bytes must never look like a header
+            zero(start, r - start);
+            _read.store(r, std::memory_order_seq_cst);//Ordered before the _waiting check below
+            if (_waiting.load(std::memory_order_seq_cst) > 0)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _space_cond.notify_all();
+            }
+            return bytes;
+        }
+
+        void waitForSpace(uint64_t end)
+        {
+            if (end - _read.load(std::memory_order_acquire) <= _capacity) return ;
+            //Full: spin briefly, the consumer frees a whole batch at a time
+            for (int i = 0; i < 64; ++i)
+            {
+                std::this_thread::yield();
+                if (end - _read.load(std::memory_order_acquire) <= _capacity) return ;
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            _waiting.fetch_add(1, std::memory_order_seq_cst);
+            _space_cond.wait(lock, [&]{ return end - _read.load(std::memory_order_seq_cst) <= _capacity; });
+            _waiting.fetch_sub(1, std::memory_order_relaxed);
+        }
+    private:
+        //Producers and the consumer touch different counters, keep them on different cache lines
+        alignas(64) std::atomic<uint64_t> _write;//Next position to reserve
+        alignas(64) std::atomic<uint64_t> _read;//Everything before it has been consumed
+        alignas(64) std::atomic<int> _waiting;//Producers parked on a full ring
+        std::mutex _mutex;
+        std::condition_variable _space_cond;
+        std::mutex _consume_mutex;//The worker, or a producer dropping the oldest records
+    };
+
+    //What SpscRing::drain appends for each record, followed by the payload
+    struct StagedRecord
+    {
+        uint64_t _stamp;
+        uint64_t _len;
+    };
+
+    /*Single producer ring: only the owning thread writes, only the backend reads
+        (under the drop-oldest policy the owner may also throw records away, both sides take _consume_mutex)
+        Record: uint32_t length | uint32_t flags | uint64_t stamp | payload, padded to a multiple of 8
+        Positions are published with a release store, so no header needs to be zeroed
+        Each side keeps a stale copy of the other side's position and only reloads it when it runs out
+    */
+    class SpscRing : public RingMemory
+    {
+    public:
+        using ptr = std::shared_ptr<SpscRing>;
+
+        enum
+        {
+            HEADER_SIZE = 16,
+            FLAG_INDIRECT = 1
+        };
+
+        //capped: see RingMemory, check valid()
+        SpscRing(size_t capacity, bool capped)
+            : RingMemory(capacity, capped), _write(0), _read_cache(0), _last_stamp(0), _spill_gen(0), _pushing(0), _read(0), _write_cache(0), _closed(false), _orphaned(false)
+        {}
+
+        ~SpscRing()
+        {
+            size_t bytes;
+            consume(nullptr, (size_t)-1, bytes);//Frees indirect payloads still in the ring
+        }
+
+        //Producer side: stamps strictly increase, two records of one thread never tie in the merge
+        uint64_t stamp(uint64_t now)
+        {
+            if (now <= _last_stamp) now = _last_stamp + 1;
+            _last_stamp = now;
+            return now;
+        }
+
+        //Producer side, around each push, before the clock is read: the backend holds back records stamped after
+        //this bound until the push ends, a record stamped before a pass but published late is not overtaken
+        void beginPush() {_pushing.store(_last_stamp + 1, std::memory_order_seq_cst); }
+        void endPush() {_pushing.store(0, std::memory_order_release); }
+
+        //Consumer side, now read from the clock before calling: records stamped from there on may still come in
+        uint64_t watermark(uint64_t now)
+        {
+            uint64_t pushing = _pushing.load(std::memory_order_seq_cst);
+            return pushing != 0 && pushing < now ? pushing : now;
+        }
+
+        //Producer side: batch of the looper's overflow buffer this thread last spilled into
+        uint64_t spillGeneration() {return _spill_gen; }
+        void setSpillGeneration(uint64_t gen) {_spill_gen = gen; }
+
+        //Producer side: false if the ring has no room for the record right now
+        //or, with capped set, if the record is too big for the ring and BlockArena's limit is reached
+        bool tryPush(const char* data, size_t len, uint64_t stamp, bool capped)
+        {
+            size_t body = len + HEADER_SIZE > _capacity ? sizeof(char*) : len;
+            size_t rec = recordSize(body);
+            uint64_t w = _write.load(std::memory_order_relaxed);
+            if (w + rec - _read_cache > _capacity)
+            {
+                _read_cache = _read.load(std::memory_order_acquire);
+                if (w + rec - _read_cache > _capacity) return false;
+            }
+            uint32_t header[2] = {(uint32_t)body, 0};
+            if (body != len)
+            {
+                //Too big for the ring: the ring holds the pointer to a copy
+                char* heap = copyOversize(data, len, capped);
+                if (heap == nullptr) return false;
+                copyIn(w + HEADER_SIZE, (const char*)&heap, sizeof(heap));
+                header[1] = FLAG_INDIRECT;
+            }
+            else copyIn(w + HEADER_SIZE, data, len);
+            copyIn(w, (const char*)header, sizeof(header));
+            copyIn(w + sizeof(header), (const char*)&stamp, sizeof(stamp));
+            _write.store(w + rec, std::memory_order_release);
+            return true;
+        }
+
+        //Consumer side: append every published record to out as StagedRecord + payload
+        //Returns the number of records
+        size_t drain(Buffer& out)
+        {
+            std::unique_lock<std::mutex> lock(_consume_mutex);
+            size_t bytes;
+            return consume(&out, (size_t)-1, bytes);
+        }
+
+        //Producer side, drop-oldest policy: throw away up to max_bytes of the oldest records to make room
+        //Returns false if the consumer is busy draining, it will free space anyway
+        bool discard(size_t max_bytes, size_t& records, size_t& bytes)
+        {
+            std::unique_lock<std::mutex> lock(_consume_mutex, std::try_to_lock);
+            if (lock.owns_lock() == false) return false;
+            records = consume(nullptr, max_bytes, bytes);
+            return true;
+        }
+
+        bool empty() {return _read.load(std::memory_order_relaxed) == _write.load(std::memory_order_acquire); }
+
+        //Bytes published and not yet consumed, including headers
+        size_t pendingBytes() {return _write.load(std::memory_order_acquire) - _read.load(std::memory_order_acquire); }
+
+        //Crash handler side: fn(stamp, data, len) on every published record, in order, without consuming anything
+        template <typename Fn>
+        void crashVisit(Fn fn, char* scratch, size_t cap)
+        {
+            uint64_t w = _write.load(std::memory_order_acquire);
+            for (uint64_t r = _read.load(std::memory_order_acquire); r < w;)
+            {
+                uint32_t header[2];
+                uint64_t stamp;
+                copyOut(r, (char*)header, sizeof(header));
+                copyOut(r + sizeof(header), (char*)&stamp, sizeof(stamp));
+                if (header[1] & FLAG_INDIRECT)
+                {
+                    char* heap;
+                    copyOut(r + HEADER_SIZE, (char*)&heap, sizeof(heap));
+                    size_t heap_len;
+                    memcpy(&heap_len, heap, sizeof(size_t));
+                    fn(stamp, (const char*)heap + sizeof(size_t), heap_len);
+                }
+                else
+                {
+                    const char* data = view(r + HEADER_SIZE, header[0], scratch, cap);
+                    if (data) fn(stamp, data, (size_t)header[0]);
+                }
+                r += recordSize(header[0]);
+            }
+        }
+
+        //The producer thread exited, the ring can go once it is drained
+        void close() {_closed.store(true, std::memory_order_release); }
+        bool closed() {return _closed.load(std::memory_order_acquire); }
+
+        //The consumer is gone, the producer thread drops the ring from its list
+        void orphan() {_orphaned.store(true, std::memory_order_release); }
+        bool orphaned() {return _orphaned.load(std::memory_order_acquire); }
+    private:
+        //Appends the records to out, or only counts them when out is null. Called with _consume_mutex held
+        size_t consume(Buffer* out, size_t max_bytes, size_t& bytes)
+        {
+            uint64_t start = _read.load(std::memory_order_relaxed);
+            uint64_t r = start;
+            if (r == _write_cache)
+            {
+                _write_cache = _write.load(std::memory_order_acquire);
+                if (r == _write_cache) return 0;
+            }
+            size_t count = 0;
+            for (bytes = 0; r != _write_cache && r - start < max_bytes; ++count)
+            {
+                uint32_t header[2];
+                StagedRecord staged;
+                copyOut(r, (char*)header, sizeof(header));
+                copyOut(r + sizeof(header), (char*)&staged._stamp, sizeof(staged._stamp));
+                if (header[1] & FLAG_INDIRECT)
+                {
+                    char* heap;
+                    copyOut(r + HEADER_SIZE, (char*)&heap, sizeof(heap));
+                    memcpy(&staged._len, heap, sizeof(size_t));
+                    if (out)
+                    {
+                        out->push((const char*)&staged, sizeof(staged));
+                        out->push(heap + sizeof(size_t), staged._len);
+                    }
+                    freeOversize(heap);
+                }
+                else
+                {
+                    staged._len = header[0];
+                    if (out)
+                    {
+                        out->push((const char*)&staged, sizeof(staged));
+                        appendOut(*out, r + HEADER_SIZE, header[0]);
+                    }
+                }
+                bytes += staged._len;
+                r += recordSize(header[0]);
+            }
+            _read.store(r, std::memory_order_release);
+            return count;
+        }
+
+        static size_t recordSize(size_t len) {return (HEADER_SIZE + len + 7) & ~(size_t)7; }
+    private:
+        alignas(64) std::atomic<uint64_t> _write;
+        uint64_t _read_cache;//Producer's view of _read
+        uint64_t _last_stamp;
+        uint64_t _spill_gen;
+        std::atomic<uint64_t> _pushing;//Lower bound of the stamp being pushed, 0 if none
+        alignas(64) std::atomic<uint64_t> _read;
+        uint64_t _write_cache;//Consumer's view of _write, guarded by _consume_mutex
+        std::mutex _consume_mutex;//The worker, or the producer dropping its oldest records
+        alignas(64) std::atomic<bool> _closed;
+        std::atomic<bool> _orphaned;
+    };
+}
+
+#endif
@@ -0,0 +1,144 @@
+/*Background work of the rolling file sinks
+    One thread shared by every rolling sink runs their timed tasks: creating the directory and opening
+    the next file ahead of time, marking a wall-clock boundary, closing the file that was replaced.
+    The logging path only picks up a descriptor that is already open.
+    Every FileWriter (filewriter.hpp) also flushes and syncs on it the bytes it would otherwise hold too long.
+*/
+
+#ifndef __M_ROTATE_H__
+#define __M_ROTATE_H__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <cstdint>
+
+namespace Logs
+{
+    class Rotator
+    {
+    public:
+        using Task = std::function<void()>;
+        using Clock = std::chrono::system_clock;
+
+        //Never destroyed, like BlockArena: static sinks may cancel their tasks after every other static is gone
+        static Rotator& instance()
+        {
+            static Rotator* rotator = new Rotator();
+            return *rotator;
+        }
+
+        Rotator(const Rotator&) = delete;
+        Rotator& operator=(const Rotator&) = delete;
+
+        //Run task at when. owner identifies the tasks cancel() removes, nullptr for tasks that must always run
+        void at(const void* owner, Clock::time_point when, const Task& task)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _tasks.push_back(Entry(owner, when, _seq++, task));
+            std::push_heap(_tasks.begin(), _tasks.end());
+            _cond.notify_one();
+        }
+
+        void post(const void* owner, const Task& task) {at(owner, Clock::now(), task); }
+
+        //Drop owner's pending tasks, and wait for the one running, if any. Must not be called from a task
+        void cancel(const void* owner)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _tasks.erase(std::remove_if(_tasks.begin(), _tasks.end(), [&](const Entry& e){ return e._owner == owner; }), _tasks.end());
+            std::make_heap(_tasks.begin(), _tasks.end());
+            _idle_cond.wait(lock, [&]{ return _running != owner; });
+        }
+
+        //Start of the period of gap seconds after the one t falls in, on local wall-clock boundaries
+        //Days follow the calendar, a day with a DST change is not 86400 seconds
+        static time_t nextBoundary(time_t t, time_t gap)
+        {
+            if (gap <= 1) return t + 1;
+            struct tm lt;
+            localtime_r(&t, &lt);
+            lt.tm_sec = 0;
+            if (gap >= 3600) lt.tm_min = 0;
+            if (gap >= 86400) lt.tm_hour = 0;
+            if (gap >= 86400) lt.tm_mday += 1;
+            else if (gap >= 3600) lt.tm_hour += 1;
+            else lt.tm_min += 1;
+            lt.tm_isdst = -1;
+            return mktime(&lt);
+        }
+
+        //Start of the period t falls in
+        static time_t periodStart(time_t t, time_t gap)
+        {
+            if (gap <= 1) return t;
+            struct tm lt;
+            localtime_r(&t, &lt);
+            lt.tm_sec = 0;
+            if (gap >= 3600) lt.tm_min = 0;
+            if (gap >= 86400) lt.tm_hour = 0;
+            lt.tm_isdst = -1;
+            return mktime(&lt);
+        }
+    private:
+        struct Entry
+        {
+            Entry(const void* owner, Clock::time_point when, uint64_t seq, const Task& task)
+                : _owner(owner), _when(when), _seq(seq), _task(task) {}
+            //Reversed so that std heap functions build a min-heap, ties in submission order
+            bool operator<(const Entry& e) const {return _when > e._when || (_when == e._when && _seq > e._seq); }
+            const void* _owner;
+            Clock::time_point _when;
+            uint64_t _seq;
+            Task _task;
+        };
+
+        Rotator() : _seq(0), _running(nullptr)
+        {
+            std::thread(&Rotator::loop, this).detach();
+        }
+
+        void loop()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (1)
+            {
+                if (_tasks.empty())
+                {
+                    _cond.wait(lock);
+                    continue;
+                }
+                Clock::time_point when = _tasks.front()._when;
+                if (Clock::now() < when)
+                {
+                    //Woken early by an earlier task, or by the wall clock being set
+                    _cond.wait_until(lock, when);
+                    continue;
+                }
+                std::pop_heap(_tasks.begin(), _tasks.end());
+                Entry e = _tasks.back();
+                _tasks.pop_back();
+                _running = e._owner;
+                lock.unlock();
+                e._task();
+                lock.lock();
+                _running = nullptr;
+                _idle_cond.notify_all();
+            }
+        }
+    private:
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::condition_variable _idle_cond;//cancel() waiting for a running task
+        std::vector<Entry> _tasks;//Min-heap on _when
+        uint64_t _seq;
+        const void* _running;//Owner of the task being run
+    };
+}
+
+#endif
@@ -0,0 +1,558 @@
+/*Binary log segments with an index, and their reader
+    1、BinaryFormatter: every LogMsg field as a fixed header followed by the strings, nothing is rendered
+    2、SegmentSink: writes those records into segments of a maximum size, rolled like RollBySizeSink.
+       A closed segment ends with a footer: a dictionary of the logger names, and a sparse index with one
+       entry per INDEX_INTERVAL bytes of records (time range, level bitmap, logger name bitmap, offset)
+    3、SegmentReader: maps a segment and visits the records matching a query, skipping every index
+       entry that can't hold one. A segment without a footer (still open, or the process died) is scanned
+    The logcat tool (logcat/) answers queries on the command line.
+    The formatter belongs to the logger, so a logger writing segments has no text sinks:
+        builder->buildFormatter(std::make_shared<Logs::BinaryFormatter>());
+        builder->buildSink<Logs::SegmentSink>("./logs/seg-", 256 * 1024 * 1024);
+    Numbers are stored in the byte order of the machine, segments are read where they were written.
+*/
+
+#ifndef __M_SEGMENT_H__
+#define __M_SEGMENT_H__
+
+#include "format.hpp"
+#include "sink.hpp"
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <limits>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace Logs
+{
+    //Fixed part of a record, the name, file, thread name and payload follow in that order
+    struct BinaryRecord
+    {
+        uint32_t _len;//Whole record
+        uint32_t _line;
+        int64_t _ctime;
+        uint32_t _nsec;
+        int32_t _tid;
+        uint32_t _payload_len;
+        uint16_t _name_len;
+        uint16_t _file_len;
+        uint16_t _tname_len;
+        uint8_t _level;
+        uint8_t _reserved[5];
+
+        enum {MAX_LEN = 64 * 1024 * 1024};//Anything larger isn't a record
+
+        int64_t time() const {return _ctime * 1000000000LL + _nsec; }
+        //Records aren't aligned, the header is copied out before use
+        static uint32_t length(const char* data)
+        {
+            uint32_t len;
+            memcpy(&len, data, sizeof(len));
+            return len;
+        }
+        bool valid(size_t avail) const
+        {
+            return _len >= sizeof(BinaryRecord) && _len <= MAX_LEN && _len <= avail
+                && sizeof(BinaryRecord) + (size_t)_name_len + _file_len + _tname_len + _payload_len == _len;
+        }
+    };
+    static_assert(sizeof(BinaryRecord) == 40, "BinaryRecord is a file format");
+
+    class BinaryFormatter : public Formatter
+    {
+    public:
+        using ptr = std::shared_ptr<BinaryFormatter>;
+
+        BinaryFormatter() : Formatter("binary", Unparsed()) {}
+
+        using Formatter::format;
+
+        //Names longer than 64KB are cut, the payload is kept whole
+        void format(FmtBuffer& out, const LogMsg& msg) override
+        {
+            BinaryRecord rec;
+            memset(&rec, 0, sizeof(rec));
+            rec._line = (uint32_t)msg._line;
+            rec._ctime = msg._ctime;
+            rec._nsec = (uint32_t)msg._nsec;
+            rec._tid = msg._tid;
+            rec._payload_len = (uint32_t)msg._payload.size();
+            rec._name_len = cut(msg._name.size());
+            rec._file_len = cut(msg._file.size());
+            rec._tname_len = cut(msg._tname.size());
+            rec._level = (uint8_t)msg._level;
+            rec._len = sizeof(rec) + rec._name_len + rec._file_len + rec._tname_len + rec._payload_len;
+            out.append((const char*)&rec, sizeof(rec));
+            out.append(msg._name.data(), rec._name_len);
+            out.append(msg._file.data(), rec._file_len);
+            out.append(msg._tname.data(), rec._tname_len);
+            out.append(msg._payload.data(), rec._payload_len);
+        }
+    private:
+        static uint16_t cut(size_t len) {return len < 0xFFFF ? (uint16_t)len : 0xFFFF; }
+    };
+
+    struct SegmentHeader
+    {
+        char _magic[8];//"LOGSEG1"
+        uint32_t _record_size;//sizeof(BinaryRecord)
+        uint32_t _reserved;
+    };
+
+    //One per INDEX_INTERVAL bytes of records
+    struct SegmentIndexEntry
+    {
+        uint64_t _offset;//First record
+        uint64_t _bytes;//Records covered, from _offset
+        int64_t _min_time;//Nanoseconds since the epoch. Async loggers don't keep threads in time order, so both ends
+        int64_t _max_time;
+        uint64_t _names;//Bit i: dictionary name i, bit 63: name 63 and every one after it
+        uint32_t _records;
+        uint16_t _levels;//Bit LogLevel::value
+        uint16_t _reserved;
+    };
+
+    //Last bytes of a closed segment
+    struct SegmentTrailer
+    {
+        uint64_t _data_end;//Records end here, the dictionary starts here
+        uint64_t _index_offset;
+        uint32_t _name_count;
+        uint32_t _index_count;
+        uint64_t _records;
+        int64_t _min_time;
+        int64_t _max_time;
+        uint16_t _levels;
+        uint16_t _reserved[3];
+        char _magic[8];//"LOGSEGIX"
+    };
+
+    //Direction: indexed binary segments, <basename><YYYYmmddHHMMSS>--<6 digit count>.logseg
+    class SegmentSink : public LogSink
+    {
+    public:
+        using ptr = std::shared_ptr<SegmentSink>;
+
+        enum
+        {
+            INDEX_INTERVAL = 64 * 1024,//Bytes of records per index entry: a query reads at most this much for nothing
+            NAME_BITS = 64
+        };
+
+        SegmentSink(const std::string& basename, size_t max_size, const FileConfig& config = FileConfig())
+            : _name_count(0), _basename(basename), _file(config), _max_fsize(max_size), _preparing(false), _warned(false)
+        {
+            std::string pathname = createFilename();
+            R_Create(pathname, _file);
+            startSegment();
+        }
+
+        ~SegmentSink()
+        {
+            Rotator::instance().cancel(this);
+            finishSegment();
+        }
+
+        void log(const char* data, size_t len)
+        {
+            //Only between records: a segment holds whole records
+            if (_carry.empty() && _offset >= _max_fsize) roll();
+            if (_file.write(data, len) == false) std::cout << "Segment log file write failed! \n";
+            _offset += len;
+            index(data, len);
+            if (_preparing == false && _offset >= _max_fsize - _max_fsize / 10)
+            {
+                _preparing = true;
+                Rotator::instance().post(this, [this]{ _prepared.prepare(0, createFilename()); });
+            }
+        }
+
+        void flush()
+        {
+            if (_file.flush() == false) std::cout << "Segment log file write failed! \n";
+        }
+
+        //The segment gets no footer, the reader scans it
+        void crashWrite(const char* data, size_t len) {_file.crashWrite(data, len); }
+    private:
+        void startSegment()
+        {
+            SegmentHeader hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            memcpy(hdr._magic, "LOGSEG1", 8);
+            hdr._record_size = sizeof(BinaryRecord);
+            _file.write((const char*)&hdr, sizeof(hdr));
+            _offset = sizeof(hdr);
+            _next = sizeof(hdr);
+            _names.clear();
+            _dict.clear();
+            _entries.clear();
+            memset(&_block, 0, sizeof(_block));
+            memset(&_trailer, 0, sizeof(_trailer));
+            _trailer._min_time = std::numeric_limits<int64_t>::max();
+            _trailer._max_time = std::numeric_limits<int64_t>::min();
+            _indexed = true;
+            _carry.clear();
+            _last_bit = NAME_BITS;//No name looked up yet
+        }
+
+        //Dictionary, index and trailer after the records. Nothing if the records couldn't be followed
+        void finishSegment()
+        {
+            if (_indexed == false)
+            {
+                _file.flush();
+                return ;
+            }
+            if (_block._records > 0) _entries.push_back(_block);
+            _trailer._data_end = _offset;
+            _trailer._name_count = (uint32_t)_dict.size();
+            _trailer._index_count = (uint32_t)_entries.size();
+            FmtBuffer out;
+            for (const std::string& name : _dict)
+            {
+                uint16_t len = (uint16_t)name.size();
+                out.append((const char*)&len, sizeof(len));
+                out.append(name.data(), len);
+            }
+            while ((_offset + out.size()) % 8 != 0) out.append('\0');
+            _trailer._index_offset = _offset + out.size();
+            if (_entries.empty() == false) out.append((const char*)_entries.data(), _entries.size() * sizeof(SegmentIndexEntry));
+            memcpy(_trailer._magic, "LOGSEGIX", 8);
+            out.append((const char*)&_trailer, sizeof(_trailer));
+            if (_file.write(out.data(), out.size()) == false || _file.flush() == false)
+                std::cout << "Segment log file write failed! \n";
+        }
+
+        //Footer on the full segment, then the next one, opened in the background if it was ready in time
+        void roll()
+        {
+            std::string pathname;
+            int fd = _prepared.take(0, pathname);
+            if (fd < 0)
+            {
+                pathname = createFilename();
+                LogUtil::File::createDirectory(LogUtil::File::path(pathname));
+                fd = FileWriter::openFile(pathname);
+            }
+            _preparing = false;
+            if (fd < 0)
+            {
+                //The full segment goes on, the next call tries again
+                std::cout << "Segment log file open failed! \n";
+                return ;
+            }
+            finishSegment();
+            PreparedFiles::closeLater(_file.adopt(fd));
+            startSegment();
+        }
+
+        //Follow the records through the bytes written, a record may be split between two calls
+        void index(const char* data, size_t len)
+        {
+            while (len > 0 && _indexed)
+            {
+                if (_carry.empty() && len >= sizeof(BinaryRecord))
+                {
+                    uint32_t rlen = BinaryRecord::length(data);
+                    if (rlen < sizeof(BinaryRecord) || rlen > BinaryRecord::MAX_LEN) return notBinary();
+                    if (rlen <= len)
+                    {
+                        add(data, rlen);
+                        data += rlen;
+                        len -= rlen;
+                        continue;
+                    }
+                }
+                //Gather the split record: its header first, which tells how much more is needed
+                size_t part = _carry.size() < sizeof(BinaryRecord) ? sizeof(BinaryRecord) - _carry.size() : 0;
+                part = part < len ? part : len;
+                _carry.append(data, part);
+                data += part;
+                len -= part;
+                if (_carry.size() < sizeof(BinaryRecord)) return ;
+                uint32_t rlen = BinaryRecord::length(_carry.data());
+                if (rlen < sizeof(BinaryRecord) || rlen > BinaryRecord::MAX_LEN) return notBinary();
+                part = rlen - _carry.size() < len ? rlen - _carry.size() : len;
+                _carry.append(data, part);
+                data += part;
+                len -= part;
+                if (_carry.size() < rlen) return ;
+                std::string whole;
+                whole.swap(_carry);
+                add(whole.data(), whole.size());
+            }
+        }
+
+        //One whole record at _next
+        void add(const char* data, size_t len)
+        {
+            BinaryRecord rec;
+            memcpy(&rec, data, sizeof(rec));
+            if (rec.valid(len) == false) return notBinary();
+            int64_t t = rec.time();
+            if (_block._records == 0)
+            {
+                _block._offset = _next;
+                _block._min_time = t;
+                _block._max_time = t;
+            }
+            if (t < _block._min_time) _block._min_time = t;
+            if (t > _block._max_time) _block._max_time = t;
+            _block._levels |= (uint16_t)(1u << (rec._level & 15));
+            _block._names |= 1ULL << nameId(data + sizeof(rec), rec._name_len);
+            _block._records += 1;
+            _block._bytes += len;
+            _next += len;
+            _trailer._records += 1;
+            _trailer._levels |= (uint16_t)(1u << (rec._level & 15));
+            if (t < _trailer._min_time) _trailer._min_time = t;
+            if (t > _trailer._max_time) _trailer._max_time = t;
+            if (_block._bytes >= INDEX_INTERVAL)
+            {
+                _entries.push_back(_block);
+                memset(&_block, 0, sizeof(_block));
+            }
+        }
+
+        //Bit of the name in the index, the dictionary keeps every name
+        size_t nameId(const char* name, size_t len)
+        {
+            if (_last_bit < NAME_BITS && len == _last_name.size() && memcmp(name, _last_name.data(), len) == 0) return _last_bit;
+            _last_name.assign(name, len);
+            auto it = _names.find(_last_name);
+            size_t id;
+            if (it == _names.end())
+            {
+                id = _dict.size();
+                _names.insert(std::make_pair(_last_name, id));
+                _dict.push_back(_last_name);
+            }
+            else id = it->second;
+            _last_bit = id < NAME_BITS - 1 ? id : NAME_BITS - 1;
+            return _last_bit;
+        }
+
+        //Not written by BinaryFormatter: the bytes are still written, the segment is left without a footer
+        void notBinary()
+        {
+            if (_warned == false) std::cout << "Segment sink got records not made by BinaryFormatter! \n";
+            _warned = true;
+            _indexed = false;
+            _carry.clear();
+        }
+
+        //Called by the logging thread and the Rotator. Names already taken are skipped
+        std::string createFilename()
+        {
+            while (1)
+            {
+                time_t t = time(NULL);
+                struct tm lt;
+                localtime_r(&t, &lt);
+                char stamp[32];
+                strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &lt);
+                char count[32];
+                snprintf(count, sizeof(count), "--%06zu", _name_count.fetch_add(1));
+                std::string name = _basename + stamp + count + ".logseg";
+                if (LogUtil::File::exists(name) == false) return name;
+            }
+        }
+    private:
+        std::atomic<size_t> _name_count;
+        std::string _basename;
+        FileWriter _file;
+        size_t _max_fsize;
+        bool _preparing;//The next segment was asked for
+        PreparedFiles _prepared;
+        bool _warned;
+        //Current segment
+        uint64_t _offset;//Bytes written
+        uint64_t _next;//Offset of the next record to index
+        bool _indexed;//Records could be followed so far
+        std::string _carry;//Start of a record whose end hasn't come yet
+        std::unordered_map<std::string, size_t> _names;
+        std::vector<std::string> _dict;
+        std::string _last_name;
+        size_t _last_bit;//Bit of _last_name, NAME_BITS: none
+        std::vector<SegmentIndexEntry> _entries;
+        SegmentIndexEntry _block;//Being filled
+        SegmentTrailer _trailer;
+    };
+
+    struct SegmentQuery
+    {
+        SegmentQuery()
+            : _from(std::numeric_limits<int64_t>::min()), _to(std::numeric_limits<int64_t>::max()), _levels(0xFFFF) {}
+
+        int64_t _from;//Nanoseconds since the epoch, both ends included
+        int64_t _to;
+        uint16_t _levels;//Bit LogLevel::value, e.g. Error and above: 0xFFFF << (int)LogLevel::value::Error
+        std::string _name;//Logger name, empty: every logger
+    };
+
+    class SegmentReader
+    {
+    public:
+        //Records seen: the handler gets a LogMsg borrowing the mapping, the payload isn't terminated
+        using Handler = std::function<void(const LogMsg&)>;
+
+        SegmentReader() : _map(nullptr), _size(0), _trailer(nullptr), _blocks(0), _skipped(0) {}
+        ~SegmentReader() {close(); }
+
+        SegmentReader(const SegmentReader&) = delete;
+        SegmentReader& operator=(const SegmentReader&) = delete;
+
+        //False if the file can't be mapped or isn't a segment
+        bool open(const std::string& pathname)
+        {
+            close();
+            int fd = ::open(pathname.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SegmentHeader))
+            {
+                ::close(fd);
+                return false;
+            }
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED) return false;
+            _map = (const char*)p;
+            _size = st.st_size;
+            const SegmentHeader* hdr = (const SegmentHeader*)_map;
+            if (memcmp(hdr->_magic, "LOGSEG1", 8) != 0 || hdr->_record_size != sizeof(BinaryRecord))
+            {
+                close();
+                return false;
+            }
+            //Only the index entries that match are read, the kernel shouldn't read around them
+            madvise((void*)_map, _size, MADV_RANDOM);
+            _trailer = findTrailer();
+            return true;
+        }
+
+        void close()
+        {
+            if (_map != nullptr) munmap((void*)_map, _size);
+            _map = nullptr;
+            _size = 0;
+            _trailer = nullptr;
+        }
+
+        //Closed segment: the query uses the index
+        bool indexed() {return _trailer != nullptr; }
+
+        //Index entries read and skipped by the queries so far
+        size_t blocksRead() {return _blocks; }
+        size_t blocksSkipped() {return _skipped; }
+
+        //Number of records handed to fn, in file order
+        size_t query(const SegmentQuery& q, const Handler& fn)
+        {
+            if (_map == nullptr) return 0;
+            if (_trailer == nullptr) return scan(q, fn, sizeof(SegmentHeader), _size);
+            if (_trailer->_records == 0 || (_trailer->_levels & q._levels) == 0) return 0;
+            if (_trailer->_max_time < q._from || _trailer->_min_time > q._to) return 0;
+            uint64_t names = ~0ULL;
+            if (q._name.empty() == false)
+            {
+                int id = findName(q._name);
+                if (id < 0) return 0;//The logger wrote nothing into this segment
+                names = 1ULL << (id < SegmentSink::NAME_BITS - 1 ? id : SegmentSink::NAME_BITS - 1);
+            }
+            const SegmentIndexEntry* entries = (const SegmentIndexEntry*)(_map + _trailer->_index_offset);
+            size_t count = 0;
+            for (uint32_t i = 0; i < _trailer->_index_count; ++i)
+            {
+                const SegmentIndexEntry& e = entries[i];
+                //A damaged footer must not send the scan outside the records
+                if (e._offset < sizeof(SegmentHeader) || e._offset > _trailer->_data_end || e._bytes > _trailer->_data_end - e._offset)
+                {
+                    ++_skipped;
+                    continue;
+                }
+                if (e._max_time < q._from || e._min_time > q._to || (e._levels & q._levels) == 0 || (e._names & names) == 0)
+                {
+                    ++_skipped;
+                    continue;
+                }
+                ++_blocks;
+                madvise((void*)(_map + (e._offset & ~(uint64_t)4095)), e._bytes + (e._offset & 4095), MADV_WILLNEED);
+                count += scan(q, fn, e._offset, e._offset + e._bytes);
+            }
+            return count;
+        }
+    private:
+        const SegmentTrailer* findTrailer()
+        {
+            if (_size < sizeof(SegmentHeader) + sizeof(SegmentTrailer)) return nullptr;
+            const SegmentTrailer* t = (const SegmentTrailer*)(_map + _size - sizeof(SegmentTrailer));
+            if (memcmp(t->_magic, "LOGSEGIX", 8) != 0) return nullptr;
+            if (t->_data_end < sizeof(SegmentHeader) || t->_data_end > t->_index_offset || t->_index_offset % 8 != 0) return nullptr;
+            if (t->_index_offset + (uint64_t)t->_index_count * sizeof(SegmentIndexEntry) != _size - sizeof(SegmentTrailer)) return nullptr;
+            return t;
+        }
+
+        int findName(const std::string& name)
+        {
+            const char* p = _map + _trailer->_data_end;
+            const char* end = _map + _trailer->_index_offset;
+            for (uint32_t i = 0; i < _trailer->_name_count && p + 2 <= end; ++i)
+            {
+                uint16_t len;
+                memcpy(&len, p, sizeof(len));
+                p += sizeof(len);
+                if (p + len > end) break;
+                if (len == name.size() && memcmp(p, name.data(), len) == 0) return (int)i;
+                p += len;
+            }
+            return -1;
+        }
+
+        //Records from begin to end, an unclosed segment may end in the middle of one
+        size_t scan(const SegmentQuery& q, const Handler& fn, uint64_t begin, uint64_t end)
+        {
+            size_t count = 0;
+            uint64_t pos = begin;
+            if (end > _size) end = _size;
+            while (pos + sizeof(BinaryRecord) <= end)
+            {
+                BinaryRecord rec;
+                memcpy(&rec, _map + pos, sizeof(rec));
+                if (rec.valid(end - pos) == false) break;
+                const char* name = _map + pos + sizeof(rec);
+                const char* file = name + rec._name_len;
+                const char* tname = file + rec._file_len;
+                const char* payload = tname + rec._tname_len;
+                pos += rec._len;
+                int64_t t = rec.time();
+                if (t < q._from || t > q._to || ((1u << (rec._level & 15)) & q._levels) == 0) continue;
+                if (q._name.empty() == false && (q._name.size() != rec._name_len || memcmp(name, q._name.data(), rec._name_len) != 0))
+                    continue;
+                LogMsg msg((LogLevel::value)rec._level, rec._line,
+                           LogUtil::StrView(file, rec._file_len),
+                           LogUtil::StrView(name, rec._name_len),
+                           LogUtil::StrView(payload, rec._payload_len),
+                           rec._ctime, rec._nsec, rec._tid);
+                msg._tname = LogUtil::StrView(tname, rec._tname_len);
+                fn(msg);
+                ++count;
+            }
+            return count;
+        }
+    private:
+        const char* _map;
+        size_t _size;
+        const SegmentTrailer* _trailer;//Null for an unclosed segment
+        size_t _blocks;
+        size_t _skipped;
+    };
+}
+
+#endif
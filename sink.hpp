@@ -5,27 +5,59 @@
     1、Abstract base class for log sink
     2、Derived classes (derived according to different landing directions)
     3、Use factory pattern to separate creation and presentation
+    Sinks with a queue of their own are in asyncsink.hpp, the memory mapped file sink in mmapsink.hpp,
+    the io_uring file sink in iouringsink.hpp, compression and retention of rolled files in archive.hpp,
+    indexed binary segments in segment.hpp, the network sink in netsink.hpp
 */
 
 #include "util.hpp"
-#include <fstream>
-#include <sstream>
+#include "filewriter.hpp"
+#include "rotator.hpp"
+#include "archive.hpp"
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <sys/stat.h>
 #include <memory>
+#include <cstring>
 #include <cassert>
+#include <unistd.h>
 
-static void R_Create(const std::string& pathname, std::ofstream& ofs)
+static void R_Create(const std::string& pathname, Logs::FileWriter& file)
 {
     // 1、Create the log files directory
     Logs::LogUtil::File::createDirectory(Logs::LogUtil::File::path(pathname));
-    // 2、Create and open log file
-    //The second parameter indicates the opening mode, binary mode, the default is writing
-    //Now we need to append, so there is content after |
-    ofs.open(pathname, std::ios::binary | std::ios::app); 
-    assert(ofs.is_open());//Ensure successful opening
+    // 2、Create and open log file, in append mode
+    bool opened = file.open(pathname);
+    assert(opened);//Ensure successful opening
+    (void)opened;
 }
  
 namespace Logs
 {
+    //Formatted bytes handed to several queued sinks, copied once and freed with the last reference
+    class SinkBatch
+    {
+    public:
+        using ptr = std::shared_ptr<const SinkBatch>;
+
+        static ptr copy(const char* data, size_t len)
+        {
+            std::shared_ptr<SinkBatch> b = std::make_shared<SinkBatch>(len);
+            memcpy(b->_data.get(), data, len);
+            return b;
+        }
+
+        explicit SinkBatch(size_t len) : _data(new char[len]), _len(len) {}
+
+        const char* data() const {return _data.get(); }
+        size_t size() const {return _len; }
+    private:
+        std::unique_ptr<char[]> _data;
+        size_t _len;
+    };
+
     class LogSink
     {
     public:
@@ -34,6 +66,41 @@ namespace Logs
         LogSink() {}
         virtual ~LogSink() {}
         virtual void log(const char* data, size_t len) = 0;
+        //Push buffered data to the destination, called by Logger::flush
+        virtual void flush() {}
+        //Sinks that keep the data for later say so, the logger then hands them a shared copy instead
+        virtual bool queued() {return false; }
+        virtual void logShared(const SinkBatch::ptr& batch) {log(batch->data(), batch->size()); }
+        //Called from a signal handler by CrashHandler (crash.hpp): write(2) only, no lock, no allocation
+        virtual void crashWrite(const char*, size_t) {}
+    private:
+        friend class SerialSink;
+        std::mutex _serial;//Taken by every SerialSink wrapping this sink
+    };
+
+    //Sinks other than AsyncSinkAdapter keep no lock: when one is shared by several loggers, each of them
+    //reaches it through its own SerialSink, and all of those take the wrapped sink's mutex
+    class SerialSink : public LogSink
+    {
+    public:
+        explicit SerialSink(const LogSink::ptr& sink) : _sink(sink) {}
+
+        void log(const char* data, size_t len) override
+        {
+            std::unique_lock<std::mutex> lock(_sink->_serial);
+            _sink->log(data, len);
+        }
+
+        void flush() override
+        {
+            std::unique_lock<std::mutex> lock(_sink->_serial);
+            _sink->flush();
+        }
+
+        //A signal handler can't wait for the lock, the crash path is best effort anyway
+        void crashWrite(const char* data, size_t len) override {_sink->crashWrite(data, len); }
+    private:
+        LogSink::ptr _sink;
     };
 
 
@@ -50,6 +117,10 @@ namespace Logs
             //Use the overloaded function write in the library to write to the standard output file
             std::cout.write(data, len);//Write contents of length len from data
         }
+
+        void flush() {std::cout.flush(); }
+
+        void crashWrite(const char* data, size_t len) {LogUtil::File::writeAll(STDOUT_FILENO, data, len); }
     };
 
 
@@ -60,9 +131,9 @@ namespace Logs
         using ptr = std::shared_ptr<FileSink>;
 
         //Open the file during construction and manage the operation handle
-        FileSink(const std::string& filename):_filename(filename)
+        FileSink(const std::string& filename, const FileConfig& config = FileConfig()) : _filename(filename), _file(config)
         {
-            R_Create(_filename, _ofs);
+            R_Create(_filename, _file);
         }
 
         const std::string& file() {return _filename; }
@@ -70,83 +141,196 @@ namespace Logs
         //Write log messages to file
         void log(const char* data, size_t len)
         {
-            _ofs.write(data, len);
-            //Check whether the current handle is normal
-            //That is, whether there is any abnormality after writing above, and exit directly if so
-            if (_ofs.good() == false) std::cout << "Log output file failed! \n";
+            //Check whether the write succeeded, the bytes are lost otherwise
+            if (_file.write(data, len) == false) std::cout << "Log output file failed! \n";
         }
+
+        void flush()
+        {
+            if (_file.flush() == false) std::cout << "Log output file failed! \n";
+        }
+
+        void crashWrite(const char* data, size_t len) {_file.crashWrite(data, len); }
     private:
         std::string _filename;
-        std::ofstream _ofs;//Write to log via handle
+        FileWriter _file;//Write to log via handle
     };
 
 
+    //Files a rolling sink switches to later, opened ahead of time on the Rotator thread
+    //The logging path only takes a descriptor, closing and removing files is posted back to the Rotator
+    class PreparedFiles
+    {
+    public:
+        PreparedFiles() = default;
+        ~PreparedFiles()
+        {
+            for (auto& f : _files) discard(f);
+        }
+
+        PreparedFiles(const PreparedFiles&) = delete;
+        PreparedFiles& operator=(const PreparedFiles&) = delete;
+
+        //Rotator side: key tells the files apart, e.g. the start of the period a file is for
+        void prepare(time_t key, const std::string& pathname)
+        {
+            LogUtil::File::createDirectory(LogUtil::File::path(pathname));
+            int fd = FileWriter::openFile(pathname);
+            if (fd < 0)
+            {
+                std::cout << "Rolling log file open failed: " << pathname << "\n";
+                return ;
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            _files.push_back(File(key, fd, pathname));
+        }
+
+        //Logging side: the descriptor prepared for key and its path, -1 if there is none
+        //Files for earlier keys were never used, they go away
+        int take(time_t key, std::string& path)
+        {
+            int fd = -1;
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (size_t i = 0; i < _files.size();)
+            {
+                if (_files[i]._key == key && fd < 0)
+                {
+                    fd = _files[i]._fd;
+                    path = _files[i]._path;
+                }
+                else if (_files[i]._key < key)
+                {
+                    File f = _files[i];
+                    Rotator::instance().post(nullptr, [f]{ discard(f); });
+                }
+                else
+                {
+                    ++i;
+                    continue;
+                }
+                _files.erase(_files.begin() + i);
+            }
+            return fd;
+        }
+
+        //What a rolling sink does with the descriptor it replaced
+        static void closeLater(int fd)
+        {
+            if (fd >= 0) Rotator::instance().post(nullptr, [fd]{ ::close(fd); });
+        }
+    private:
+        struct File
+        {
+            File(time_t key, int fd, const std::string& path) : _key(key), _fd(fd), _path(path) {}
+            time_t _key;
+            int _fd;
+            std::string _path;
+        };
+
+        //Created for a period nobody logged in: an empty file is removed
+        static void discard(const File& f)
+        {
+            struct stat st;
+            if (fstat(f._fd, &st) == 0 && st.st_size == 0) unlink(f._path.c_str());
+            ::close(f._fd);
+        }
+    private:
+        std::mutex _mutex;
+        std::vector<File> _files;
+    };
+
     //Direction: rolling file
+    //Names sort in creation order: <basename><YYYYmmddHHMMSS>--<6 digit count>.logsize
     class RollBySizeSink : public LogSink
     {
     public:
         using ptr = std::shared_ptr<RollBySizeSink>;
 
         //Open the file when it's constructed and manages the operation handle
-        RollBySizeSink(const std::string& basename, size_t max_size)
-            : _basename(basename), _max_fsize(max_size), _cur_fsize(0), _name_count(0)
+        RollBySizeSink(const std::string& basename, size_t max_size, const FileConfig& config = FileConfig(),
+            const ArchiveConfig& archive = ArchiveConfig())
+            : _name_count(0), _basename(basename), _file(config), _max_fsize(max_size), _cur_fsize(0), _preparing(false)
         {
-            //LogUtil::File::createDirectory(LogUtil::File::path(basename));
             std::string pathname = createFilename();
-            R_Create(pathname, _ofs);
+            R_Create(pathname, _file);
+            if (archive.enabled())
+            {
+                _archiver.reset(new Archiver(basename, ".logsize", archive));
+                _archiver->current(pathname);
+            }
         }
 
+        //Pending preparations would use this sink
+        ~RollBySizeSink() {Rotator::instance().cancel(this); }
+
         void log(const char* data, size_t len)
         {
             InitLogFile();
-            _ofs.write(data, len);
-            if (_ofs.good() == false) std::cout << "Space-differentiated log file write failed! \n";
+            if (_file.write(data, len) == false) std::cout << "Space-differentiated log file write failed! \n";
             _cur_fsize += len;
         }
+
+        void flush()
+        {
+            if (_file.flush() == false) std::cout << "Space-differentiated log file write failed! \n";
+        }
+
+        void crashWrite(const char* data, size_t len) {_file.crashWrite(data, len); }
+
+        ArchiveStats archiveStats() {return _archiver ? _archiver->stats() : ArchiveStats(); }
     private:
         //There is no stipulation on the maximum file size, so the file size will vary
-        //Check before each write
-        //If it is larger than the specified maximum size after the last write, close the file, reopen one, and let _ofs point to the new file
+        //Check before each write: at 90% the next file is opened in the background, at 100% it replaces the current one
         void InitLogFile()
         {
-            if (_ofs.is_open() == false || _cur_fsize >= _max_fsize)
+            if (_preparing == false && _cur_fsize >= _max_fsize - _max_fsize / 10)
             {
-                _ofs.close();//Close the current file first, then open the new file
-                std::string pathname = createFilename();
-                _ofs.open(pathname, std::ios::binary | std::ios::app);
-                assert(_ofs.is_open());
-                _cur_fsize = 0;
-                return ;
+                _preparing = true;
+                Rotator::instance().post(this, [this]{ _prepared.prepare(0, createFilename()); });
+            }
+            if (_cur_fsize < _max_fsize) return ;
+            std::string pathname;
+            int fd = _prepared.take(0, pathname);
+            if (fd < 0)
+            {
+                //Not ready yet, a tiny max size or a slow disk: open it here
+                pathname = createFilename();
+                LogUtil::File::createDirectory(LogUtil::File::path(pathname));
+                fd = FileWriter::openFile(pathname);
+            }
+            if (fd >= 0)
+            {
+                PreparedFiles::closeLater(_file.adopt(fd));
+                if (_archiver) _archiver->current(pathname);
             }
-            return ;
+            else std::cout << "Space-differentiated log file open failed! \n";
+            _cur_fsize = 0;
+            _preparing = false;
         }
 
+        //Called by the logging thread and the Rotator
         std::string createFilename()
         {
             //Get the system time and use the time to construct the file name extension
             time_t t = time(NULL);
             struct tm lt;
             localtime_r(&t, &lt);//Convert timestamp to time structure
-            std::stringstream ss;
-            ss << _basename;
-            ss << lt.tm_year + 1900;
-            ss << lt.tm_mon + 1;
-            ss << lt.tm_mday;
-            ss << lt.tm_hour;
-            ss << lt.tm_min;
-            ss << lt.tm_sec;
-            ss << "--";
-            ss << _name_count++;
-            ss << ".logsize";
-            return ss.str();
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &lt);
+            char count[32];
+            snprintf(count, sizeof(count), "--%06zu", _name_count.fetch_add(1));
+            return _basename + stamp + count + ".logsize";
         }
     private:
-        size_t _name_count;//When writing content is small, prevent a large number of files from being generated in an instant
+        std::atomic<size_t> _name_count;//When writing content is small, prevent a large number of files from being generated in an instant
         //Base file name + extended file name (generated in time) form the actual file name of the current output
-        std::string _basename;//Example: .//log/base-20240120.log
-        std::ofstream _ofs;
+        std::string _basename;//Example: ./log/base-
+        FileWriter _file;
         size_t _max_fsize;//maximum file size
         size_t _cur_fsize;//The size of the data written to the current file
+        bool _preparing;//The next file was asked for
+        PreparedFiles _prepared;
+        std::unique_ptr<Archiver> _archiver;//Closed files, if archiving was asked for
     };
 
     enum class TimeGap
@@ -157,11 +341,16 @@ namespace Logs
         GAP_DAY,
     };
 
+    //Periods start on local wall-clock boundaries (second, minute, hour, midnight), named after their start:
+    //<basename><YYYYmmddHHMMSS>.logtime. A restart within a period appends to its file
+    //The Rotator opens the next file shortly before the boundary and flags the boundary when it passes,
+    //the logging path reads no clock
     class RollByTimeSink : public LogSink
     {
     public:
-        RollByTimeSink(const std::string& basename, TimeGap gap_type)
-            : _basename(basename), _name_count(0)
+        RollByTimeSink(const std::string& basename, TimeGap gap_type, const FileConfig& config = FileConfig(),
+            const ArchiveConfig& archive = ArchiveConfig())
+            : _basename(basename), _file(config)
         {
             switch (gap_type)
             {
@@ -178,59 +367,83 @@ namespace Logs
                 _gap_size = 3600 * 24;
                 break;
             }
-            std::string filename = createFilename();
-            R_Create(filename, _ofs);
-            _cur_gap = Logs::LogUtil::Date::now();
+            _cur_start = Rotator::periodStart(Logs::LogUtil::Date::now(), _gap_size);
+            _due.store(_cur_start, std::memory_order_relaxed);
+            std::string filename = createFilename(_cur_start);
+            R_Create(filename, _file);
+            if (archive.enabled())
+            {
+                _archiver.reset(new Archiver(basename, ".logtime", archive));
+                _archiver->current(filename);
+            }
+            schedule(Rotator::nextBoundary(_cur_start, _gap_size));
         }
 
+        ~RollByTimeSink() {Rotator::instance().cancel(this); }
+
         void log(const char *data, size_t len)
         {
             InitLogFile();
-            _ofs.write(data, len);
-            if (_ofs.good() == false)
+            if (_file.write(data, len) == false)
                 std::cout << "Time-differentiated log file writing failed! \n";
         }
 
+        void flush()
+        {
+            if (_file.flush() == false)
+                std::cout << "Time-differentiated log file writing failed! \n";
+        }
+
+        void crashWrite(const char* data, size_t len) {_file.crashWrite(data, len); }
+
+        ArchiveStats archiveStats() {return _archiver ? _archiver->stats() : ArchiveStats(); }
+
     private:
+        //One atomic load unless a boundary passed
         void InitLogFile()
         {
-            time_t cur = Logs::LogUtil::Date::now();
-            if (cur >= _cur_gap + _gap_size)
+            time_t due = _due.load(std::memory_order_acquire);
+            if (due == _cur_start) return ;
+            std::string pathname;
+            int fd = _prepared.take(due, pathname);
+            //Couldn't be opened: stay in the current file until the next period
+            if (fd >= 0)
             {
-                _ofs.close();
-                std::string filename = createFilename();
-                _ofs.open(filename, std::ios::binary | std::ios::app);
-                assert(_ofs.is_open());
-                _cur_gap = cur;
+                PreparedFiles::closeLater(_file.adopt(fd));
+                if (_archiver) _archiver->current(pathname);
             }
+            _cur_start = due;
         }
 
-        std::string createFilename()
+        //Rotator side: open the file of the period starting at boundary a little ahead, switch once it passes
+        void schedule(time_t boundary)
+        {
+            Rotator::Clock::time_point at = Rotator::Clock::from_time_t(boundary);
+            std::chrono::milliseconds lead(_gap_size > 1 ? 1000 : 500);
+            Rotator::instance().at(this, at - lead, [this, boundary]{ _prepared.prepare(boundary, createFilename(boundary)); });
+            Rotator::instance().at(this, at, [this, boundary]{
+                _due.store(boundary, std::memory_order_release);
+                schedule(Rotator::nextBoundary(boundary, _gap_size));
+            });
+        }
+
+        std::string createFilename(time_t start)
         {
-            //Get the system time and use the time to construct the file name extension
-            time_t t = Logs::LogUtil::Date::now();
             struct tm lt;
-            localtime_r(&t, &lt);//Convert timestamp to time structure
-            std::stringstream sst;
-            sst << _basename;
-            sst << lt.tm_year + 1900;
-            sst << lt.tm_mon + 1;
-            sst << lt.tm_mday;
-            sst << lt.tm_hour;
-            sst << lt.tm_min;
-            sst << lt.tm_sec;
-            sst << "--";
-            sst << _name_count++;
-            sst << ".logtime";
-            return sst.str();
+            localtime_r(&start, &lt);//Convert timestamp to time structure
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &lt);
+            return _basename + stamp + ".logtime";
         }
 
     private:
         std::string _basename;
-        std::ofstream _ofs;
-        size_t _cur_gap;
+        FileWriter _file;
         size_t _gap_size;
-        size_t _name_count;
+        time_t _cur_start;//Start of the period _file belongs to, logging side
+        std::atomic<time_t> _due;//Start of the period the Rotator says we are in
+        PreparedFiles _prepared;
+        std::unique_ptr<Archiver> _archiver;
     };
 
     //Even if new directions are added in the future, the factory can produce them
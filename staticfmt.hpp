@@ -0,0 +1,140 @@
+/*Pattern parsed at compile time
+    The pattern has to be a constexpr char array with linkage, declared at namespace scope:
+        constexpr char kPattern[] = "[%d{%H:%M:%S}][%p] %m%n";
+        builder->buildFormatter(std::make_shared<Logs::StaticFormatter<kPattern>>());
+    Every literal run and field becomes its own template instantiation, so format() is unrolled
+    and inlined. Malformed patterns and unknown formatting characters are compile errors.
+    Same rules as Formatter::parsePattern, without custom items.
+*/
+
+#ifndef __M_SFMT_H__
+#define __M_SFMT_H__
+
+#include "format.hpp"
+
+namespace Logs
+{
+    //C++11 constexpr functions are a single return statement, hence the recursion
+    struct PatternScan
+    {
+        static constexpr size_t npos = (size_t)-1;
+
+        static constexpr bool isAlpha(char c) {return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+        static constexpr bool isKey(char c)
+        {
+            return c == 'm' || c == 'p' || c == 'd' || c == 'f' || c == 'l'
+                || c == 't' || c == 'N' || c == 'c' || c == 'T' || c == 'n';
+        }
+
+        //End of the literal run starting at i
+        static constexpr size_t literalEnd(const char* p, size_t i)
+        {
+            return (p[i] == '\0' || p[i] == '%') ? i : literalEnd(p, i + 1);
+        }
+
+        //Several % in a row count as one, returns the last of them
+        static constexpr size_t lastPercent(const char* p, size_t i)
+        {
+            return p[i + 1] == '%' ? lastPercent(p, i + 1) : i;
+        }
+
+        //Position of the } closing a subformat, npos if the pattern ends first
+        static constexpr size_t braceEnd(const char* p, size_t i)
+        {
+            return p[i] == '\0' ? npos : (p[i] == '}' ? i : braceEnd(p, i + 1));
+        }
+    };
+
+    template <const char* P, size_t I, char C = P[I]>
+    struct StaticItems;
+
+    //End of pattern
+    template <const char* P, size_t I>
+    struct StaticItems<P, I, '\0'>
+    {
+        static void write(FmtBuffer&, const LogMsg&) {}
+    };
+
+    //Formatting character, optionally followed by {subformat}
+    template <const char* P, size_t I>
+    struct StaticItems<P, I, '%'>
+    {
+        static constexpr size_t K = PatternScan::lastPercent(P, I);
+        static constexpr char Key = P[K + 1];
+        static_assert(PatternScan::isAlpha(Key), "pattern: % must be followed by a formatting character");
+        static_assert(PatternScan::isKey(Key), "pattern: no corresponding formatting character");
+        static constexpr bool HasSub = Key != '\0' && P[K + 2] == '{';
+        static constexpr size_t Close = HasSub ? PatternScan::braceEnd(P, K + 3) : K + 2;
+        static_assert(Close != PatternScan::npos, "pattern: subformat {} is not closed");
+        static constexpr size_t Next = HasSub ? Close + 1 : K + 2;
+
+        static void write(FmtBuffer& out, const LogMsg& msg)
+        {
+            field(out, msg, std::integral_constant<char, Key>());
+            StaticItems<P, Next>::write(out, msg);
+        }
+    private:
+        typedef std::integral_constant<char, 'm'> Msg;
+        typedef std::integral_constant<char, 'p'> Level;
+        typedef std::integral_constant<char, 'd'> Time;
+        typedef std::integral_constant<char, 'f'> File;
+        typedef std::integral_constant<char, 'l'> Line;
+        typedef std::integral_constant<char, 't'> Thread;
+        typedef std::integral_constant<char, 'N'> ThreadName;
+        typedef std::integral_constant<char, 'c'> Name;
+        typedef std::integral_constant<char, 'T'> Tab;
+        typedef std::integral_constant<char, 'n'> NLine;
+
+        static void field(FmtBuffer& out, const LogMsg& msg, Msg) {out.append(msg._payload.data(), msg._payload.size()); }
+        static void field(FmtBuffer& out, const LogMsg& msg, Level) {out.append(LogLevel::toString(msg._level)); }
+        static void field(FmtBuffer& out, const LogMsg& msg, Time)
+        {
+            //One TimeFormat per %d, built from the subformat the first time it is used
+            static const TimeFormat tf(HasSub ? std::string(P + K + 3, Close - K - 3) : std::string());
+            tf.format(out, msg._ctime, msg._nsec);
+        }
+        static void field(FmtBuffer& out, const LogMsg& msg, File) {out.append(msg._file.data(), msg._file.size()); }
+        static void field(FmtBuffer& out, const LogMsg& msg, Line) {ArgWriter::writeUnsigned(out, msg._line); }
+        static void field(FmtBuffer& out, const LogMsg& msg, Thread) {Formatter::appendThread(out, msg); }
+        static void field(FmtBuffer& out, const LogMsg& msg, ThreadName)
+        {
+            if (msg._tname.empty()) field(out, msg, Thread());
+            else out.append(msg._tname.data(), msg._tname.size());
+        }
+        static void field(FmtBuffer& out, const LogMsg& msg, Name) {out.append(msg._name.data(), msg._name.size()); }
+        static void field(FmtBuffer& out, const LogMsg&, Tab) {out.append('\t'); }
+        static void field(FmtBuffer& out, const LogMsg&, NLine) {out.append('\n'); }
+    };
+
+    //Literal run, copied with a length known at compile time
+    template <const char* P, size_t I, char C>
+    struct StaticItems
+    {
+        static constexpr size_t End = PatternScan::literalEnd(P, I);
+
+        static void write(FmtBuffer& out, const LogMsg& msg)
+        {
+            out.append(P + I, End - I);
+            StaticItems<P, End>::write(out, msg);
+        }
+    };
+
+    template <const char* P>
+    class StaticFormatter : public Formatter
+    {
+    public:
+        using ptr = std::shared_ptr<StaticFormatter>;
+
+        StaticFormatter() : Formatter(P, Unparsed()) {}
+
+        using Formatter::format;
+
+        void format(FmtBuffer& out, const LogMsg& msg) override
+        {
+            StaticItems<P, 0>::write(out, msg);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,216 @@
+/*Structured output:
+    1、JSON: one object per line
+    2、logfmt: key=value pairs separated by spaces
+    Escaping scans the payload 16 bytes at a time, clean runs are copied in bulk
+*/
+
+#ifndef __M_STRUCT_H__
+#define __M_STRUCT_H__
+
+#include "format.hpp"
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Logs
+{
+    class Escaper
+    {
+    public:
+        //Index of the first byte that needs escaping in JSON: '"', '\\' or a control character
+        //With logfmt set, space and '=' also count, they force a value to be quoted
+        static size_t findSpecial(const char* data, size_t len, bool logfmt = false)
+        {
+            size_t i = 0;
+#ifdef __SSE2__
+            const __m128i quote = _mm_set1_epi8('"');
+            const __m128i slash = _mm_set1_epi8('\\');
+            const __m128i ctrl = _mm_set1_epi8(0x1f);
+            const __m128i space = _mm_set1_epi8(' ');
+            const __m128i equal = _mm_set1_epi8('=');
+            for (; i + 16 <= len; i += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+                __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash));
+                //Unsigned v <= 0x1f, bytes >= 0x80 (UTF-8) must not be caught by a signed compare
+                hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+                if (logfmt) hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, equal)));
+                int mask = _mm_movemask_epi8(hit);
+                if (mask != 0) return i + __builtin_ctz(mask);
+            }
+#endif
+            for (; i < len; ++i)
+            {
+                unsigned char c = data[i];
+                if (c == '"' || c == '\\' || c < 0x20 || (logfmt && (c == ' ' || c == '='))) return i;
+            }
+            return len;
+        }
+
+        //Append data as the inside of a JSON string
+        static void json(FmtBuffer& out, const char* data, size_t len)
+        {
+            while (len > 0)
+            {
+                size_t n = findSpecial(data, len);
+                out.append(data, n);
+                if (n == len) return ;
+                escape(out, (unsigned char)data[n]);
+                data += n + 1;
+                len -= n + 1;
+            }
+        }
+
+        //Append a logfmt value, quoted only when it has to be
+        static void logfmt(FmtBuffer& out, const char* data, size_t len)
+        {
+            if (len > 0 && findSpecial(data, len, true) == len)
+            {
+                out.append(data, len);
+                return ;
+            }
+            out.append('"');
+            json(out, data, len);
+            out.append('"');
+        }
+        //Keys can't be quoted: space, '=', '"' and control characters become '_', an empty key is "_"
+        static void logfmtKey(FmtBuffer& out, const char* data, size_t len)
+        {
+            if (len == 0) out.append('_');
+            for (size_t i = 0; i < len; ++i)
+            {
+                unsigned char c = data[i];
+                out.append(c <= ' ' || c == '=' || c == '"' || c == 0x7f ? '_' : (char)c);
+            }
+        }
+    private:
+        static void escape(FmtBuffer& out, unsigned char c)
+        {
+            switch (c)
+            {
+            case '"': out.append("\\\"", 2); return ;
+            case '\\': out.append("\\\\", 2); return ;
+            case '\n': out.append("\\n", 2); return ;
+            case '\r': out.append("\\r", 2); return ;
+            case '\t': out.append("\\t", 2); return ;
+            default:
+                char buf[6] = {'\\', 'u', '0', '0', "0123456789abcdef"[c >> 4], "0123456789abcdef"[c & 0xf]};
+                out.append(buf, 6);
+            }
+        }
+    };
+
+    /*
+        JSON:   {"time":"2024-01-20T10:00:00.123+08:00","level":"Info","logger":"root","tid":1234,"thread":"main",
+                 "file":"main.cc","line":10,"msg":"...",<fields>}
+        logfmt: time=2024-01-20T10:00:00.123+08:00 level=Info logger=root tid=1234 thread=main file=main.cc line=10 msg=... <fields>
+        Fields are constant key/value pairs appended to every line (service, host...)
+        logfmt has no quoting for keys: bytes a key can't hold become '_'
+    */
+    class StructuredFormatter : public Formatter
+    {
+    public:
+        using ptr = std::shared_ptr<StructuredFormatter>;
+        using Fields = std::vector<std::pair<std::string, std::string>>;
+
+        enum class Style
+        {
+            JSON,
+            LOGFMT
+        };
+
+        StructuredFormatter(Style style = Style::JSON, const Fields& fields = Fields())
+            : Formatter(style == Style::JSON ? "json" : "logfmt", Unparsed()), _style(style),
+              _time("%Y-%m-%dT%H:%M:%S.%3N%:z")
+        {
+            //The fields never change, so they are escaped once here
+            FmtBuffer buf;
+            for (auto& kv : fields)
+            {
+                if (_style == Style::JSON)
+                {
+                    buf.append(",\"", 2);
+                    Escaper::json(buf, kv.first.c_str(), kv.first.size());
+                    buf.append("\":\"", 3);
+                    Escaper::json(buf, kv.second.c_str(), kv.second.size());
+                    buf.append('"');
+                }
+                else
+                {
+                    buf.append(' ');
+                    Escaper::logfmtKey(buf, kv.first.c_str(), kv.first.size());
+                    buf.append('=');
+                    Escaper::logfmt(buf, kv.second.c_str(), kv.second.size());
+                }
+            }
+            _fields.assign(buf.data(), buf.size());
+        }
+
+        using Formatter::format;
+
+        void format(FmtBuffer& out, const LogMsg& msg) override
+        {
+            if (_style == Style::JSON) formatJson(out, msg);
+            else formatLogfmt(out, msg);
+        }
+    private:
+        void formatJson(FmtBuffer& out, const LogMsg& msg)
+        {
+            out.append("{\"time\":\"", 9);
+            _time.format(out, msg._ctime, msg._nsec);
+            out.append("\",\"level\":\"", 11);
+            out.append(LogLevel::toString(msg._level));
+            out.append("\",\"logger\":\"", 12);
+            Escaper::json(out, msg._name.data(), msg._name.size());
+            out.append("\",\"tid\":", 8);
+            ArgWriter::writeSigned(out, msg._tid);
+            if (msg._tname.empty() == false)
+            {
+                out.append(",\"thread\":\"", 11);
+                Escaper::json(out, msg._tname.data(), msg._tname.size());
+                out.append('"');
+            }
+            out.append(",\"file\":\"", 9);
+            Escaper::json(out, msg._file.data(), msg._file.size());
+            out.append("\",\"line\":", 9);
+            ArgWriter::writeUnsigned(out, msg._line);
+            out.append(",\"msg\":\"", 8);
+            Escaper::json(out, msg._payload.data(), msg._payload.size());
+            out.append('"');
+            out.append(_fields.data(), _fields.size());
+            out.append("}\n", 2);
+        }
+
+        void formatLogfmt(FmtBuffer& out, const LogMsg& msg)
+        {
+            out.append("time=", 5);
+            _time.format(out, msg._ctime, msg._nsec);
+            out.append(" level=", 7);
+            out.append(LogLevel::toString(msg._level));
+            out.append(" logger=", 8);
+            Escaper::logfmt(out, msg._name.data(), msg._name.size());
+            out.append(" tid=", 5);
+            ArgWriter::writeSigned(out, msg._tid);
+            if (msg._tname.empty() == false)
+            {
+                out.append(" thread=", 8);
+                Escaper::logfmt(out, msg._tname.data(), msg._tname.size());
+            }
+            out.append(" file=", 6);
+            Escaper::logfmt(out, msg._file.data(), msg._file.size());
+            out.append(" line=", 6);
+            ArgWriter::writeUnsigned(out, msg._line);
+            out.append(" msg=", 5);
+            Escaper::logfmt(out, msg._payload.data(), msg._payload.size());
+            out.append(_fields.data(), _fields.size());
+            out.append('\n');
+        }
+    private:
+        Style _style;
+        TimeFormat _time;
+        std::string _fields;//Pre-rendered user fields
+    };
+}
+
+#endif
@@ -6,22 +6,136 @@
     2、Determine whether the file exists
     3、Get file path
     4、Create directory
+    5、Borrowed string view
+    6、Cached kernel thread id and thread name
+    7、Write a whole buffer to a file descriptor
 */
 
 #include <iostream>
 #include <ctime>
+#include <cstring>
+#include <cstdint>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <cerrno>
 
 namespace Logs
 {
     namespace LogUtil
     {
+        //Non-owning reference to characters that live somewhere else (C++11 has no std::string_view)
+        //The referenced data must outlive the view
+        class StrView
+        {
+        public:
+            StrView() : _data(""), _size(0) {}
+            StrView(const char* str) : _data(str), _size(strlen(str)) {}
+            StrView(const char* str, size_t len) : _data(str), _size(len) {}
+            StrView(const std::string& str) : _data(str.data()), _size(str.size()) {}
+
+            const char* data() const {return _data; }
+            size_t size() const {return _size; }
+            bool empty() const {return _size == 0; }
+            std::string str() const {return std::string(_data, _size); }
+        private:
+            const char* _data;
+            size_t _size;
+        };
+
+        inline std::ostream& operator<<(std::ostream& out, const StrView& sv)
+        {
+            return out.write(sv.data(), sv.size());
+        }
+
         class Date
         {
         public:
             static time_t now() {return time(nullptr); }//Get system time
+
+            //Get system time with nanoseconds, CLOCK_REALTIME is served from the vDSO without a syscall
+            static time_t now(long& nsec)
+            {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                nsec = ts.tv_nsec;
+                return ts.tv_sec;
+            }
+
+            //Monotonic nanoseconds, for ordering records from different threads
+            static uint64_t steady()
+            {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            }
+        };
+
+        class Thread
+        {
+        public:
+            //Looked up once per thread, the digits are converted at the same time
+            struct Info
+            {
+                pid_t _tid;
+                char _tid_str[16];
+                size_t _tid_len;
+                char _name[16];//pthread names are at most 15 characters
+                size_t _name_len;
+            };
+
+            //Kernel thread id, the number shown by top -H, perf and gdb
+            static pid_t tid() {return info()._tid; }
+            static StrView tidText() {return StrView(info()._tid_str, info()._tid_len); }
+            static StrView name() {return StrView(info()._name, info()._name_len); }
+
+            //Name the calling thread, longer names are cut to 15 characters
+            static void setName(const std::string& name)
+            {
+                Info& in = info();
+                in._name_len = name.size() < 15 ? name.size() : 15;
+                memcpy(in._name, name.c_str(), in._name_len);
+                in._name[in._name_len] = '\0';
+                pthread_setname_np(pthread_self(), in._name);
+            }
+
+            static Info& info()
+            {
+                static thread_local Info in = load();
+                return in;
+            }
+        private:
+            static Info load()
+            {
+                Info in;
+                //glibc before 2.30 has no gettid wrapper
+                in._tid = (pid_t)syscall(SYS_gettid);
+                in._tid_len = snprintf(in._tid_str, sizeof(in._tid_str), "%d", (int)in._tid);
+                //A thread nobody named carries the name of the thread that created it, most often the executable's
+                if (pthread_getname_np(pthread_self(), in._name, sizeof(in._name)) != 0
+                    || (in._tid != getpid() && inherited(in._name))) in._name[0] = '\0';
+                in._name_len = strlen(in._name);
+                return in;
+            }
+
+            //Same name as the main thread, or as the executable (cut to 15 characters like the kernel does)
+            static bool inherited(const char* name)
+            {
+                char main_name[32] = {0};
+                int fd = open("/proc/self/comm", O_RDONLY | O_CLOEXEC);
+                if (fd >= 0)
+                {
+                    ssize_t n = read(fd, main_name, sizeof(main_name) - 1);
+                    ::close(fd);
+                    if (n > 0 && main_name[n - 1] == '\n') main_name[n - 1] = '\0';
+                    if (strcmp(name, main_name) == 0) return true;
+                }
+                return strncmp(name, program_invocation_short_name, 15) == 0;
+            }
         };
 
         class File
@@ -88,6 +202,23 @@ namespace Logs
                     idx = pos + 1;
                 }
             }
+
+            //Only write(2) in a loop, usable from a signal handler. False on an error other than EINTR
+            static bool writeAll(int fd, const char* data, size_t len)
+            {
+                while (len > 0)
+                {
+                    ssize_t n = ::write(fd, data, len);
+                    if (n < 0)
+                    {
+                        if (errno == EINTR) continue;
+                        return false;
+                    }
+                    data += n;
+                    len -= n;
+                }
+                return true;
+            }
         };
     }
 }